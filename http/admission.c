@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "config.h"
+#include "tls.h"
+
+#define ADMIT_TARGET_MS 5
+#define ADMIT_INTERVAL_MS 100
+#define ADMIT_MIN_MS 1
+#define DRAIN_BUF 4096
+
+static const char overloaded[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Retry-After: 1\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+// A zero target would shed every connection that waited at all
+static long long read_ms(const char *name, long fallback) {
+	long ms = config_int(name, fallback);
+	if (ms < ADMIT_MIN_MS) {
+		printf("admission: %s %ld is too short, using %d\n", name, ms, ADMIT_MIN_MS);
+		ms = ADMIT_MIN_MS;
+	}
+	return (long long)ms * 1000;
+}
+
+void admission_init(admission_control *ac) {
+	memset(ac, 0, sizeof(*ac));
+	ac->target = read_ms("HTTP_ADMIT_TARGET_MS", ADMIT_TARGET_MS);
+	ac->interval = read_ms("HTTP_ADMIT_INTERVAL_MS", ADMIT_INTERVAL_MS);
+}
+
+long long admission_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long isqrt(unsigned long long n) {
+	unsigned long long x = n, y = (x + 1) / 2;
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+	return x;
+}
+
+// interval / sqrt(count), in 1/1024 steps to stay in integer math
+static long long control_law(admission_control *ac, long long t) {
+	return t + ac->interval * 1024 / (long long)isqrt((unsigned long long)ac->count << 20);
+}
+
+static int wait_too_long(admission_control *ac, long long sojourn, long long now) {
+	if (sojourn < ac->target) {
+		ac->first_above = 0;
+		return 0;
+	}
+	if (ac->first_above == 0) {
+		ac->first_above = now + ac->interval;
+		return 0;
+	}
+	return now >= ac->first_above;
+}
+
+int admission_should_shed(admission_control *ac, long long enqueued, long long now) {
+	int too_long = wait_too_long(ac, now - enqueued, now);
+	if (ac->dropping) {
+		if (!too_long) {
+			ac->dropping = 0;
+			return 0;
+		}
+		if (now >= ac->drop_next) {
+			ac->count++;
+			ac->drop_next = control_law(ac, ac->drop_next);
+			return 1;
+		}
+		return 0;
+	}
+	if (!too_long) {
+		return 0;
+	}
+	ac->dropping = 1;
+	// resume near the previous drop rate if the last episode ended recently
+	if (ac->count > 2 && now - ac->drop_next < 16 * ac->interval) {
+		ac->count -= 2;
+	} else {
+		ac->count = 1;
+	}
+	ac->drop_next = control_law(ac, now);
+	return 1;
+}
+
+void reject_connection(int fd, const char *response, size_t len) {
+	// a plaintext response means nothing inside a TLS session, just close
+	if (!tls_enabled()) {
+		// read what already arrived so close() sends a FIN instead of a RST
+		char buf[DRAIN_BUF];
+		while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+		send(fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		shutdown(fd, SHUT_WR);
+	}
+	close(fd);
+}
+
+void admission_reject(int fd) {
+	reject_connection(fd, overloaded, sizeof(overloaded) - 1);
+}
@@ -0,0 +1,46 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+/*
+ * Admission control for the accept queue. Instead of letting the queue
+ * (and the kernel backlog behind it) grow until clients time out, excess
+ * connections get a cheap pre-serialized 503 with Retry-After.
+ *
+ * Connections are shed when the queue is full or, CoDel style, when the
+ * time they spent queued stays above a target for a whole interval. While
+ * that lasts, one connection is shed per interval / sqrt(drops) so the
+ * queue drains back below the target without emptying it. Defaults can be
+ * overridden with HTTP_ADMIT_TARGET_MS and HTTP_ADMIT_INTERVAL_MS, both
+ * at least 1 ms.
+ *
+ * The controller isn't synchronized, callers use it under the lock that
+ * protects their queue.
+ */
+
+typedef struct {
+	long long target;       // acceptable queue wait, us
+	long long interval;     // how long the wait may stay above target, us
+	long long first_above;  // when the current excursion counts as standing, 0 if none
+	long long drop_next;    // next shed while dropping
+	unsigned int count;     // sheds in the current dropping state
+	int dropping;
+} admission_control;
+
+void admission_init(admission_control *ac);
+long long admission_now(void);
+
+/*
+ * Called once for every connection as it leaves the queue, returns 1 if it
+ * should be shed. Each call feeds the connection's wait into the state.
+ */
+int admission_should_shed(admission_control *ac, long long enqueued, long long now);
+
+// Answers 503 without blocking and closes fd.
+void admission_reject(int fd);
+
+// Sends a pre-serialized response without blocking and closes fd.
+void reject_connection(int fd, const char *response, size_t len);
+
+#endif // ADMISSION_H
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "aio-threads.h"
+
+static void cq_post(aio_completion_queue *cq, aio_task *task) {
+	task->next = NULL;
+	pthread_mutex_lock(&cq->lock);
+	if (cq->tail) {
+		cq->tail->next = task;
+	} else {
+		cq->head = task;
+	}
+	cq->tail = task;
+	pthread_mutex_unlock(&cq->lock);
+	aio_cq_wake(cq);
+}
+
+static void *aio_worker(void *arg) {
+	aio_pool *pool = arg;
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL) {
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+		}
+		aio_task *task = pool->head;
+		pool->head = task->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+
+		task->work(task);
+		cq_post(task->cq, task);
+	}
+	return NULL;
+}
+
+int aio_pool_init(aio_pool *pool, int num_threads, int max_queued) {
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->queued = 0;
+	pool->max_queued = max_queued;
+	for (int i = 0; i < num_threads; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, aio_worker, pool) != 0) {
+			perror("pthread_create aio");
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+int aio_pool_submit(aio_pool *pool, aio_task *task) {
+	task->next = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->max_queued > 0 && pool->queued >= pool->max_queued) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	if (pool->tail) {
+		pool->tail->next = task;
+	} else {
+		pool->head = task;
+	}
+	pool->tail = task;
+	pool->queued++;
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+// Wakes the reactor polling the queue's eventfd, even if nothing was posted.
+void aio_cq_wake(aio_completion_queue *cq) {
+	uint64_t one = 1;
+	if (write(cq->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		perror("write eventfd");
+	}
+}
+
+int aio_cq_init(aio_completion_queue *cq) {
+	pthread_mutex_init(&cq->lock, NULL);
+	cq->head = NULL;
+	cq->tail = NULL;
+	cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cq->efd == -1) {
+		perror("eventfd");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Called by the reactor when the eventfd is readable. Returns all completed
+ * tasks as a list in completion order.
+ */
+aio_task *aio_cq_drain(aio_completion_queue *cq) {
+	uint64_t count;
+	if (read(cq->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("read eventfd");
+	}
+
+	pthread_mutex_lock(&cq->lock);
+	aio_task *head = cq->head;
+	cq->head = NULL;
+	cq->tail = NULL;
+	pthread_mutex_unlock(&cq->lock);
+	return head;
+}
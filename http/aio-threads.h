@@ -0,0 +1,47 @@
+#ifndef AIO_THREADS_H
+#define AIO_THREADS_H
+
+#include <pthread.h>
+
+/*
+ * Pools of threads for blocking work that must not run on a reactor
+ * thread, e.g. file open/stat/read. Finished tasks are posted to the
+ * completion queue of the reactor that submitted them, which is woken up
+ * through the queue's eventfd. Work of different kinds gets pools of its
+ * own, so a slow client can't hold up tasks that only touch the disk.
+ */
+
+typedef struct aio_task aio_task;
+
+typedef struct {
+	pthread_mutex_t lock;
+	aio_task *head;
+	aio_task *tail;
+	int efd;
+} aio_completion_queue;
+
+struct aio_task {
+	void (*work)(aio_task *task);   // runs on a pool thread
+	void (*done)(aio_task *task);   // runs on the reactor once the task is drained
+	aio_completion_queue *cq;       // where the task is posted when work() returns
+	aio_task *next;
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	aio_task *head;
+	aio_task *tail;
+	int queued;
+	int max_queued;     // tasks waiting beyond this are refused, 0 for no limit
+} aio_pool;
+
+int aio_pool_init(aio_pool *pool, int num_threads, int max_queued);
+// Returns -1 if the pool's queue is full, the task isn't queued then.
+int aio_pool_submit(aio_pool *pool, aio_task *task);
+
+int aio_cq_init(aio_completion_queue *cq);
+aio_task *aio_cq_drain(aio_completion_queue *cq);
+void aio_cq_wake(aio_completion_queue *cq);
+
+#endif // AIO_THREADS_H
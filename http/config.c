@@ -0,0 +1,25 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "config.h"
+
+const char *config_string(const char *name, const char *fallback) {
+	const char *value = getenv(name);
+	return value && *value ? value : fallback;
+}
+
+long config_int(const char *name, long fallback) {
+	const char *value = getenv(name);
+	if (!value || !*value) {
+		return fallback;
+	}
+	char *end;
+	errno = 0;
+	long n = strtol(value, &end, 10);
+	if (errno != 0 || *end != '\0') {
+		fprintf(stderr, "config: ignoring invalid %s=%s\n", name, value);
+		return fallback;
+	}
+	return n;
+}
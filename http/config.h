@@ -0,0 +1,12 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * Runtime settings are read from the environment, e.g.
+ * HTTP_TLS_CERT=certs/server.crt ./hybrid/http-server.r
+ */
+
+const char *config_string(const char *name, const char *fallback);
+long config_int(const char *name, long fallback);
+
+#endif // CONFIG_H
@@ -5,9 +5,16 @@
 #define HTTP_STATIC_DIR "./static"
 #define SAFE_PATH_MAX 512
 
+// Packed static dir, built with `make pack`
+#define HTTP_STATIC_PACK "./static.pack"
+
 // Default files
 #define INDEX_FILE      "./static/index.html"
 #define NOTFOUND_FILE   "./static/404.html"
 #define SERVER_ERROR_FILE   "./static/500.html"
 
+// Request bodies
+#define HTTP_UPLOAD_DIR "./uploads"
+#define MAX_BODY_SIZE   (64 * 1024 * 1024)
+
 #endif
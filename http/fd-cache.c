@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fd-cache.h"
+
+#define FD_CACHE_SHARDS 16
+#define FD_CACHE_BUCKETS 64
+#define FD_CACHE_SHARD_SIZE 64
+#define FD_CACHE_TTL_MS 5000
+
+typedef struct {
+	pthread_mutex_t lock;
+	fd_cache_entry *buckets[FD_CACHE_BUCKETS];
+	fd_cache_entry *lru_head;   // most recently used
+	fd_cache_entry *lru_tail;
+	int count;
+} fd_cache_shard;
+
+static fd_cache_shard shards[FD_CACHE_SHARDS] = {
+	[0 ... FD_CACHE_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long hash_path(const char *path) {
+	unsigned long hash = 14695981039346656037UL;
+	for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+static fd_cache_shard *shard_of(unsigned long hash) {
+	return &shards[hash % FD_CACHE_SHARDS];
+}
+
+static fd_cache_entry **bucket_of(fd_cache_shard *shard, unsigned long hash) {
+	return &shard->buckets[(hash / FD_CACHE_SHARDS) % FD_CACHE_BUCKETS];
+}
+
+static void free_entry(fd_cache_entry *entry) {
+	if (entry->fd != -1) {
+		close(entry->fd);
+	}
+	free(entry->path);
+	free(entry);
+}
+
+static void lru_unlink(fd_cache_shard *shard, fd_cache_entry *entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else shard->lru_head = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else shard->lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push_front(fd_cache_shard *shard, fd_cache_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+	if (shard->lru_head) shard->lru_head->lru_prev = entry;
+	shard->lru_head = entry;
+	if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+// Takes the entry out of the cache; it is freed once the last user releases it.
+static void remove_entry(fd_cache_shard *shard, fd_cache_entry *entry) {
+	fd_cache_entry **link = bucket_of(shard, entry->hash);
+	while (*link && *link != entry) {
+		link = &(*link)->next;
+	}
+	if (*link) *link = entry->next;
+	lru_unlink(shard, entry);
+	shard->count--;
+	entry->cached = 0;
+	if (entry->refs == 0) {
+		free_entry(entry);
+	}
+}
+
+static fd_cache_entry *find_entry(fd_cache_shard *shard, unsigned long hash, const char *path) {
+	for (fd_cache_entry *e = *bucket_of(shard, hash); e; e = e->next) {
+		if (e->hash == hash && strcmp(e->path, path) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void insert_entry(fd_cache_shard *shard, fd_cache_entry *entry) {
+	while (shard->count >= FD_CACHE_SHARD_SIZE && shard->lru_tail) {
+		remove_entry(shard, shard->lru_tail);
+	}
+	fd_cache_entry **bucket = bucket_of(shard, entry->hash);
+	entry->next = *bucket;
+	*bucket = entry;
+	lru_push_front(shard, entry);
+	shard->count++;
+	entry->cached = 1;
+}
+
+// Checks an expired entry against the filesystem without opening the file again.
+static int still_valid(fd_cache_entry *entry) {
+	struct stat sb;
+	if (stat(entry->path, &sb) == -1) {
+		return entry->fd == -1 && errno == entry->error;
+	}
+	if (entry->fd == -1) {
+		return 0;
+	}
+	return sb.st_ino == entry->sb.st_ino && sb.st_dev == entry->sb.st_dev &&
+		sb.st_size == entry->sb.st_size &&
+		sb.st_mtim.tv_sec == entry->sb.st_mtim.tv_sec &&
+		sb.st_mtim.tv_nsec == entry->sb.st_mtim.tv_nsec;
+}
+
+static fd_cache_entry *open_entry(const char *path, unsigned long hash) {
+	fd_cache_entry *entry = calloc(1, sizeof(fd_cache_entry));
+	if (!entry) return NULL;
+	entry->path = strdup(path);
+	entry->hash = hash;
+	entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (entry->fd == -1) {
+		entry->error = errno;
+	} else if (fstat(entry->fd, &entry->sb) == -1) {
+		entry->error = errno;
+		close(entry->fd);
+		entry->fd = -1;
+	}
+	entry->expires = now_ms() + FD_CACHE_TTL_MS;
+	return entry;
+}
+
+/*
+ * Returns the cached entry for path, opening the file on a miss. The caller
+ * owns a reference and must hand it back with fd_cache_release().
+ */
+fd_cache_entry *fd_cache_acquire(const char *path) {
+	unsigned long hash = hash_path(path);
+	fd_cache_shard *shard = shard_of(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	fd_cache_entry *entry = find_entry(shard, hash, path);
+	if (entry && entry->expires > now_ms()) {
+		entry->refs++;
+		lru_unlink(shard, entry);
+		lru_push_front(shard, entry);
+		pthread_mutex_unlock(&shard->lock);
+		return entry;
+	}
+	if (entry) {
+		// pin the expired entry while revalidating outside the lock
+		entry->refs++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (entry) {
+		int valid = still_valid(entry);
+		pthread_mutex_lock(&shard->lock);
+		if (valid && entry->cached) {
+			entry->expires = now_ms() + FD_CACHE_TTL_MS;
+			pthread_mutex_unlock(&shard->lock);
+			return entry;
+		}
+		if (entry->cached) {
+			remove_entry(shard, entry);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		fd_cache_release(entry);
+	}
+
+	// open outside the lock so a slow open doesn't stall the whole shard
+	fd_cache_entry *fresh = open_entry(path, hash);
+	if (!fresh) return NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	entry = find_entry(shard, hash, path);
+	if (entry) {
+		// another thread cached the file first
+		entry->refs++;
+		pthread_mutex_unlock(&shard->lock);
+		free_entry(fresh);
+		return entry;
+	}
+	fresh->refs = 1;
+	insert_entry(shard, fresh);
+	pthread_mutex_unlock(&shard->lock);
+	return fresh;
+}
+
+void fd_cache_release(fd_cache_entry *entry) {
+	if (!entry) return;
+	fd_cache_shard *shard = shard_of(entry->hash);
+	pthread_mutex_lock(&shard->lock);
+	entry->refs--;
+	int dead = entry->refs == 0 && !entry->cached;
+	pthread_mutex_unlock(&shard->lock);
+	if (dead) {
+		free_entry(entry);
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <sys/stat.h>
+
+/*
+ * Cache of open file descriptors and their stat results, keyed by the
+ * normalized file path. Failed opens (ENOENT, ...) are cached too, so
+ * repeated requests for missing files don't reach the filesystem.
+ *
+ * Entries are revalidated against the filesystem once their TTL expires.
+ * An entry returned by fd_cache_acquire() stays valid until it is
+ * released, even if it is evicted in the meantime.
+ */
+
+typedef struct fd_cache_entry fd_cache_entry;
+
+struct fd_cache_entry {
+	char *path;
+	unsigned long hash;
+	int fd;             // -1 for a negative entry
+	int error;          // errno of the failed open for negative entries
+	struct stat sb;
+	long long expires;  // monotonic ms
+	int refs;
+	int cached;         // still reachable through the cache
+	fd_cache_entry *next;
+	fd_cache_entry *lru_prev;
+	fd_cache_entry *lru_next;
+};
+
+fd_cache_entry *fd_cache_acquire(const char *path);
+void fd_cache_release(fd_cache_entry *entry);
+
+#endif // FD_CACHE_H
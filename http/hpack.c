@@ -0,0 +1,563 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define HPACK_STATIC_COUNT 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HUFFMAN_EOS 256
+
+typedef struct {
+	const char *name;
+	const char *value;
+} hpack_static_entry;
+
+static const hpack_static_entry static_table[HPACK_STATIC_COUNT] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+
+typedef struct {
+	uint32_t code;
+	uint8_t len;
+} huffman_code;
+
+static const huffman_code huffman_codes[257] = {
+	{0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+	{0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+	{0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+	{0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+	{0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+	{0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+	{0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+	{0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+	{0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+	{0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+	{0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+	{0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+	{0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+	{0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+	{0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+	{0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+	{0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+	{0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+	{0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+	{0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+	{0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+	{0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+	{0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+	{0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+	{0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+	{0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+	{0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+	{0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+	{0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+	{0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+	{0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+	{0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+	{0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+	{0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+	{0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+	{0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+	{0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+	{0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+	{0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+	{0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+	{0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+	{0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+	{0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+	{0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+	{0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+	{0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+	{0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+	{0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+	{0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+	{0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+	{0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+	{0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+	{0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+	{0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+	{0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+	{0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+	{0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+	{0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+	{0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+	{0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+	{0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+	{0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+	{0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+	{0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+	{0x3fffffff, 30}  // EOS
+};
+
+/*
+ * Decoding tree for the Huffman code: a positive child is the index of an
+ * inner node, a negative child -(sym + 1) is a leaf and 0 is unused.
+ */
+static short huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tree(void) {
+	int nodes = 1;
+	for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+		uint32_t code = huffman_codes[sym].code;
+		int node = 0;
+		for (int bit = huffman_codes[sym].len - 1; bit > 0; bit--) {
+			int b = (code >> bit) & 1;
+			if (huffman_tree[node][b] == 0) {
+				huffman_tree[node][b] = nodes++;
+			}
+			node = huffman_tree[node][b];
+		}
+		huffman_tree[node][code & 1] = -(sym + 1);
+	}
+}
+
+int hpack_buf_append(hpack_buf *buf, const void *data, size_t len) {
+	if (buf->len + len > buf->cap) {
+		size_t new_cap = buf->cap ? buf->cap : 256;
+		while (buf->len + len > new_cap) {
+			new_cap *= 2;
+		}
+		unsigned char *tmp = realloc(buf->data, new_cap);
+		if (!tmp) return -1;
+		buf->data = tmp;
+		buf->cap = new_cap;
+	}
+	if (len > 0) {
+		memcpy(buf->data + buf->len, data, len);
+	}
+	buf->len += len;
+	return 0;
+}
+
+void hpack_buf_free(hpack_buf *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->cap = 0;
+}
+
+static int huffman_decode(const unsigned char *src, size_t len, hpack_buf *out) {
+	pthread_once(&huffman_once, build_huffman_tree);
+
+	int node = 0;
+	int depth = 0;
+	int all_ones = 1;
+	for (size_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			int b = (src[i] >> bit) & 1;
+			int next = huffman_tree[node][b];
+			if (next == 0) return -1;
+			if (next < 0) {
+				int sym = -next - 1;
+				if (sym == HUFFMAN_EOS) return -1;
+				unsigned char c = sym;
+				if (hpack_buf_append(out, &c, 1) == -1) return -1;
+				node = 0;
+				depth = 0;
+				all_ones = 1;
+			} else {
+				node = next;
+				depth++;
+				all_ones = all_ones && b;
+			}
+		}
+	}
+	// the remainder must be a prefix of EOS: at most 7 one bits
+	if (depth > 7 || !all_ones) return -1;
+	return 0;
+}
+
+static size_t huffman_length(const char *src, size_t len) {
+	size_t bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		bits += huffman_codes[(unsigned char)src[i]].len;
+	}
+	return (bits + 7) / 8;
+}
+
+static int huffman_encode(const char *src, size_t len, hpack_buf *out) {
+	uint64_t acc = 0;
+	int bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		const huffman_code *hc = &huffman_codes[(unsigned char)src[i]];
+		acc = (acc << hc->len) | hc->code;
+		bits += hc->len;
+		while (bits >= 8) {
+			unsigned char c = acc >> (bits - 8);
+			if (hpack_buf_append(out, &c, 1) == -1) return -1;
+			bits -= 8;
+		}
+	}
+	if (bits > 0) {
+		// pad with the most significant bits of EOS
+		unsigned char c = (acc << (8 - bits)) | (0xff >> bits);
+		if (hpack_buf_append(out, &c, 1) == -1) return -1;
+	}
+	return 0;
+}
+
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+	if (*p >= end) return -1;
+	size_t max = (1u << prefix) - 1;
+	size_t v = **p & max;
+	(*p)++;
+	if (v < max) {
+		*value = v;
+		return 0;
+	}
+	for (int shift = 0; *p < end && shift <= 28; shift += 7) {
+		unsigned char b = **p;
+		(*p)++;
+		v += (size_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*value = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int encode_int(hpack_buf *out, unsigned char first, int prefix, size_t value) {
+	size_t max = (1u << prefix) - 1;
+	unsigned char c;
+	if (value < max) {
+		c = first | value;
+		return hpack_buf_append(out, &c, 1);
+	}
+	c = first | max;
+	if (hpack_buf_append(out, &c, 1) == -1) return -1;
+	value -= max;
+	while (value >= 128) {
+		c = (value & 0x7f) | 0x80;
+		if (hpack_buf_append(out, &c, 1) == -1) return -1;
+		value >>= 7;
+	}
+	c = value;
+	return hpack_buf_append(out, &c, 1);
+}
+
+// Decodes a string literal into out, which is reset and NUL-terminated.
+static int decode_string(const unsigned char **p, const unsigned char *end, hpack_buf *out) {
+	if (*p >= end) return -1;
+	int huffman = **p & 0x80;
+	size_t len;
+	if (decode_int(p, end, 7, &len) == -1 || len > (size_t)(end - *p)) return -1;
+
+	out->len = 0;
+	if (huffman) {
+		if (huffman_decode(*p, len, out) == -1) return -1;
+	} else if (hpack_buf_append(out, *p, len) == -1) {
+		return -1;
+	}
+	*p += len;
+
+	if (hpack_buf_append(out, "", 1) == -1) return -1;
+	out->len--;
+	return 0;
+}
+
+static int encode_string(hpack_buf *out, const char *str, size_t len) {
+	size_t huffman_len = huffman_length(str, len);
+	if (huffman_len < len) {
+		if (encode_int(out, 0x80, 7, huffman_len) == -1) return -1;
+		return huffman_encode(str, len, out);
+	}
+	if (encode_int(out, 0x00, 7, len) == -1) return -1;
+	return hpack_buf_append(out, str, len);
+}
+
+void hpack_table_init(hpack_table *table, size_t limit) {
+	memset(table, 0, sizeof(*table));
+	table->max_size = limit;
+	table->limit = limit;
+}
+
+static hpack_entry *table_entry(hpack_table *table, size_t i) {
+	return &table->entries[(table->first + i) % table->cap];
+}
+
+static void evict_oldest(hpack_table *table) {
+	hpack_entry *e = table_entry(table, table->count - 1);
+	table->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+	free(e->name);
+	free(e->value);
+	table->count--;
+}
+
+static void table_evict(hpack_table *table, size_t max_size) {
+	while (table->count > 0 && table->size > max_size) {
+		evict_oldest(table);
+	}
+}
+
+void hpack_table_free(hpack_table *table) {
+	while (table->count > 0) {
+		evict_oldest(table);
+	}
+	free(table->entries);
+	table->entries = NULL;
+	table->cap = 0;
+}
+
+/*
+ * Called when the peer changes SETTINGS_HEADER_TABLE_SIZE. An encoder table
+ * announces its new size at the start of the next header block.
+ */
+void hpack_table_set_limit(hpack_table *table, size_t limit) {
+	table->limit = limit;
+	if (table->max_size != limit) {
+		table->max_size = limit;
+		table_evict(table, limit);
+		table->update_pending = 1;
+	}
+}
+
+static int table_add(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len) {
+	size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	if (entry_size > table->max_size) {
+		// an entry larger than the table empties it
+		table_evict(table, 0);
+		return 0;
+	}
+	table_evict(table, table->max_size - entry_size);
+
+	if (table->count == table->cap) {
+		size_t new_cap = table->cap ? table->cap * 2 : 16;
+		hpack_entry *tmp = malloc(sizeof(hpack_entry) * new_cap);
+		if (!tmp) return -1;
+		for (size_t i = 0; i < table->count; i++) {
+			tmp[i] = *table_entry(table, i);
+		}
+		free(table->entries);
+		table->entries = tmp;
+		table->cap = new_cap;
+		table->first = 0;
+	}
+
+	table->first = (table->first + table->cap - 1) % table->cap;
+	hpack_entry *e = &table->entries[table->first];
+	e->name = strndup(name, name_len);
+	e->value = strndup(value, value_len);
+	e->name_len = name_len;
+	e->value_len = value_len;
+	table->count++;
+	table->size += entry_size;
+	return 0;
+}
+
+static int lookup_index(hpack_table *table, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len) {
+	if (index == 0) return -1;
+	if (index <= HPACK_STATIC_COUNT) {
+		*name = static_table[index - 1].name;
+		*name_len = strlen(*name);
+		*value = static_table[index - 1].value;
+		*value_len = strlen(*value);
+		return 0;
+	}
+	index -= HPACK_STATIC_COUNT + 1;
+	if (index >= table->count) return -1;
+	hpack_entry *e = table_entry(table, index);
+	*name = e->name;
+	*name_len = e->name_len;
+	*value = e->value;
+	*value_len = e->value_len;
+	return 0;
+}
+
+/*
+ * Decodes one complete header block, calling cb for every header field in
+ * order. Returns -1 on a compression error, which is fatal for the
+ * connection.
+ */
+int hpack_decode(hpack_table *table, const unsigned char *buf, size_t len, hpack_header_cb cb, void *ctx) {
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+	hpack_buf name_buf = {0};
+	hpack_buf value_buf = {0};
+	int status = 0;
+	int fields_seen = 0;
+
+	while (p < end && status == 0) {
+		unsigned char c = *p;
+		size_t index;
+		const char *name, *value;
+		size_t name_len, value_len;
+
+		if (c & 0x80) {
+			// indexed header field
+			if (decode_int(&p, end, 7, &index) == -1 ||
+			    lookup_index(table, index, &name, &name_len, &value, &value_len) == -1) {
+				status = -1;
+				break;
+			}
+			// copy, the callback may outlive a later eviction of the entry
+			name_buf.len = 0;
+			value_buf.len = 0;
+			if (hpack_buf_append(&name_buf, name, name_len) == -1 || hpack_buf_append(&name_buf, "", 1) == -1 ||
+			    hpack_buf_append(&value_buf, value, value_len) == -1 || hpack_buf_append(&value_buf, "", 1) == -1) {
+				status = -1;
+				break;
+			}
+			status = cb((char *)name_buf.data, name_len, (char *)value_buf.data, value_len, ctx);
+			fields_seen = 1;
+			continue;
+		}
+
+		if ((c & 0xe0) == 0x20) {
+			// dynamic table size update, only allowed before the first field
+			size_t new_size;
+			if (fields_seen || decode_int(&p, end, 5, &new_size) == -1 || new_size > table->limit) {
+				status = -1;
+				break;
+			}
+			table->max_size = new_size;
+			table_evict(table, new_size);
+			continue;
+		}
+
+		int incremental = (c & 0xc0) == 0x40;
+		int prefix = incremental ? 6 : 4;
+		if (decode_int(&p, end, prefix, &index) == -1) {
+			status = -1;
+			break;
+		}
+		if (index == 0) {
+			if (decode_string(&p, end, &name_buf) == -1) {
+				status = -1;
+				break;
+			}
+		} else {
+			if (lookup_index(table, index, &name, &name_len, &value, &value_len) == -1) {
+				status = -1;
+				break;
+			}
+			name_buf.len = 0;
+			if (hpack_buf_append(&name_buf, name, name_len) == -1 || hpack_buf_append(&name_buf, "", 1) == -1) {
+				status = -1;
+				break;
+			}
+			name_buf.len--;
+		}
+		if (decode_string(&p, end, &value_buf) == -1) {
+			status = -1;
+			break;
+		}
+		name_len = index == 0 ? name_buf.len : name_len;
+		if (incremental && table_add(table, (char *)name_buf.data, name_len, (char *)value_buf.data, value_buf.len) == -1) {
+			status = -1;
+			break;
+		}
+		status = cb((char *)name_buf.data, name_len, (char *)value_buf.data, value_buf.len, ctx);
+		fields_seen = 1;
+	}
+
+	hpack_buf_free(&name_buf);
+	hpack_buf_free(&value_buf);
+	return status;
+}
+
+/*
+ * Appends one header field to out. Exact matches become a single index;
+ * other fields are added to the dynamic table, except for values that
+ * change with every response.
+ */
+int hpack_encode(hpack_table *table, hpack_buf *out, const char *name, const char *value) {
+	if (table->update_pending) {
+		if (encode_int(out, 0x20, 5, table->max_size) == -1) return -1;
+		table->update_pending = 0;
+	}
+
+	size_t name_len = strlen(name);
+	size_t value_len = strlen(value);
+	size_t name_index = 0;
+
+	for (size_t i = 0; i < HPACK_STATIC_COUNT; i++) {
+		if (strcmp(static_table[i].name, name) != 0) continue;
+		if (strcmp(static_table[i].value, value) == 0) {
+			return encode_int(out, 0x80, 7, i + 1);
+		}
+		if (name_index == 0) name_index = i + 1;
+	}
+	for (size_t i = 0; i < table->count; i++) {
+		hpack_entry *e = table_entry(table, i);
+		if (e->name_len != name_len || memcmp(e->name, name, name_len) != 0) continue;
+		if (e->value_len == value_len && memcmp(e->value, value, value_len) == 0) {
+			return encode_int(out, 0x80, 7, HPACK_STATIC_COUNT + 1 + i);
+		}
+		if (name_index == 0) name_index = HPACK_STATIC_COUNT + 1 + i;
+	}
+
+	int incremental = strcmp(name, "content-length") != 0 &&
+		name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size / 4;
+	if (encode_int(out, incremental ? 0x40 : 0x00, incremental ? 6 : 4, name_index) == -1) return -1;
+	if (name_index == 0 && encode_string(out, name, name_len) == -1) return -1;
+	if (encode_string(out, value, value_len) == -1) return -1;
+
+	if (incremental) {
+		return table_add(table, name, name_len, value, value_len);
+	}
+	return 0;
+}
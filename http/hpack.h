@@ -0,0 +1,49 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541): the static table, a
+ * dynamic table per direction, integer and string coding with Huffman.
+ */
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+} hpack_buf;
+
+typedef struct {
+	char *name;
+	char *value;
+	size_t name_len;
+	size_t value_len;
+} hpack_entry;
+
+typedef struct {
+	hpack_entry *entries;   // ring buffer, entries[first] is the newest
+	size_t first;
+	size_t count;
+	size_t cap;
+	size_t size;            // sum of entry sizes as defined by the RFC
+	size_t max_size;        // current maximum, changed by table size updates
+	size_t limit;           // upper bound for max_size agreed through SETTINGS
+	int update_pending;     // encoder only: announce max_size in the next block
+} hpack_table;
+
+typedef int (*hpack_header_cb)(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx);
+
+int hpack_buf_append(hpack_buf *buf, const void *data, size_t len);
+void hpack_buf_free(hpack_buf *buf);
+
+void hpack_table_init(hpack_table *table, size_t limit);
+void hpack_table_free(hpack_table *table);
+void hpack_table_set_limit(hpack_table *table, size_t limit);
+
+int hpack_decode(hpack_table *table, const unsigned char *buf, size_t len, hpack_header_cb cb, void *ctx);
+int hpack_encode(hpack_table *table, hpack_buf *out, const char *name, const char *value);
+
+#endif // HPACK_H
@@ -0,0 +1,329 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include "http-body.h"
+#include "constants.h"
+#include "tcp.h"
+
+#define BODY_BUF_SIZE 16384
+#define SPLICE_CHUNK (64 * 1024)
+#define READ_TIMEOUT 30000
+
+enum {
+	BODY_DATA,
+	BODY_DONE,
+	CHUNK_SIZE,
+	CHUNK_EXT,
+	CHUNK_SIZE_LF,
+	CHUNK_DATA_CR,
+	CHUNK_DATA_LF,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE,
+	CHUNK_TRAILER_LF
+};
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Sets up the decoder from the framing headers of a message, either of
+ * which may be NULL. Returns 0 or the HTTP status to answer with.
+ */
+int http_body_init_framing(http_body_decoder *decoder, const char *transfer_encoding, const char *content_length, size_t limit) {
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->limit = limit;
+	decoder->state = BODY_DONE;
+	decoder->encoding = BODY_NONE;
+
+	if (transfer_encoding) {
+		if (strcasecmp(transfer_encoding, "chunked") != 0) {
+			return 501;
+		}
+		decoder->encoding = BODY_CHUNKED;
+		decoder->state = CHUNK_SIZE;
+		return 0;
+	}
+
+	if (!content_length) {
+		return 0;
+	}
+
+	char *end;
+	errno = 0;
+	unsigned long long length = strtoull(content_length, &end, 10);
+	if (errno != 0 || end == content_length || *end != '\0' || content_length[0] == '-') {
+		return 400;
+	}
+	if (length > decoder->limit) {
+		return 413;
+	}
+
+	decoder->encoding = BODY_CONTENT_LENGTH;
+	decoder->remaining = length;
+	decoder->state = length > 0 ? BODY_DATA : BODY_DONE;
+	return 0;
+}
+
+int http_body_init(http_body_decoder *decoder, http_request *request) {
+	return http_body_init_framing(decoder,
+		http_get_header(request, "Transfer-Encoding"),
+		http_get_header(request, "Content-Length"),
+		MAX_BODY_SIZE);
+}
+
+int http_body_done(http_body_decoder *decoder) {
+	return decoder->state == BODY_DONE;
+}
+
+static ssize_t body_fail(http_body_decoder *decoder, int status) {
+	decoder->error = status;
+	return -1;
+}
+
+/*
+ * Feeds raw bytes from the connection into the decoder. Returns the number
+ * of bytes consumed, which is less than len once the body is complete.
+ */
+ssize_t http_body_feed(http_body_decoder *decoder, const char *buf, size_t len, http_body_cb cb, void *ctx) {
+	size_t i = 0;
+	while (i < len && decoder->state != BODY_DONE) {
+		char c;
+		switch (decoder->state) {
+		case BODY_DATA: {
+			size_t n = len - i;
+			if (n > decoder->remaining) n = decoder->remaining;
+			if (cb(buf + i, n, ctx) == -1) {
+				return body_fail(decoder, 500);
+			}
+			i += n;
+			decoder->remaining -= n;
+			decoder->received += n;
+			if (decoder->remaining == 0) {
+				decoder->state = decoder->encoding == BODY_CHUNKED ? CHUNK_DATA_CR : BODY_DONE;
+			}
+			break;
+		}
+		case CHUNK_SIZE:
+			c = buf[i++];
+			if (hex_value(c) >= 0) {
+				if (decoder->remaining > (SIZE_MAX >> 4)) return body_fail(decoder, 413);
+				decoder->remaining = decoder->remaining * 16 + hex_value(c);
+				decoder->digits++;
+			} else if (decoder->digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+				decoder->state = CHUNK_EXT;
+			} else if (decoder->digits > 0 && c == '\r') {
+				decoder->state = CHUNK_SIZE_LF;
+			} else {
+				return body_fail(decoder, 400);
+			}
+			break;
+		case CHUNK_EXT:
+			// chunk extensions are ignored
+			if (buf[i++] == '\r') decoder->state = CHUNK_SIZE_LF;
+			break;
+		case CHUNK_SIZE_LF:
+			if (buf[i++] != '\n') return body_fail(decoder, 400);
+			decoder->digits = 0;
+			if (decoder->remaining == 0) {
+				decoder->state = CHUNK_TRAILER;
+			} else if (decoder->remaining > decoder->limit - decoder->received) {
+				return body_fail(decoder, 413);
+			} else {
+				decoder->state = BODY_DATA;
+			}
+			break;
+		case CHUNK_DATA_CR:
+			if (buf[i++] != '\r') return body_fail(decoder, 400);
+			decoder->state = CHUNK_DATA_LF;
+			break;
+		case CHUNK_DATA_LF:
+			if (buf[i++] != '\n') return body_fail(decoder, 400);
+			decoder->state = CHUNK_SIZE;
+			break;
+		case CHUNK_TRAILER:
+			// trailer fields are skipped, an empty line ends the body
+			c = buf[i++];
+			decoder->state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (buf[i++] == '\n') decoder->state = CHUNK_TRAILER;
+			break;
+		case CHUNK_TRAILER_LF:
+			if (buf[i++] != '\n') return body_fail(decoder, 400);
+			decoder->state = BODY_DONE;
+			break;
+		}
+	}
+	return i;
+}
+
+// Answers "Expect: 100-continue" so the client starts sending the body.
+int http_send_continue(http_request *request) {
+	const char *expect = http_get_header(request, "Expect");
+	if (!expect || strcasecmp(expect, "100-continue") != 0) {
+		return 0;
+	}
+	const char *line = "HTTP/1.1 100 Continue\r\n\r\n";
+	if (write(request->fd, line, strlen(line)) == -1) {
+		perror("write 100-continue");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Streams the request body through cb as it arrives on the socket. Returns 0
+ * once the whole body has been delivered, or the HTTP status to answer with.
+ */
+int http_read_body(http_request *request, http_body_cb cb, void *ctx) {
+	http_body_decoder decoder;
+	int status = http_body_init(&decoder, request);
+	if (status != 0) {
+		return status;
+	}
+	if (http_body_done(&decoder)) {
+		return 0;
+	}
+	if (http_send_continue(request) == -1) {
+		return 500;
+	}
+
+	if (request->body_len > 0 && http_body_feed(&decoder, request->body, request->body_len, cb, ctx) == -1) {
+		return decoder.error;
+	}
+
+	char buf[BODY_BUF_SIZE];
+	while (!http_body_done(&decoder)) {
+		ssize_t nbytes = read(request->fd, buf, sizeof(buf));
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (tcp_wait(request->fd, POLLIN, READ_TIMEOUT, request->deadline) <= 0) return 408;
+				continue;
+			}
+			perror("read body");
+			return 400;
+		}
+		if (nbytes == 0) {
+			// client went away before the body was complete
+			return 400;
+		}
+		if (http_body_feed(&decoder, buf, nbytes, cb, ctx) == -1) {
+			return decoder.error;
+		}
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t nbytes = write(fd, buf, len);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+static int write_to_fd(const char *chunk, size_t len, void *ctx) {
+	int fd = *(int *)ctx;
+	if (write_all(fd, chunk, len) == -1) {
+		perror("write body");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Moves len bytes from the socket into out_fd through a pipe, so that the
+ * payload never passes through user space. A non-blocking socket is waited
+ * on until deadline.
+ */
+static int splice_to_file(int in_fd, int out_fd, size_t len, long long deadline) {
+	int pipefd[2];
+	if (pipe(pipefd) == -1) {
+		perror("pipe");
+		return 500;
+	}
+
+	int status = 0;
+	while (len > 0) {
+		size_t want = len < SPLICE_CHUNK ? len : SPLICE_CHUNK;
+		ssize_t in = splice(in_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (tcp_wait(in_fd, POLLIN, READ_TIMEOUT, deadline) <= 0) {
+					status = 408;
+					break;
+				}
+				continue;
+			}
+			perror("splice socket");
+			status = 400;
+			break;
+		}
+		if (in == 0) {
+			status = 400;
+			break;
+		}
+		len -= in;
+
+		while (in > 0) {
+			ssize_t out = splice(pipefd[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out == -1) {
+				if (errno == EINTR) continue;
+				perror("splice file");
+				status = 500;
+				break;
+			}
+			in -= out;
+		}
+		if (status != 0) break;
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return status;
+}
+
+/*
+ * Stores the request body in out_fd. Bodies with a Content-Length are
+ * spliced straight from the socket into the file; chunked bodies have to go
+ * through the decoder.
+ */
+int http_body_to_file(http_request *request, int out_fd) {
+	http_body_decoder decoder;
+	int status = http_body_init(&decoder, request);
+	if (status != 0) {
+		return status;
+	}
+	if (decoder.encoding != BODY_CONTENT_LENGTH) {
+		return http_read_body(request, write_to_fd, &out_fd);
+	}
+	if (http_send_continue(request) == -1) {
+		return 500;
+	}
+
+	size_t prefix = request->body_len < decoder.remaining ? request->body_len : decoder.remaining;
+	if (prefix > 0 && write_all(out_fd, request->body, prefix) == -1) {
+		perror("write body");
+		return 500;
+	}
+	return splice_to_file(request->fd, out_fd, decoder.remaining - prefix, request->deadline);
+}
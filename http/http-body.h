@@ -0,0 +1,42 @@
+#ifndef HTTP_BODY_H
+#define HTTP_BODY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http-parser.h"
+
+typedef enum {
+	BODY_NONE,
+	BODY_CONTENT_LENGTH,
+	BODY_CHUNKED
+} http_body_encoding;
+
+/*
+ * Incremental decoder for message bodies. Bytes can be fed in whatever
+ * pieces they arrive in; decoded body bytes are passed on to a callback
+ * as soon as they are available, so the body never has to be buffered.
+ */
+typedef struct {
+	http_body_encoding encoding;
+	int state;
+	size_t remaining;   // bytes left in the body or in the current chunk
+	size_t received;    // decoded body bytes so far
+	size_t limit;
+	int digits;
+	int error;          // HTTP status to answer with when decoding fails
+} http_body_decoder;
+
+// Called for every decoded piece of the body. Returning -1 aborts decoding.
+typedef int (*http_body_cb)(const char *chunk, size_t len, void *ctx);
+
+int http_body_init(http_body_decoder *decoder, http_request *request);
+int http_body_init_framing(http_body_decoder *decoder, const char *transfer_encoding, const char *content_length, size_t limit);
+ssize_t http_body_feed(http_body_decoder *decoder, const char *buf, size_t len, http_body_cb cb, void *ctx);
+int http_body_done(http_body_decoder *decoder);
+
+int http_send_continue(http_request *request);
+int http_read_body(http_request *request, http_body_cb cb, void *ctx);
+int http_body_to_file(http_request *request, int out_fd);
+
+#endif // HTTP_BODY_H
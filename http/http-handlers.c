@@ -1,16 +1,24 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
 
 #include "http-handlers.h"
 #include "http-parser.h"
+#include "http-body.h"
+#include "http-range.h"
+#include "fd-cache.h"
+#include "static-pack.h"
 #include "constants.h"
 
-#define TMP_BUF_SIZE 1024
+#define FILE_INLINE_MAX (64 * 1024)
 
 
 char *extract_mime_type(char *file_name) {
@@ -34,70 +42,308 @@ char *extract_mime_type(char *file_name) {
 
 }
 
+int set_content_headers(http_response *res, size_t content_length, const char *mime_type) {
+	char value_buf[21];
+	snprintf(value_buf, sizeof(value_buf), "%zu", content_length);
+	add_http_header(res, "Content-Length", value_buf);
+	add_http_header(res, "Content-Type", mime_type);
+	return 0;
+}
+
+static void http_date(time_t t, char *buf, size_t size) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// The validator If-Range is checked against, and the offer to resume
+static void add_file_headers(http_response *res, struct stat *sb) {
+	char modified[32];
+	http_date(sb->st_mtime, modified, sizeof(modified));
+	add_http_header(res, "Last-Modified", modified);
+	add_http_header(res, "Accept-Ranges", "bytes");
+}
+
 int fill_http_headers(http_response *res, struct stat *sb, char *file_name) {
+	add_file_headers(res, sb);
+	return set_content_headers(res, sb->st_size, extract_mime_type(file_name));
+}
 
-	http_header content_length;
-	content_length.key = strdup("Content-Length");
-	char value_buf[21];
-	snprintf(value_buf, sizeof(value_buf), "%lld", sb->st_size);
-	content_length.value = strdup(value_buf);
+static int etag_matches(const char *if_none_match, const char *etag, size_t etag_len) {
+	if (strcmp(if_none_match, "*") == 0) return 1;
+	return memmem(if_none_match, strlen(if_none_match), etag, etag_len) != NULL;
+}
 
-	http_header content_type;
-	content_type.key = strdup("Content-Type");
-	char *mime_type = extract_mime_type(file_name);
-	content_type.value = strdup(mime_type);
+/*
+ * Returns the ranges a GET asks for, see http_parse_range(). With If-Range
+ * the ranges only apply while it names validator exactly; NULL when the
+ * representation has no strong validator, the whole of it is sent then.
+ */
+static int requested_ranges(http_request *req, off_t size, const char *validator, http_range *ranges) {
+	if (!req || req->request.method != GET) return 0;
+	const char *range = http_get_header(req, "Range");
+	if (!range) return 0;
+	const char *if_range = http_get_header(req, "If-Range");
+	if (if_range && (!validator || strcmp(if_range, validator) != 0)) return 0;
 
+	int count = http_parse_range(range, size, ranges, HTTP_RANGES_MAX);
+	// overlapping ranges could ask for the file many times over, send it once instead
+	off_t total = 0;
+	for (int i = 0; i < count; i++) {
+		total += ranges[i].last - ranges[i].first + 1;
+	}
+	return total > size ? 0 : count;
+}
 
-	http_header *resp_headers = malloc(sizeof(http_header) * 2);
+/*
+ * The Last-Modified date as an If-Range validator. It is only strong once
+ * the file is more than a second older than now, a file written twice
+ * within the same second would otherwise keep the date and change its
+ * bytes under a resumed download.
+ */
+static const char *file_validator(struct stat *sb, char *buf, size_t size) {
+	if (sb->st_mtime + 1 >= time(NULL)) return NULL;
+	http_date(sb->st_mtime, buf, size);
+	return buf;
+}
 
-	resp_headers[0] = content_length;
-	resp_headers[1] = content_type;
-	
-	http_headers headers;
-	headers.count = 2;
-	headers.capacity = 2;
-	headers.headers = resp_headers;
+/*
+ * Serves file_name from the static pack if it was packed. The headers and
+ * the body point straight into the mapped pack. A single range is sent
+ * from the mapped body too, in place of the Content-Length line that
+ * starts every packed header block; several ranges get the whole asset.
+ */
+static int handle_packed_file(http_request *req, http_response *res, const char *file_name) {
+	size_t dir_len = strlen(HTTP_STATIC_DIR);
+	if (strncmp(file_name, HTTP_STATIC_DIR, dir_len) != 0) {
+		return -1;
+	}
+
+	const char *accept_encoding = req ? http_get_header(req, "Accept-Encoding") : NULL;
+	int accept_gzip = accept_encoding && strstr(accept_encoding, "gzip") != NULL;
+	static_pack_asset asset;
+	if (static_pack_lookup(file_name + dir_len, accept_gzip, &asset) == -1) {
+		return -1;
+	}
+
+	char etag[64];
+	snprintf(etag, sizeof(etag), "%.*s", (int)asset.etag_len, asset.etag);
+	const char *if_none_match = req ? http_get_header(req, "If-None-Match") : NULL;
+	if (if_none_match && etag_matches(if_none_match, asset.etag, asset.etag_len)) {
+		add_http_header(res, "ETag", etag);
+		return 304;
+	}
 
-	res->headers = headers;
+	http_range ranges[HTTP_RANGES_MAX];
+	int range_count = requested_ranges(req, asset.body_len, etag, ranges);
+	const char *length_end = memmem(asset.headers, asset.headers_len, "\r\n", 2);
+	if (range_count == -1) {
+		char content_range[32];
+		snprintf(content_range, sizeof(content_range), "bytes */%zu", asset.body_len);
+		add_http_header(res, "Content-Range", content_range);
+		add_http_header(res, "Content-Length", "0");
+		return 416;
+	}
+	if (range_count == 1 && length_end && strncmp(asset.headers, "Content-Length:", 15) == 0) {
+		char content_range[64];
+		char content_length[21];
+		size_t size = ranges[0].last - ranges[0].first + 1;
+		snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%zu",
+			(long long)ranges[0].first, (long long)ranges[0].last, asset.body_len);
+		snprintf(content_length, sizeof(content_length), "%zu", size);
+		add_http_header(res, "Content-Length", content_length);
+		add_http_header(res, "Content-Range", content_range);
+		length_end += 2;
+		res->raw_headers = length_end;
+		res->raw_headers_len = asset.headers + asset.headers_len - length_end;
+		res->body_ref = asset.body + ranges[0].first;
+		res->body_size = size;
+		return 206;
+	}
+
+	res->raw_headers = asset.headers;
+	res->raw_headers_len = asset.headers_len;
+	res->body_ref = asset.body;
+	res->body_size = asset.body_len;
 	return 0;
 }
 
-int handle_file(http_request *req, http_response *res, char *file_name) {
-	int fd = open(file_name, O_RDONLY);
-	if (fd == -1) {
-		return 404;
+/*
+ * Answers several ranges with a multipart/byteranges body. The part heads
+ * are built here, the file bytes between them still go out with sendfile().
+ * Takes over the reference to file.
+ */
+static int serve_multipart(http_response *res, fd_cache_entry *file, char *file_name, http_range *ranges, int count) {
+	static unsigned int boundaries = 0;
+	char boundary[32];
+	snprintf(boundary, sizeof(boundary), "%016llx%08x", (unsigned long long)trace_now(),
+		__atomic_add_fetch(&boundaries, 1, __ATOMIC_RELAXED));
+	const char *mime_type = extract_mime_type(file_name);
+
+	// one part per range and a last one for the closing delimiter
+	http_file_part *parts = calloc(count + 1, sizeof(http_file_part));
+	if (!parts) {
+		fd_cache_release(file);
+		return 500;
 	}
+	size_t total = 0;
+	for (int i = 0; i <= count; i++) {
+		char head[256];
+		int len;
+		if (i < count) {
+			len = snprintf(head, sizeof(head), "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				boundary, mime_type, (long long)ranges[i].first, (long long)ranges[i].last, (long long)file->sb.st_size);
+			parts[i].offset = ranges[i].first;
+			parts[i].len = ranges[i].last - ranges[i].first + 1;
+		} else {
+			len = snprintf(head, sizeof(head), "\r\n--%s--\r\n", boundary);
+		}
+		parts[i].head = strndup(head, len);
+		if (!parts[i].head) {
+			for (int j = 0; j < i; j++) free(parts[j].head);
+			free(parts);
+			fd_cache_release(file);
+			return 500;
+		}
+		parts[i].head_len = len;
+		total += len + parts[i].len;
+	}
+
+	char content_type[64];
+	snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+	add_file_headers(res, &file->sb);
+	set_content_headers(res, total, content_type);
+	res->file = file;
+	res->parts = parts;
+	res->part_count = count + 1;
+	res->body_size = total;
+	return 206;
+}
+
+static int serve_file(http_request *req, http_response *res, char *file_name) {
+	if (!res) return 500;
 
-	struct stat sb;
+	int packed = handle_packed_file(req, res, file_name);
+	if (packed != -1) {
+		return packed;
+	}
 
-	if(fstat(fd, &sb) == -1) {
+	fd_cache_entry *file = fd_cache_acquire(file_name);
+	if (!file) {
 		return 500;
 	}
+	if (file->fd == -1 || !S_ISREG(file->sb.st_mode)) {
+		int error = file->fd == -1 ? file->error : ENOENT;
+		fd_cache_release(file);
+		return (error == ENOENT || error == ENOTDIR || error == EACCES) ? 404 : 500;
+	}
 
-	if (!res) return 500;
+	char modified[32];
+	http_range ranges[HTTP_RANGES_MAX];
+	int range_count = requested_ranges(req, file->sb.st_size, file_validator(&file->sb, modified, sizeof(modified)), ranges);
+	if (range_count == -1) {
+		char content_range[32];
+		snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long)file->sb.st_size);
+		add_http_header(res, "Content-Range", content_range);
+		add_http_header(res, "Content-Length", "0");
+		fd_cache_release(file);
+		return 416;
+	}
+	if (range_count > 1) {
+		return serve_multipart(res, file, file_name, ranges, range_count);
+	}
+
+	int status = 0;
+	off_t offset = 0;
+	size_t size = file->sb.st_size;
+	if (range_count == 1) {
+		char content_range[64];
+		offset = ranges[0].first;
+		size = ranges[0].last - ranges[0].first + 1;
+		snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+			(long long)ranges[0].first, (long long)ranges[0].last, (long long)file->sb.st_size);
+		add_file_headers(res, &file->sb);
+		set_content_headers(res, size, extract_mime_type(file_name));
+		add_http_header(res, "Content-Range", content_range);
+		status = 206;
+	} else {
+		fill_http_headers(res, &file->sb, file_name);
+	}
 
-	char buf[TMP_BUF_SIZE];
-	int cap = TMP_BUF_SIZE;
-	char *resp_body = malloc(sb.st_size + 1);
+	// Large files go out with sendfile() straight from the cached descriptor
+	if (size > FILE_INLINE_MAX) {
+		res->file = file;
+		res->file_offset = offset;
+		res->body_size = size;
+		return status;
+	}
 
-	if (!resp_body) return -1;
+	char *resp_body = malloc(size + 1);
+	if (!resp_body) {
+		fd_cache_release(file);
+		return 500;
+	}
 
+	// pread, the descriptor's file offset is shared with other requests
 	ssize_t nbytes;
-	int count = 0;
-	while((nbytes = read(fd, buf, TMP_BUF_SIZE)) > 0) {
-		memcpy(resp_body + count, buf, nbytes);
+	size_t count = 0;
+	while (count < size &&
+	       (nbytes = pread(file->fd, resp_body + count, size - count, offset + count)) > 0) {
 		count += nbytes;
 	}
 
-	resp_body[count +  + 11] = '\0';
-	printf("count: %d\n", count);
+	resp_body[count] = '\0';
+	printf("count: %zu\n", count);
 
 	res->resp_body = resp_body;
+	res->body_size = count;
 
-	fill_http_headers(res, &sb, file_name);
+	fd_cache_release(file);
+	return status;
+}
 
-	printf("default done\n");
-	close(fd);
+/*
+ * Large files are only opened here, their bytes go out with sendfile() in
+ * the write phase. Returns 0, or 206, 304, 404, 416 or 500 with the
+ * headers for it already set.
+ */
+int handle_file(http_request *req, http_response *res, char *file_name) {
+	long long start = trace_now();
+	int status = serve_file(req, res, file_name);
+	if (req) {
+		long long spent = trace_now() - start;
+		req->trace.file_ns += spent;
+		HTTP_PROBE2(file, &req->trace, spent);
+	}
+	return status;
+}
+
+/*
+ * Copies HTTP_STATIC_DIR and the request target into out, dropping the query
+ * string, duplicate slashes and "." segments. Fails on ".." segments and on
+ * paths that don't fit.
+ */
+int normalize_static_path(const char *target, char *out, size_t out_size) {
+	size_t len = strlen(HTTP_STATIC_DIR);
+	if (len + 1 >= out_size) return -1;
+	memcpy(out, HTTP_STATIC_DIR, len);
+
+	const char *p = target;
+	while (*p && *p != '?' && *p != '#') {
+		while (*p == '/') p++;
+		const char *segment = p;
+		while (*p && *p != '/' && *p != '?' && *p != '#') p++;
+		size_t segment_len = p - segment;
+
+		if (segment_len == 0 || (segment_len == 1 && segment[0] == '.')) continue;
+		if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') return -1;
+		if (len + 1 + segment_len >= out_size) return -1;
+
+		out[len++] = '/';
+		memcpy(out + len, segment, segment_len);
+		len += segment_len;
+	}
+	out[len] = '\0';
 	return 0;
 }
 
@@ -107,7 +353,16 @@ int handle_file(http_request *req, http_response *res, char *file_name) {
  */
 int handle_default(http_request *req, http_response *res) {
 	printf("handle default\n");
-	handle_file(req, res, INDEX_FILE);
+	int status = handle_file(req, res, INDEX_FILE);
+	if (status == 304) {
+		return handle_not_modified(req, res);
+	}
+	if (status == 206) {
+		return handle_partial_content(req, res);
+	}
+	if (status == 416) {
+		return handle_range_not_satisfiable(req, res);
+	}
 	res->code = 200;
 	res->start_line = "HTTP/1.1 200 OK";
 	return 0;
@@ -117,13 +372,11 @@ int handle_path(http_request *req, http_response *res) {
 	printf("handle path\n");
 	
 	// Guard against path traversal
-	if (strstr(req->request.request_target, "..") != NULL) {
+	char safe_path[SAFE_PATH_MAX];
+	if (normalize_static_path(req->request.request_target, safe_path, SAFE_PATH_MAX) == -1) {
 		return handle_not_found(req, res);
 	}
 
-	char safe_path[SAFE_PATH_MAX];
-	snprintf(safe_path, SAFE_PATH_MAX, "%s/%s", HTTP_STATIC_DIR, req->request.request_target);
-
 	int status_code = handle_file(req, res, safe_path);
 	if (status_code == 404) {
 		return handle_not_found(req, res);
@@ -131,24 +384,202 @@ int handle_path(http_request *req, http_response *res) {
 	if (status_code == 500) {
 		return handle_internal_server_error(req, res);
 	}
+	if (status_code == 304) {
+		return handle_not_modified(req, res);
+	}
+	if (status_code == 206) {
+		return handle_partial_content(req, res);
+	}
+	if (status_code == 416) {
+		return handle_range_not_satisfiable(req, res);
+	}
 	res->code = 200;
 	res->start_line = "HTTP/1.1 200 OK";
 	return 0;
 }
 
+int handle_not_modified(http_request *req, http_response *res) {
+	(void)req;
+	printf("handle not modified\n");
+	res->code = 304;
+	res->start_line = "HTTP/1.1 304 Not Modified";
+	return 0;
+}
+
+int handle_partial_content(http_request *req, http_response *res) {
+	(void)req;
+	printf("handle partial content\n");
+	res->code = 206;
+	res->start_line = "HTTP/1.1 206 Partial Content";
+	return 0;
+}
+
+// Content-Range with the file size was set by handle_file()
+int handle_range_not_satisfiable(http_request *req, http_response *res) {
+	(void)req;
+	printf("handle range not satisfiable\n");
+	res->code = 416;
+	res->start_line = "HTTP/1.1 416 Range Not Satisfiable";
+	return 0;
+}
+
 int handle_not_found(http_request *req, http_response *res) {
+	(void)req;
 	printf("handle not found\n");
-	handle_file(req, res, NOTFOUND_FILE);
+	handle_file(NULL, res, NOTFOUND_FILE);
 	res->code = 404;
 	res->start_line = "HTTP/1.1 404 Not Found";
 	return 0;
 }
 
 int handle_internal_server_error(http_request *req, http_response *res) {
+	(void)req;
 	printf("internal server error\n");
-	handle_file(req, res, SERVER_ERROR_FILE);
+	handle_file(NULL, res, SERVER_ERROR_FILE);
 	res->code = 500;
 	res->start_line = "HTTP/1.1 500 Internal Server Error";
 	return 0;
 }
 
+static int respond_text(http_response *res, int code, char *start_line, const char *body) {
+	res->resp_body = strdup(body);
+	res->body_size = strlen(body);
+	set_content_headers(res, strlen(body), "text/plain");
+	res->code = code;
+	res->start_line = start_line;
+	return 0;
+}
+
+/**
+ * The client is over its request rate, see ratelimit.h
+ */
+int handle_too_many_requests(http_request *req, http_response *res) {
+	(void)req;
+	respond_text(res, 429, "HTTP/1.1 429 Too Many Requests", "Too Many Requests\n");
+	add_http_header(res, "Retry-After", "1");
+	return 0;
+}
+
+/**
+ * The server has no room for the request right now
+ */
+int handle_service_unavailable(http_request *req, http_response *res) {
+	(void)req;
+	respond_text(res, 503, "HTTP/1.1 503 Service Unavailable", "Service Unavailable\n");
+	add_http_header(res, "Retry-After", "1");
+	return 0;
+}
+
+static int respond_status(http_response *res, int status) {
+	switch (status) {
+	case 400:
+		return respond_text(res, 400, "HTTP/1.1 400 Bad Request", "Bad Request\n");
+	case 408:
+		return respond_text(res, 408, "HTTP/1.1 408 Request Timeout", "Request Timeout\n");
+	case 413:
+		return respond_text(res, 413, "HTTP/1.1 413 Payload Too Large", "Payload Too Large\n");
+	case 501:
+		return respond_text(res, 501, "HTTP/1.1 501 Not Implemented", "Not Implemented\n");
+	default:
+		return respond_text(res, 500, "HTTP/1.1 500 Internal Server Error", "Internal Server Error\n");
+	}
+}
+
+/**
+ *
+ * Stores the request body of POST/PUT /uploads/<name> in HTTP_UPLOAD_DIR
+ */
+int handle_upload(http_request *req, http_response *res) {
+	printf("handle upload\n");
+
+	// the name is the last path segment, the query string isn't part of it
+	const char *target = req->request.request_target;
+	size_t path_len = strcspn(target, "?#");
+	const char *name = target + path_len;
+	while (name > target && name[-1] != '/') name--;
+	size_t name_len = target + path_len - name;
+	if (memmem(target, path_len, "..", 2) != NULL || name_len == 0 || name_len >= NAME_MAX) {
+		return respond_status(res, 400);
+	}
+
+	if (mkdir(HTTP_UPLOAD_DIR, 0755) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		return respond_status(res, 500);
+	}
+
+	char upload_path[SAFE_PATH_MAX];
+	snprintf(upload_path, SAFE_PATH_MAX, "%s/%.*s", HTTP_UPLOAD_DIR, (int)name_len, name);
+
+	int fd = open(upload_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open upload");
+		return respond_status(res, 500);
+	}
+
+	int status = http_body_to_file(req, fd);
+	close(fd);
+	if (status != 0) {
+		unlink(upload_path);
+		return respond_status(res, status);
+	}
+	return respond_text(res, 201, "HTTP/1.1 201 Created", "Created\n");
+}
+
+// Upload names come from request targets, escape them before they go into markup
+static void html_escape(const char *in, char *out, size_t size) {
+	size_t n = 0;
+	for (; *in; in++) {
+		const char *entity;
+		switch (*in) {
+		case '&': entity = "&amp;"; break;
+		case '<': entity = "&lt;"; break;
+		case '>': entity = "&gt;"; break;
+		case '"': entity = "&quot;"; break;
+		case '\'': entity = "&#39;"; break;
+		default: entity = NULL; break;
+		}
+		size_t len = entity ? strlen(entity) : 1;
+		if (n + len >= size) break;
+		if (entity) {
+			memcpy(out + n, entity, len);
+		} else {
+			out[n] = *in;
+		}
+		n += len;
+	}
+	out[n] = '\0';
+}
+
+static int stream_upload_index(http_writer *writer, void *ctx) {
+	(void)ctx;
+	DIR *dir = opendir(HTTP_UPLOAD_DIR);
+	http_writer_printf(writer, "<!DOCTYPE html>\n<html><body><h1>Uploads</h1><ul>\n");
+	if (dir) {
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL && !writer->error) {
+			if (entry->d_name[0] == '.') continue;
+			char name[sizeof(entry->d_name) * 6];
+			html_escape(entry->d_name, name, sizeof(name));
+			http_writer_printf(writer, "<li>%s</li>\n", name);
+		}
+		closedir(dir);
+	}
+	http_writer_printf(writer, "</ul></body></html>\n");
+	return 0;
+}
+
+/**
+ *
+ * Lists HTTP_UPLOAD_DIR as a streamed response, entries go out while the
+ * directory is still being read
+ */
+int handle_upload_index(http_request *req, http_response *res) {
+	(void)req;
+	printf("handle upload index\n");
+	add_http_header(res, "Content-Type", "text/html");
+	res->stream = stream_upload_index;
+	res->stream_ctx = NULL;
+	res->code = 200;
+	res->start_line = "HTTP/1.1 200 OK";
+	return 0;
+}
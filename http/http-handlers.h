@@ -1,7 +1,17 @@
 #include "http-parser.h"
 #include "http-response.h"
 
+char *extract_mime_type(char *file_name);
+int handle_file(http_request *request, http_response *response, char *file_name);
+
 int handle_default(http_request *request, http_response *response);
 int handle_path(http_request *request, http_response *response);
+int handle_not_modified(http_request *request, http_response *response);
+int handle_partial_content(http_request *request, http_response *response);
+int handle_range_not_satisfiable(http_request *request, http_response *response);
 int handle_not_found(http_request *request, http_response *response);
 int handle_internal_server_error(http_request *request, http_response *response);
+int handle_too_many_requests(http_request *request, http_response *response);
+int handle_service_unavailable(http_request *request, http_response *response);
+int handle_upload(http_request *request, http_response *response);
+int handle_upload_index(http_request *request, http_response *response);
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include "http-parser.h"
 
 
@@ -92,7 +93,10 @@ int parse_http_request(char *buf, http_request *request) {
 	if (request_body == NULL) {
 		return -1;
 	}
+	// Terminate the header block after the last header line
+	request_body[2] = '\0';
 	request_body += 4;
+	request->body = request_body;
 
 	char *line_buf = buf;
 	request_line line;
@@ -113,7 +117,7 @@ int parse_http_request(char *buf, http_request *request) {
 	request->headers = r_headers;
 
 	const char* method_names[] = { "GET", "POST", "PUT", "NOT_SUPPORTED" };
-	const char* protocol_names[] = { "HTTP/1.1", "NOT_SUPPORTED" };
+	const char* protocol_names[] = { "HTTP/1.1", "HTTP/2", "NOT_SUPPORTED" };
 	printf("%s %s %s\n", method_names[request->request.method], request->request.request_target, protocol_names[request->request.protocol]);
 
 	for (size_t i = 0; i < r_headers.count; i++) {
@@ -123,6 +127,15 @@ int parse_http_request(char *buf, http_request *request) {
 	return 0;
 }
 
+const char *http_get_header(http_request *request, const char *key) {
+	for (size_t i = 0; i < request->headers.count; i++) {
+		if (strcasecmp(request->headers.headers[i].key, key) == 0) {
+			return request->headers.headers[i].value;
+		}
+	}
+	return NULL;
+}
+
 void free_http_request(http_request *request) {
 	if (!request || !request->headers.headers) return;
 
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#include "trace.h"
+
 #define MAX_HEADER_KEY_SIZE 256
 #define MAX_HEADER_VALUE_SIZE 4096
 
@@ -16,6 +18,7 @@ typedef enum {
 
 typedef enum {
 	HTTP_1_1,
+	HTTP_2,
 	PROTOCOL_NOT_SUPPORTED
 } http_protocol;
 
@@ -39,11 +42,18 @@ typedef struct {
 typedef struct {
 	request_line request;
 	http_headers headers;
+	int fd;         // client socket, the rest of the body is read from here
+	char *body;     // body bytes that arrived together with the head
+	size_t body_len;
+	long long deadline;     // tcp_now() by which the body must be read, 0 for none
+	request_trace trace;
 } http_request;
 
 
 int parse_http_request(char *buf, http_request *request);
 
+const char *http_get_header(http_request *request, const char *key);
+
 void free_http_request(http_request *request);
 
 #endif // HTTP_PARSER_H
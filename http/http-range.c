@@ -0,0 +1,74 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "http-range.h"
+
+static const char *skip_space(const char *p) {
+	while (*p == ' ' || *p == '\t') p++;
+	return p;
+}
+
+// Reads a decimal position, -1 if there are no digits or it overflows
+static off_t read_pos(const char **p) {
+	if (!isdigit((unsigned char)**p)) return -1;
+	long long pos = 0;
+	while (isdigit((unsigned char)**p)) {
+		if (pos > (LLONG_MAX - 9) / 10) return -1;
+		pos = pos * 10 + (**p - '0');
+		(*p)++;
+	}
+	return pos;
+}
+
+int http_parse_range(const char *value, off_t size, http_range *ranges, int max) {
+	if (strncasecmp(value, "bytes=", 6) != 0) {
+		return 0;
+	}
+	const char *p = value + 6;
+	int count = 0;
+	int specs = 0;
+	while (1) {
+		p = skip_space(p);
+		// empty list elements are allowed, "bytes=0-1,,2-3"
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		if (*p == '\0') break;
+
+		off_t first;
+		off_t last;
+		if (*p == '-') {
+			// suffix range, the last n bytes
+			p++;
+			off_t n = read_pos(&p);
+			if (n == -1) return 0;
+			first = n < size ? size - n : 0;
+			last = size - 1;
+			if (n == 0) first = size;
+		} else {
+			first = read_pos(&p);
+			if (first == -1 || *p != '-') return 0;
+			p++;
+			last = read_pos(&p);
+			if (last == -1) {
+				last = size - 1;
+			} else if (last < first) {
+				return 0;
+			} else if (last >= size) {
+				last = size - 1;
+			}
+		}
+		p = skip_space(p);
+		if (*p != ',' && *p != '\0') return 0;
+		if (++specs > max) return 0;
+
+		if (first < size) {
+			ranges[count++] = (http_range){ first, last };
+		}
+	}
+	if (specs == 0) return 0;
+	return count > 0 ? count : -1;
+}
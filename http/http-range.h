@@ -0,0 +1,22 @@
+#ifndef HTTP_RANGE_H
+#define HTTP_RANGE_H
+
+#include <sys/types.h>
+
+#define HTTP_RANGES_MAX 16
+
+// A satisfiable byte range, both ends inclusive
+typedef struct {
+	off_t first;
+	off_t last;
+} http_range;
+
+/*
+ * Parses a "Range: bytes=..." value against a representation of size
+ * bytes. Returns the number of satisfiable ranges written to ranges, 0 if
+ * the header should be ignored (not a byte range, malformed, or more than
+ * max ranges) and -1 if no range can be satisfied, which is a 416.
+ */
+int http_parse_range(const char *value, off_t size, http_range *ranges, int max);
+
+#endif // HTTP_RANGE_H
@@ -1,8 +1,249 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "http-response.h"
+#include "tcp.h"
+
+#define HEAD_IOV_MAX 64
+#define WRITER_BUF_SIZE 4096
+#define WRITE_TIMEOUT 30000
+
+/*
+ * Writes the whole iovec. If the socket is non-blocking and its send queue is
+ * full we wait for POLLOUT, which throttles the producer to the client's pace,
+ * but not past deadline (tcp_now() based, 0 for none). flags are passed to
+ * sendmsg(), e.g. MSG_MORE, and dropped for descriptors that aren't sockets.
+ */
+static int sendv_all(int fd, struct iovec *iov, int iovcnt, int flags, long long deadline) {
+	while (iovcnt > 0) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+		ssize_t nbytes = flags ? sendmsg(fd, &msg, flags) : writev(fd, iov, iovcnt);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == ENOTSOCK && flags) {
+				flags = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (tcp_wait(fd, POLLOUT, WRITE_TIMEOUT, deadline) <= 0) return -1;
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)nbytes >= iov->iov_len) {
+			nbytes -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nbytes;
+			iov->iov_len -= nbytes;
+		}
+	}
+	return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt, long long deadline) {
+	return sendv_all(fd, iov, iovcnt, 0, deadline);
+}
+
+static int sendfile_all(int fd, int file_fd, off_t offset, size_t len, long long deadline) {
+	while (len > 0) {
+		ssize_t nbytes = sendfile(fd, file_fd, &offset, len);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (tcp_wait(fd, POLLOUT, WRITE_TIMEOUT, deadline) <= 0) return -1;
+				continue;
+			}
+			perror("sendfile");
+			return -1;
+		}
+		if (nbytes == 0) {
+			// file shrank underneath us
+			return -1;
+		}
+		len -= nbytes;
+	}
+	return 0;
+}
+
+// Each part head shares a segment with the first bytes of its file range
+static int send_file_parts(int fd, http_response *response) {
+	int more = tcp_more_flag();
+	for (size_t i = 0; i < response->part_count; i++) {
+		http_file_part *part = &response->parts[i];
+		struct iovec head = { part->head, part->head_len };
+		if (sendv_all(fd, &head, 1, part->len > 0 ? more : 0, response->deadline) == -1) return -1;
+		if (part->len > 0 && sendfile_all(fd, response->file->fd, part->offset, part->len, response->deadline) == -1) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sends the status line and headers, followed by body if there is one so
+ * that small responses leave in a single write.
+ */
+static int send_head(int fd, http_response *response, const char *body, size_t body_len, int flags) {
+	struct iovec iov[HEAD_IOV_MAX];
+	int n = 0;
+
+	iov[n++] = (struct iovec){ response->start_line, strlen(response->start_line) };
+	iov[n++] = (struct iovec){ "\r\n", 2 };
+	for (size_t i = 0; i < response->headers.count; i++) {
+		if (n + 8 > HEAD_IOV_MAX) {
+			if (sendv_all(fd, iov, n, tcp_more_flag(), response->deadline) == -1) return -1;
+			n = 0;
+		}
+		http_header *h = &response->headers.headers[i];
+		iov[n++] = (struct iovec){ h->key, strlen(h->key) };
+		iov[n++] = (struct iovec){ ": ", 2 };
+		iov[n++] = (struct iovec){ h->value, strlen(h->value) };
+		iov[n++] = (struct iovec){ "\r\n", 2 };
+	}
+	if (response->raw_headers_len > 0) {
+		iov[n++] = (struct iovec){ (void *)response->raw_headers, response->raw_headers_len };
+	}
+	if (response->stream) {
+		char *te = "Transfer-Encoding: chunked\r\n";
+		iov[n++] = (struct iovec){ te, strlen(te) };
+	}
+	iov[n++] = (struct iovec){ "\r\n", 2 };
+	if (body && body_len > 0) {
+		iov[n++] = (struct iovec){ (void *)body, body_len };
+	}
+	return sendv_all(fd, iov, n, flags, response->deadline);
+}
+
+/*
+ * Serializes the response onto fd. Streaming responses get their head sent
+ * right away so the first bytes reach the client before the body is ready.
+ */
+int http_response_send(int fd, http_response *response) {
+	if (!response->start_line) return -1;
+
+	if (response->stream) {
+		if (send_head(fd, response, NULL, 0, 0) == -1) return -1;
+
+		http_writer writer = { .fd = fd, .bytes_sent = 0, .error = 0, .deadline = response->deadline, .sink = NULL, .sink_ctx = NULL };
+		int status = response->stream(&writer, response->stream_ctx);
+		if (writer.error) return -1;
+
+		struct iovec last = { "0\r\n\r\n", 5 };
+		if (writev_all(fd, &last, 1, response->deadline) == -1) return -1;
+		return status;
+	}
+
+	if (response->file) {
+		// the head waits for the first sendfile() bytes to share a segment
+		if (send_head(fd, response, NULL, 0, tcp_more_flag()) == -1) return -1;
+		if (response->parts) {
+			return send_file_parts(fd, response);
+		}
+		return sendfile_all(fd, response->file->fd, response->file_offset, response->body_size, response->deadline);
+	}
+	const char *body = response->resp_body ? response->resp_body : response->body_ref;
+	return send_head(fd, response, body, response->body_size, 0);
+}
+
+int http_writer_write(http_writer *writer, const void *data, size_t len) {
+	if (writer->error) return -1;
+	if (len == 0) return 0;  // a zero-sized chunk would end the body
+	if (writer->sink) {
+		if (writer->sink(writer, data, len) == -1) {
+			writer->error = ENOMEM;
+			return -1;
+		}
+		writer->bytes_sent += len;
+		return 0;
+	}
+
+	char size_line[20];
+	int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+	struct iovec iov[3] = {
+		{ size_line, size_len },
+		{ (void *)data, len },
+		{ "\r\n", 2 }
+	};
+	if (writev_all(writer->fd, iov, 3, writer->deadline) == -1) {
+		writer->error = errno;
+		return -1;
+	}
+	writer->bytes_sent += len;
+	return 0;
+}
+
+// Formats into a stack buffer, longer output gets a heap buffer of its size
+int http_writer_printf(http_writer *writer, const char *fmt, ...) {
+	char buf[WRITER_BUF_SIZE];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len < 0) {
+		writer->error = EINVAL;
+		return -1;
+	}
+	if ((size_t)len < sizeof(buf)) {
+		return http_writer_write(writer, buf, len);
+	}
+
+	char *heap = malloc(len + 1);
+	if (!heap) {
+		writer->error = ENOMEM;
+		return -1;
+	}
+	va_start(args, fmt);
+	vsnprintf(heap, len + 1, fmt, args);
+	va_end(args);
+	int status = http_writer_write(writer, heap, len);
+	free(heap);
+	return status;
+}
+
+int add_http_header(http_response *response, const char *key, const char *value) {
+	http_headers *headers = &response->headers;
+	if (headers->count == headers->capacity) {
+		size_t new_capacity = headers->capacity ? headers->capacity * 2 : 4;
+		http_header *tmp = realloc(headers->headers, sizeof(http_header) * new_capacity);
+		if (tmp == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		headers->headers = tmp;
+		headers->capacity = new_capacity;
+	}
+	headers->headers[headers->count].key = strdup(key);
+	headers->headers[headers->count].value = strdup(value);
+	headers->count++;
+	return 0;
+}
 
 void free_http_response(http_response *response) {
-        if (!response || !response->headers.headers) return;
+        if (!response) return;
+
+        free(response->resp_body);
+        response->resp_body = NULL;
+        fd_cache_release(response->file);
+        response->file = NULL;
+        for (size_t i = 0; i < response->part_count; i++) {
+                free(response->parts[i].head);
+        }
+        free(response->parts);
+        response->parts = NULL;
+        response->part_count = 0;
+        if (response->stream_free) {
+                response->stream_free(response->stream_ctx);
+                response->stream_free = NULL;
+        }
+        if (!response->headers.headers) return;
 
         for (size_t i = 0; i < response->headers.count; i++) {
                 free(response->headers.headers[i].key);
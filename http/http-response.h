@@ -1,7 +1,11 @@
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #include "http-parser.h"
+#include "fd-cache.h"
 
 typedef enum {
 	OK,
@@ -9,16 +13,58 @@ typedef enum {
 	INTERNAL_SERVER_ERROR
 } status_code;
 
+/*
+ * Handed to streaming handlers once the status line and headers are on the
+ * wire. Every http_writer_write() goes out as one chunk of a
+ * Transfer-Encoding: chunked body, unless a sink collects the body instead.
+ */
+typedef struct http_writer http_writer;
+
+struct http_writer {
+	int fd;
+	size_t bytes_sent;
+	int error;
+	long long deadline;     // tcp_now() by which every write must be done, 0 for none
+	int (*sink)(http_writer *writer, const void *data, size_t len);
+	void *sink_ctx;
+};
+
+typedef int (*http_stream_fn)(http_writer *writer, void *ctx);
+
+// One part of a multipart body: head, then len bytes of the file at offset
+typedef struct {
+	char *head;
+	size_t head_len;
+	off_t offset;
+	size_t len;
+} http_file_part;
+
 typedef struct {
 	char *start_line;
 	status_code code;
 	http_headers headers;
+	const char *raw_headers;     // preformatted "Key: value\r\n" lines sent after headers
+	size_t raw_headers_len;
 	char *resp_body;
+	const char *body_ref;        // body borrowed from memory that outlives the response
 	size_t body_size;
+	fd_cache_entry *file;    // when set, body_size bytes at file_offset are sent with sendfile()
+	off_t file_offset;
+	http_file_part *parts;   // when set, the file body is these parts instead of one run at file_offset
+	size_t part_count;
+	http_stream_fn stream;   // when set, the body is produced by stream() instead of resp_body
+	void *stream_ctx;
+	void (*stream_free)(void *ctx);  // releases stream_ctx, whether or not stream() ran
+	long long deadline;      // tcp_now() by which the response must be sent, 0 for none
 } http_response;
 
 
+int add_http_header(http_response *response, const char *key, const char *value);
+int http_response_send(int fd, http_response *response);
+
+int http_writer_write(http_writer *writer, const void *data, size_t len);
+int http_writer_printf(http_writer *writer, const char *fmt, ...);
+
 void free_http_response(http_response *response);
 
 #endif // HTTP_RESPONSE_H
-
@@ -2,36 +2,79 @@
 #include <stdio.h>
 #include "http-router.h"
 #include "http-handlers.h"
+#include "proxy.h"
+#include "sse.h"
 
 const static route routes[] = {
-	{GET, "/", handle_default},
-	{GET, "/favicon.ico", handle_path},
-	{GET, "/index.html", handle_default},
-	{GET, "*", handle_path},
+	{GET, "/", handle_default, ROUTE_HANDLER},
+	{GET, "/favicon.ico", handle_path, ROUTE_HANDLER},
+	{GET, "/index.html", handle_default, ROUTE_HANDLER},
+	{GET, "/uploads/", handle_upload_index, ROUTE_HANDLER},
+	{GET, "/events", handle_events, ROUTE_EVENTS},
+	{POST, "/events", handle_publish, ROUTE_HANDLER},
+	{GET, "/api/*", handle_proxy, ROUTE_PROXY},
+	{POST, "/api/*", handle_proxy, ROUTE_PROXY},
+	{PUT, "/api/*", handle_proxy, ROUTE_PROXY},
+	{POST, "/uploads/*", handle_upload, ROUTE_HANDLER},
+	{PUT, "/uploads/*", handle_upload, ROUTE_HANDLER},
+	{GET, "*", handle_path, ROUTE_HANDLER},
 
 }; 
 
-int dispatch_request(http_request *request, http_response *response) {
-	if (!request) return -1;
+/**
+ * A path ending in '*' matches every target with that prefix, "*" matches all.
+ * Other paths match the target up to its query string.
+ */
+static int route_matches(const char *path, const char *target) {
+	size_t len = strlen(path);
+	if (len > 0 && path[len - 1] == '*') {
+		return strncmp(path, target, len - 1) == 0;
+	}
+	return strcspn(target, "?") == len && strncmp(path, target, len) == 0;
+}
 
+/**
+ * Returns the first route of table the request matches, NULL if none does
+ */
+const route *match_route(const route *table, size_t route_size, http_request *request) {
 	char *target = request->request.request_target;
-	if (!target) {
-		return handle_internal_server_error(request, response);
-	}
+	if (!target) return NULL;
 
 	http_method method = request->request.method;
 
-	size_t route_size = sizeof(routes) / sizeof(routes[0]);
-
 	for (size_t i = 0; i < route_size; i++) {
-		route tmp = routes[i];
+		const route *tmp = &table[i];
 
-		if (tmp.method == method) {
-			if (strcmp(tmp.path, "*") == 0 || strcmp(tmp.path, target) == 0) {
-				return tmp.handler(request, response);			
-			}
+		if (tmp->type == ROUTE_PROXY && !proxy_enabled()) {
+			continue;
+		}
+		if (tmp->type == ROUTE_EVENTS && !sse_enabled()) {
+			continue;
+		}
+		if (tmp->method == method && route_matches(tmp->path, target)) {
+			return tmp;
 		}
 	}
-	return handle_not_found(request, response);
+	return NULL;
 }
 
+/**
+ * Returns the route the request is dispatched to, NULL if none matches
+ */
+const route *find_route(http_request *request) {
+	return match_route(routes, sizeof(routes) / sizeof(routes[0]), request);
+}
+
+int dispatch_request(http_request *request, http_response *response) {
+	if (!request) return -1;
+
+	if (!request->request.request_target) {
+		return handle_internal_server_error(request, response);
+	}
+
+	const route *match = find_route(request);
+	if (match) {
+		return match->handler(request, response);
+	}
+	return handle_not_found(request, response);
+}
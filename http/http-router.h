@@ -1,10 +1,19 @@
 #include "http-parser.h"
 #include "http-response.h"
 
+typedef enum {
+    ROUTE_HANDLER,
+    ROUTE_PROXY,    // forwarded to the upstreams, skipped when none are configured
+    ROUTE_EVENTS    // held open as an event stream, skipped without an event loop to hold it
+} route_type;
+
 typedef struct {
     http_method method;
     const char *path;
     int (*handler)(http_request*, http_response*);
+    route_type type;
 } route;
 
 int dispatch_request(http_request *request, http_response *response);
+const route *find_route(http_request *request);
+const route *match_route(const route *table, size_t route_size, http_request *request);
@@ -0,0 +1,814 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "http2.h"
+#include "constants.h"
+
+#define FRAME_HEADER_LEN 9
+#define MAX_FRAME_SIZE 16384
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_CONCURRENT_STREAMS 100
+#define STREAM_WINDOW 65535                 // initial receive window we advertise per stream
+#define CONN_BODY_MAX (16 * 1024 * 1024)    // request body bytes a connection may hold at once
+#define OUT_HIGH_WATER (256 * 1024)
+
+enum {
+	FRAME_DATA = 0x0,
+	FRAME_HEADERS = 0x1,
+	FRAME_PRIORITY = 0x2,
+	FRAME_RST_STREAM = 0x3,
+	FRAME_SETTINGS = 0x4,
+	FRAME_PUSH_PROMISE = 0x5,
+	FRAME_PING = 0x6,
+	FRAME_GOAWAY = 0x7,
+	FRAME_WINDOW_UPDATE = 0x8,
+	FRAME_CONTINUATION = 0x9
+};
+
+enum {
+	FLAG_END_STREAM = 0x1,
+	FLAG_ACK = 0x1,
+	FLAG_END_HEADERS = 0x4,
+	FLAG_PADDED = 0x8,
+	FLAG_PRIORITY = 0x20
+};
+
+enum {
+	SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+enum {
+	H2_NO_ERROR = 0x0,
+	H2_PROTOCOL_ERROR = 0x1,
+	H2_INTERNAL_ERROR = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED = 0x5,
+	H2_FRAME_SIZE_ERROR = 0x6,
+	H2_REFUSED_STREAM = 0x7,
+	H2_COMPRESSION_ERROR = 0x9
+};
+
+enum {
+	STREAM_OPEN,            // receiving headers and body
+	STREAM_HALF_CLOSED      // request complete, response pending or being sent
+};
+
+static uint32_t read_u32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write_u32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int queue_frame(h2_conn *conn, int type, int flags, uint32_t stream_id, const void *payload, size_t len) {
+	unsigned char header[FRAME_HEADER_LEN];
+	header[0] = len >> 16;
+	header[1] = len >> 8;
+	header[2] = len;
+	header[3] = type;
+	header[4] = flags;
+	write_u32(header + 5, stream_id & MAX_WINDOW);
+	if (hpack_buf_append(&conn->out, header, FRAME_HEADER_LEN) == -1) return -1;
+	return hpack_buf_append(&conn->out, payload, len);
+}
+
+static int queue_rst_stream(h2_conn *conn, uint32_t stream_id, uint32_t error) {
+	unsigned char payload[4];
+	write_u32(payload, error);
+	return queue_frame(conn, FRAME_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static int queue_window_update(h2_conn *conn, uint32_t stream_id, uint32_t increment) {
+	unsigned char payload[4];
+	write_u32(payload, increment);
+	return queue_frame(conn, FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+// Connection errors end the connection with GOAWAY; returns -1 for the caller.
+static int connection_error(h2_conn *conn, uint32_t error) {
+	unsigned char payload[8];
+	write_u32(payload, conn->last_stream_id);
+	write_u32(payload + 4, error);
+	queue_frame(conn, FRAME_GOAWAY, 0, 0, payload, 8);
+	conn->goaway = 1;
+	conn->failed = 1;
+	printf("h2: connection error %u\n", error);
+	return -1;
+}
+
+int h2_is_preface(const char *buf, size_t len) {
+	size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+	return n > 0 && memcmp(buf, H2_PREFACE, n) == 0;
+}
+
+static h2_stream *find_stream(h2_conn *conn, uint32_t id) {
+	for (h2_stream *s = conn->streams; s; s = s->next) {
+		if (s->id == id) return s;
+	}
+	return NULL;
+}
+
+static h2_stream *new_stream(h2_conn *conn, uint32_t id) {
+	h2_stream *stream = calloc(1, sizeof(h2_stream));
+	if (!stream) return NULL;
+	stream->id = id;
+	stream->state = STREAM_OPEN;
+	stream->send_window = conn->peer_initial_window;
+	stream->recv_window = STREAM_WINDOW;
+	stream->request.fd = -1;
+	stream->request.headers.capacity = 8;
+	stream->request.headers.headers = malloc(sizeof(http_header) * 8);
+	stream->request.request.protocol = HTTP_2;
+	stream->request.request.method = METHOD_NOT_SUPPORTED;
+	stream->next = conn->streams;
+	conn->streams = stream;
+	conn->open_streams++;
+	if (id > conn->last_stream_id) conn->last_stream_id = id;
+	return stream;
+}
+
+static void free_stream(h2_conn *conn, h2_stream *stream) {
+	for (h2_stream **link = &conn->streams; *link; link = &(*link)->next) {
+		if (*link == stream) {
+			*link = stream->next;
+			break;
+		}
+	}
+	conn->open_streams--;
+	conn->buffered -= stream->body.len;
+	free_http_request(&stream->request);
+	free_http_response(&stream->response);
+	free(stream->target);
+	hpack_buf_free(&stream->header_block);
+	hpack_buf_free(&stream->body);
+	hpack_buf_free(&stream->data);
+	free(stream);
+}
+
+static void free_conn(h2_conn *conn) {
+	while (conn->streams) {
+		free_stream(conn, conn->streams);
+	}
+	hpack_table_free(&conn->decoder);
+	hpack_table_free(&conn->encoder);
+	hpack_buf_free(&conn->in);
+	hpack_buf_free(&conn->out);
+	free(conn);
+}
+
+h2_conn *h2_conn_new(int fd, h2_dispatch_fn dispatch, void *ctx) {
+	h2_conn *conn = calloc(1, sizeof(h2_conn));
+	if (!conn) return NULL;
+	conn->fd = fd;
+	conn->dispatch = dispatch;
+	conn->ctx = ctx;
+	conn->send_window = DEFAULT_WINDOW;
+	conn->recv_window = DEFAULT_WINDOW;
+	conn->peer_initial_window = DEFAULT_WINDOW;
+	conn->peer_max_frame = MAX_FRAME_SIZE;
+	hpack_table_init(&conn->decoder, HPACK_DEFAULT_TABLE_SIZE);
+	hpack_table_init(&conn->encoder, HPACK_DEFAULT_TABLE_SIZE);
+
+	// the server preface is a SETTINGS frame
+	unsigned char settings[12];
+	settings[0] = 0;
+	settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+	write_u32(settings + 2, MAX_CONCURRENT_STREAMS);
+	settings[6] = 0;
+	settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+	write_u32(settings + 8, STREAM_WINDOW);
+	queue_frame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+	return conn;
+}
+
+static int apply_settings(h2_conn *conn, const unsigned char *p, size_t len) {
+	if (len % 6 != 0) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+	for (size_t i = 0; i < len; i += 6) {
+		int id = (p[i] << 8) | p[i + 1];
+		uint32_t value = read_u32(p + i + 2);
+		switch (id) {
+		case SETTINGS_HEADER_TABLE_SIZE:
+			hpack_table_set_limit(&conn->encoder, value < HPACK_DEFAULT_TABLE_SIZE ? value : HPACK_DEFAULT_TABLE_SIZE);
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE: {
+			if (value > MAX_WINDOW) return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+			int64_t delta = (int64_t)value - conn->peer_initial_window;
+			for (h2_stream *s = conn->streams; s; s = s->next) {
+				if ((int64_t)s->send_window + delta > MAX_WINDOW) {
+					return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+				}
+				s->send_window += delta;
+			}
+			conn->peer_initial_window = value;
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+			if (value < MAX_FRAME_SIZE || value > 0xffffff) return connection_error(conn, H2_PROTOCOL_ERROR);
+			conn->peer_max_frame = value;
+			break;
+		default:
+			// unknown settings must be ignored
+			break;
+		}
+	}
+	return 0;
+}
+
+static int b64url_value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '-' || c == '+') return 62;
+	if (c == '_' || c == '/') return 63;
+	return -1;
+}
+
+static int add_request_header(http_request *request, const char *key, const char *value) {
+	http_headers *headers = &request->headers;
+	if (headers->count == headers->capacity) {
+		size_t new_capacity = headers->capacity * 2;
+		http_header *tmp = realloc(headers->headers, sizeof(http_header) * new_capacity);
+		if (tmp == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		headers->headers = tmp;
+		headers->capacity = new_capacity;
+	}
+	headers->headers[headers->count].key = strdup(key);
+	headers->headers[headers->count].value = strdup(value);
+	headers->count++;
+	return 0;
+}
+
+static http_method parse_method(const char *method) {
+	if (strcmp(method, "GET") == 0) return GET;
+	if (strcmp(method, "POST") == 0) return POST;
+	if (strcmp(method, "PUT") == 0) return PUT;
+	return METHOD_NOT_SUPPORTED;
+}
+
+/*
+ * Turns an HTTP/1.1 request carrying "Upgrade: h2c" into stream 1 of the
+ * connection. On -1 nothing was dispatched or sent, the caller answers the
+ * request over HTTP/1.1 then; otherwise it still has to send 101 Switching
+ * Protocols before the connection is flushed.
+ */
+int h2_conn_upgrade(h2_conn *conn, http_request *request) {
+	if (!request->request.request_target) return -1;
+	const char *settings = http_get_header(request, "HTTP2-Settings");
+	if (settings) {
+		unsigned char payload[256];
+		size_t len = 0;
+		uint32_t acc = 0;
+		int bits = 0;
+		for (const char *p = settings; *p && *p != '='; p++) {
+			int v = b64url_value(*p);
+			if (v < 0 || len == sizeof(payload)) return -1;
+			acc = (acc << 6) | v;
+			bits += 6;
+			if (bits >= 8) {
+				payload[len++] = acc >> (bits - 8);
+				bits -= 8;
+			}
+		}
+		if (apply_settings(conn, payload, len) == -1) return -1;
+	}
+
+	char *target = strdup(request->request.request_target);
+	if (!target) return -1;
+	h2_stream *stream = new_stream(conn, 1);
+	if (!stream) {
+		free(target);
+		return -1;
+	}
+	stream->request.request.method = request->request.method;
+	stream->target = target;
+	stream->request.request.request_target = stream->target;
+	for (size_t i = 0; i < request->headers.count; i++) {
+		const char *key = request->headers.headers[i].key;
+		if (strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Upgrade") == 0 ||
+		    strcasecmp(key, "HTTP2-Settings") == 0) {
+			continue;
+		}
+		add_request_header(&stream->request, key, request->headers.headers[i].value);
+	}
+	stream->state = STREAM_HALF_CLOSED;
+	stream->dispatched = 1;
+	conn->pending++;
+	conn->dispatch(conn, stream, conn->ctx);
+	return 0;
+}
+
+static int on_request_header(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx) {
+	(void)name_len;
+	(void)value_len;
+	h2_stream *stream = ctx;
+	if (name[0] != ':') {
+		return add_request_header(&stream->request, name, value);
+	}
+	if (strcmp(name, ":method") == 0) {
+		stream->request.request.method = parse_method(value);
+	} else if (strcmp(name, ":path") == 0) {
+		free(stream->target);
+		stream->target = strdup(value);
+		stream->request.request.request_target = stream->target;
+	} else if (strcmp(name, ":authority") == 0) {
+		return add_request_header(&stream->request, "host", value);
+	}
+	return 0;
+}
+
+static void dispatch_stream(h2_conn *conn, h2_stream *stream) {
+	stream->state = STREAM_HALF_CLOSED;
+	if (!stream->target) {
+		queue_rst_stream(conn, stream->id, H2_PROTOCOL_ERROR);
+		free_stream(conn, stream);
+		return;
+	}
+	stream->request.body = (char *)stream->body.data;
+	stream->request.body_len = stream->body.len;
+	if (stream->body.len > 0 && !http_get_header(&stream->request, "content-length")) {
+		// the body decoder needs to know the length, DATA frames carry no framing of their own
+		char len[21];
+		snprintf(len, sizeof(len), "%zu", stream->body.len);
+		add_request_header(&stream->request, "content-length", len);
+	}
+	stream->dispatched = 1;
+	conn->pending++;
+	conn->dispatch(conn, stream, conn->ctx);
+}
+
+static int end_headers(h2_conn *conn, h2_stream *stream, int end_stream) {
+	conn->continuation_stream = 0;
+	int status = hpack_decode(&conn->decoder, stream->header_block.data, stream->header_block.len, on_request_header, stream);
+	stream->header_block.len = 0;
+	if (status == -1) {
+		return connection_error(conn, H2_COMPRESSION_ERROR);
+	}
+	if (end_stream) {
+		dispatch_stream(conn, stream);
+	}
+	return 0;
+}
+
+// Strips padding and priority fields, returns -1 if the frame is malformed.
+static int frame_payload(int flags, int priority, const unsigned char **p, size_t *len) {
+	size_t pad = 0;
+	if (flags & FLAG_PADDED) {
+		if (*len < 1) return -1;
+		pad = (*p)[0];
+		(*p)++;
+		(*len)--;
+	}
+	if (priority && (flags & FLAG_PRIORITY)) {
+		if (*len < 5) return -1;
+		*p += 5;
+		*len -= 5;
+	}
+	if (pad > *len) return -1;
+	*len -= pad;
+	return 0;
+}
+
+static int handle_frame(h2_conn *conn, int type, int flags, uint32_t stream_id, const unsigned char *p, size_t len) {
+	if (conn->continuation_stream && (type != FRAME_CONTINUATION || stream_id != conn->continuation_stream)) {
+		return connection_error(conn, H2_PROTOCOL_ERROR);
+	}
+
+	h2_stream *stream;
+	switch (type) {
+	case FRAME_DATA: {
+		size_t frame_len = len;
+		if (stream_id == 0 || frame_payload(flags, 0, &p, &len) == -1) {
+			return connection_error(conn, H2_PROTOCOL_ERROR);
+		}
+		if (frame_len > (size_t)conn->recv_window) {
+			return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+		}
+		/*
+		 * The connection window is given back right away, so a stream that
+		 * stalls can't hold up the others. What the streams buffer is capped
+		 * by CONN_BODY_MAX instead, a stream that would go over it is reset.
+		 */
+		if (frame_len > 0) queue_window_update(conn, 0, frame_len);
+		stream = find_stream(conn, stream_id);
+		if (!stream || stream->state != STREAM_OPEN) {
+			return queue_rst_stream(conn, stream_id, H2_STREAM_CLOSED);
+		}
+		if (frame_len > (size_t)stream->recv_window) {
+			queue_rst_stream(conn, stream_id, H2_FLOW_CONTROL_ERROR);
+			free_stream(conn, stream);
+			return 0;
+		}
+		stream->recv_window -= frame_len;
+		if (stream->body.len + len > MAX_BODY_SIZE || conn->buffered + len > CONN_BODY_MAX) {
+			queue_rst_stream(conn, stream_id, H2_REFUSED_STREAM);
+			free_stream(conn, stream);
+			return 0;
+		}
+		hpack_buf_append(&stream->body, p, len);
+		conn->buffered += len;
+		if (flags & FLAG_END_STREAM) {
+			dispatch_stream(conn, stream);
+		} else if (frame_len > 0) {
+			queue_window_update(conn, stream_id, frame_len);
+			stream->recv_window += frame_len;
+		}
+		return 0;
+	}
+	case FRAME_HEADERS:
+		if (stream_id == 0 || frame_payload(flags, 1, &p, &len) == -1) {
+			return connection_error(conn, H2_PROTOCOL_ERROR);
+		}
+		stream = find_stream(conn, stream_id);
+		if (!stream) {
+			if ((stream_id & 1) == 0 || stream_id <= conn->last_stream_id) {
+				return connection_error(conn, H2_PROTOCOL_ERROR);
+			}
+			if (conn->open_streams >= MAX_CONCURRENT_STREAMS || conn->goaway) {
+				conn->last_stream_id = stream_id;
+				return queue_rst_stream(conn, stream_id, H2_REFUSED_STREAM);
+			}
+			stream = new_stream(conn, stream_id);
+			if (!stream) return connection_error(conn, H2_INTERNAL_ERROR);
+		} else if (stream->state != STREAM_OPEN) {
+			return connection_error(conn, H2_STREAM_CLOSED);
+		}
+		hpack_buf_append(&stream->header_block, p, len);
+		if (flags & FLAG_END_HEADERS) {
+			return end_headers(conn, stream, flags & FLAG_END_STREAM);
+		}
+		conn->continuation_stream = stream_id;
+		// remember END_STREAM until the header block is complete
+		stream->end_stream = flags & FLAG_END_STREAM;
+		return 0;
+	case FRAME_CONTINUATION:
+		stream = find_stream(conn, stream_id);
+		if (!stream || conn->continuation_stream != stream_id) {
+			return connection_error(conn, H2_PROTOCOL_ERROR);
+		}
+		hpack_buf_append(&stream->header_block, p, len);
+		if (flags & FLAG_END_HEADERS) {
+			return end_headers(conn, stream, stream->end_stream);
+		}
+		return 0;
+	case FRAME_PRIORITY:
+		if (len != 5) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+		return 0;
+	case FRAME_RST_STREAM:
+		if (len != 4 || stream_id == 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+		stream = find_stream(conn, stream_id);
+		if (stream) {
+			if (stream->dispatched) {
+				// freed when the application hands the response back
+				stream->reset = 1;
+			} else {
+				free_stream(conn, stream);
+			}
+		}
+		return 0;
+	case FRAME_SETTINGS:
+		if (stream_id != 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+		if (flags & FLAG_ACK) return 0;
+		if (apply_settings(conn, p, len) == -1) return -1;
+		return queue_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+	case FRAME_PUSH_PROMISE:
+		return connection_error(conn, H2_PROTOCOL_ERROR);
+	case FRAME_PING:
+		if (len != 8 || stream_id != 0) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+		if (flags & FLAG_ACK) return 0;
+		return queue_frame(conn, FRAME_PING, FLAG_ACK, 0, p, 8);
+	case FRAME_GOAWAY:
+		conn->goaway = 1;
+		return 0;
+	case FRAME_WINDOW_UPDATE: {
+		if (len != 4) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+		uint32_t increment = read_u32(p) & MAX_WINDOW;
+		if (stream_id == 0) {
+			if (increment == 0 || (int64_t)conn->send_window + increment > MAX_WINDOW) {
+				return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+			}
+			conn->send_window += increment;
+			return 0;
+		}
+		stream = find_stream(conn, stream_id);
+		if (!stream) return 0;
+		if (increment == 0 || (int64_t)stream->send_window + increment > MAX_WINDOW) {
+			return queue_rst_stream(conn, stream_id, H2_FLOW_CONTROL_ERROR);
+		}
+		stream->send_window += increment;
+		return 0;
+	}
+	default:
+		// unknown frame types are ignored
+		return 0;
+	}
+}
+
+/*
+ * Consumes bytes read from the socket. Returns -1 on a connection error;
+ * the GOAWAY is already queued and should be flushed before closing.
+ */
+int h2_conn_feed(h2_conn *conn, const unsigned char *buf, size_t len) {
+	if (conn->goaway && conn->closed) return -1;
+	if (hpack_buf_append(&conn->in, buf, len) == -1) {
+		return connection_error(conn, H2_INTERNAL_ERROR);
+	}
+
+	size_t off = 0;
+	if (!conn->preface_done) {
+		if (conn->in.len < H2_PREFACE_LEN) {
+			if (!h2_is_preface((char *)conn->in.data, conn->in.len)) return connection_error(conn, H2_PROTOCOL_ERROR);
+			return 0;
+		}
+		if (memcmp(conn->in.data, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+			return connection_error(conn, H2_PROTOCOL_ERROR);
+		}
+		conn->preface_done = 1;
+		off = H2_PREFACE_LEN;
+	}
+
+	int status = 0;
+	while (conn->in.len - off >= FRAME_HEADER_LEN) {
+		const unsigned char *h = conn->in.data + off;
+		size_t frame_len = ((size_t)h[0] << 16) | (h[1] << 8) | h[2];
+		if (frame_len > MAX_FRAME_SIZE) {
+			status = connection_error(conn, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (conn->in.len - off < FRAME_HEADER_LEN + frame_len) break;
+
+		uint32_t stream_id = read_u32(h + 5) & MAX_WINDOW;
+		status = handle_frame(conn, h[3], h[4], stream_id, h + FRAME_HEADER_LEN, frame_len);
+		off += FRAME_HEADER_LEN + frame_len;
+		if (status == -1) break;
+	}
+
+	memmove(conn->in.data, conn->in.data + off, conn->in.len - off);
+	conn->in.len -= off;
+	return status;
+}
+
+static int queue_header_block(h2_conn *conn, uint32_t stream_id, hpack_buf *block, int end_stream) {
+	size_t off = 0;
+	int type = FRAME_HEADERS;
+	do {
+		size_t len = block->len - off;
+		if (len > conn->peer_max_frame) len = conn->peer_max_frame;
+		int flags = off + len == block->len ? FLAG_END_HEADERS : 0;
+		if (type == FRAME_HEADERS && end_stream) flags |= FLAG_END_STREAM;
+		if (queue_frame(conn, type, flags, stream_id, block->data + off, len) == -1) return -1;
+		off += len;
+		type = FRAME_CONTINUATION;
+	} while (off < block->len);
+	return 0;
+}
+
+static int is_connection_header(const char *key) {
+	return strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Transfer-Encoding") == 0 ||
+		strcasecmp(key, "Keep-Alive") == 0 || strcasecmp(key, "Upgrade") == 0;
+}
+
+static int encode_field(h2_conn *conn, hpack_buf *block, const char *key, size_t key_len, const char *value) {
+	char name[MAX_HEADER_KEY_SIZE];
+	if (key_len >= sizeof(name)) return 0;
+	for (size_t i = 0; i < key_len; i++) {
+		name[i] = tolower((unsigned char)key[i]);
+	}
+	name[key_len] = '\0';
+	if (is_connection_header(name)) return 0;
+	return hpack_encode(&conn->encoder, block, name, value);
+}
+
+static int encode_response_headers(h2_conn *conn, http_response *response, hpack_buf *block) {
+	int code = 500;
+	if (response->start_line) {
+		sscanf(response->start_line, "HTTP/%*s %d", &code);
+	}
+	char status[8];
+	snprintf(status, sizeof(status), "%03d", code % 1000);
+	if (hpack_encode(&conn->encoder, block, ":status", status) == -1) return -1;
+
+	for (size_t i = 0; i < response->headers.count; i++) {
+		http_header *h = &response->headers.headers[i];
+		if (encode_field(conn, block, h->key, strlen(h->key), h->value) == -1) return -1;
+	}
+
+	// preformatted header lines (static pack, proxied responses)
+	const char *p = response->raw_headers;
+	const char *end = p ? p + response->raw_headers_len : NULL;
+	while (p && p < end) {
+		const char *line_end = memmem(p, end - p, "\r\n", 2);
+		if (!line_end) break;
+		const char *colon = memchr(p, ':', line_end - p);
+		if (colon) {
+			const char *value = colon + 1;
+			while (value < line_end && *value == ' ') value++;
+			char value_buf[MAX_HEADER_VALUE_SIZE];
+			snprintf(value_buf, sizeof(value_buf), "%.*s", (int)(line_end - value), value);
+			if (encode_field(conn, block, p, colon - p, value_buf) == -1) return -1;
+		}
+		p = line_end + 2;
+	}
+	return 0;
+}
+
+static int collect_body(http_writer *writer, const void *data, size_t len) {
+	return hpack_buf_append(writer->sink_ctx, data, len);
+}
+
+static int read_file(int fd, unsigned char *data, size_t size, off_t offset) {
+	size_t count = 0;
+	while (count < size) {
+		ssize_t nbytes = pread(fd, data + count, size - count, offset + count);
+		if (nbytes == -1 && errno == EINTR) continue;
+		if (nbytes <= 0) return -1;
+		count += nbytes;
+	}
+	return 0;
+}
+
+/*
+ * HTTP/2 sends every body in DATA frames, so bodies that would otherwise go
+ * out through sendfile() or a streaming handler are gathered into body.
+ * Runs where the handler ran, it may block on file I/O.
+ */
+int h2_response_body(http_response *response, hpack_buf *body) {
+	if (response->file) {
+		size_t size = response->body_size;
+		unsigned char *data = malloc(size ? size : 1);
+		if (!data) return -1;
+		if (response->parts) {
+			size_t count = 0;
+			for (size_t i = 0; i < response->part_count; i++) {
+				http_file_part *part = &response->parts[i];
+				memcpy(data + count, part->head, part->head_len);
+				count += part->head_len;
+				if (read_file(response->file->fd, data + count, part->len, part->offset) == -1) {
+					free(data);
+					return -1;
+				}
+				count += part->len;
+			}
+		} else if (read_file(response->file->fd, data, size, response->file_offset) == -1) {
+			free(data);
+			return -1;
+		}
+		hpack_buf_free(body);
+		body->data = data;
+		body->len = size;
+		body->cap = size ? size : 1;
+		return 0;
+	}
+	if (response->stream) {
+		http_writer writer = { .fd = -1, .bytes_sent = 0, .error = 0, .sink = collect_body, .sink_ctx = body };
+		response->stream(&writer, response->stream_ctx);
+		return writer.error ? -1 : 0;
+	}
+	return 0;
+}
+
+/*
+ * Queues the response of a dispatched stream. The body is sent by
+ * h2_conn_flush() as the flow-control windows allow. Returns -1 if the
+ * connection has already been closed, in which case it may have been freed.
+ */
+int h2_stream_respond(h2_conn *conn, h2_stream *stream) {
+	conn->pending--;
+	if (conn->closed) {
+		free_stream(conn, stream);
+		if (conn->pending == 0) free_conn(conn);
+		return -1;
+	}
+	if (stream->reset) {
+		free_stream(conn, stream);
+		return 0;
+	}
+
+	http_response *response = &stream->response;
+	if (stream->data.len > 0 || response->file || response->stream) {
+		stream->out = (const char *)stream->data.data;
+		stream->out_len = stream->data.len;
+	} else {
+		stream->out = response->resp_body ? response->resp_body : response->body_ref;
+		stream->out_len = stream->out ? response->body_size : 0;
+	}
+
+	hpack_buf block = {0};
+	if (encode_response_headers(conn, response, &block) == -1 ||
+	    queue_header_block(conn, stream->id, &block, stream->out_len == 0) == -1) {
+		connection_error(conn, H2_INTERNAL_ERROR);
+	}
+	hpack_buf_free(&block);
+	stream->dispatched = 0;
+	if (stream->out_len == 0) {
+		free_stream(conn, stream);
+	}
+	return 0;
+}
+
+void h2_stream_abort(h2_conn *conn, h2_stream *stream) {
+	conn->pending--;
+	if (!conn->closed && !stream->reset) {
+		queue_rst_stream(conn, stream->id, H2_INTERNAL_ERROR);
+	}
+	free_stream(conn, stream);
+	if (conn->closed && conn->pending == 0) free_conn(conn);
+}
+
+/*
+ * Moves response bodies into DATA frames, one frame per stream per round so
+ * that concurrent responses are interleaved on the connection.
+ */
+static void pump_streams(h2_conn *conn) {
+	int progress = 1;
+	while (progress && conn->send_window > 0 && conn->out.len - conn->out_off < OUT_HIGH_WATER) {
+		progress = 0;
+		h2_stream *stream = conn->streams;
+		while (stream) {
+			h2_stream *next = stream->next;
+			if (stream->dispatched || stream->out_len == 0 || stream->send_window <= 0 || conn->send_window <= 0) {
+				stream = next;
+				continue;
+			}
+			size_t len = stream->out_len;
+			if (len > conn->peer_max_frame) len = conn->peer_max_frame;
+			if (len > (size_t)stream->send_window) len = stream->send_window;
+			if (len > (size_t)conn->send_window) len = conn->send_window;
+
+			int end_stream = len == stream->out_len;
+			queue_frame(conn, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id, stream->out, len);
+			stream->out += len;
+			stream->out_len -= len;
+			stream->send_window -= len;
+			conn->send_window -= len;
+			progress = 1;
+			if (end_stream) {
+				free_stream(conn, stream);
+			}
+			stream = next;
+		}
+	}
+}
+
+/*
+ * Writes queued frames without blocking. Returns 1 while output is left,
+ * 0 when everything has been written and -1 on a socket error.
+ */
+int h2_conn_flush(h2_conn *conn) {
+	pump_streams(conn);
+	while (conn->out_off < conn->out.len) {
+		ssize_t nbytes = write(conn->fd, conn->out.data + conn->out_off, conn->out.len - conn->out_off);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			return -1;
+		}
+		conn->out_off += nbytes;
+		if (conn->out_off == conn->out.len) {
+			conn->out.len = 0;
+			conn->out_off = 0;
+			pump_streams(conn);
+		}
+	}
+	return 0;
+}
+
+int h2_conn_wants_write(h2_conn *conn) {
+	return conn->out_off < conn->out.len;
+}
+
+/*
+ * A connection is finished once its GOAWAY is written after an error, or
+ * once all streams are done after the peer sent GOAWAY.
+ */
+int h2_conn_finished(h2_conn *conn) {
+	if (h2_conn_wants_write(conn)) return 0;
+	return conn->failed || (conn->goaway && conn->streams == NULL);
+}
+
+/*
+ * Releases the connection once its socket is closed. Streams still being
+ * handled keep it alive until they are responded to.
+ */
+void h2_conn_close(h2_conn *conn) {
+	conn->closed = 1;
+	conn->goaway = 1;
+	if (conn->pending == 0) {
+		free_conn(conn);
+	}
+}
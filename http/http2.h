@@ -0,0 +1,89 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http-parser.h"
+#include "http-response.h"
+#include "hpack.h"
+
+/*
+ * Cleartext HTTP/2 (h2c) connections. The connection parses frames fed to
+ * it by the event loop, hands every complete request to the dispatch
+ * callback and multiplexes the responses back as DATA frames within the
+ * peer's flow-control windows. Frames are queued in an output buffer that
+ * the event loop drains with h2_conn_flush() when the socket is writable.
+ * Request bodies are buffered until their stream ends, 16 MB at most per
+ * connection; streams that would go over it are refused.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+typedef struct h2_conn h2_conn;
+typedef struct h2_stream h2_stream;
+
+typedef void (*h2_dispatch_fn)(h2_conn *conn, h2_stream *stream, void *ctx);
+
+struct h2_stream {
+	uint32_t id;
+	int state;
+	int end_stream;         // END_STREAM seen on a header block that isn't complete yet
+	int dispatched;         // the request is being handled by the application
+	int reset;              // RST_STREAM arrived while dispatched
+	http_request request;   // owned by the stream, valid until it is responded to
+	char *target;
+	hpack_buf header_block;
+	hpack_buf body;
+	http_response response;
+	hpack_buf data;         // response body for responses not backed by memory
+	const char *out;        // response body still to send
+	size_t out_len;
+	int32_t send_window;
+	int32_t recv_window;
+	h2_stream *next;
+};
+
+struct h2_conn {
+	int fd;
+	int closed;
+	int goaway;
+	int failed;
+	hpack_table decoder;
+	hpack_table encoder;
+	hpack_buf in;
+	hpack_buf out;
+	size_t out_off;
+	int preface_done;
+	uint32_t last_stream_id;
+	uint32_t continuation_stream;
+	int32_t send_window;
+	int32_t recv_window;
+	size_t buffered;        // request body bytes held by the streams
+	uint32_t peer_initial_window;
+	uint32_t peer_max_frame;
+	int open_streams;
+	int pending;            // streams dispatched but not yet responded to
+	h2_stream *streams;
+	h2_dispatch_fn dispatch;
+	void *ctx;
+};
+
+int h2_is_preface(const char *buf, size_t len);
+
+h2_conn *h2_conn_new(int fd, h2_dispatch_fn dispatch, void *ctx);
+int h2_conn_upgrade(h2_conn *conn, http_request *request);
+int h2_conn_feed(h2_conn *conn, const unsigned char *buf, size_t len);
+int h2_conn_flush(h2_conn *conn);
+int h2_conn_wants_write(h2_conn *conn);
+int h2_conn_finished(h2_conn *conn);
+void h2_conn_close(h2_conn *conn);
+
+int h2_response_body(http_response *response, hpack_buf *body);
+int h2_stream_respond(h2_conn *conn, h2_stream *stream);
+
+// Gives up on a dispatched stream, the peer gets RST_STREAM with INTERNAL_ERROR.
+void h2_stream_abort(h2_conn *conn, h2_stream *stream);
+
+#endif // HTTP2_H
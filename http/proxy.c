@@ -0,0 +1,1035 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "proxy.h"
+#include "http-body.h"
+#include "config.h"
+#include "tcp.h"
+
+#define MAX_UPSTREAMS 16
+#define PROXY_IDLE_MAX 8            // idle connections per upstream and thread
+#define PROXY_HEAD_MAX 8192         // largest upstream response head
+#define PROXY_BUF_SIZE 16384
+#define PROXY_TIMEOUT 30            // seconds, blocking path
+#define HEALTH_INTERVAL_MS 2000
+#define HEALTH_TIMEOUT_MS 1000
+#define CONNECT_TIMEOUT_MS 5000     // non-blocking path, see proxy_session_check()
+#define FIRST_BYTE_TIMEOUT_MS 30000
+#define IDLE_TIMEOUT_MS 30000
+
+typedef struct {
+	char name[128];             // host:port, sent as Host if the client sent none
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int healthy;
+	int outstanding;            // requests in flight, across all workers
+} upstream;
+
+static upstream upstreams[MAX_UPSTREAMS];
+static int upstream_count = 0;
+static const char *health_path = NULL;
+static long health_interval = HEALTH_INTERVAL_MS;
+static long connect_timeout = CONNECT_TIMEOUT_MS;
+static long first_byte_timeout = FIRST_BYTE_TIMEOUT_MS;
+static long idle_timeout = IDLE_TIMEOUT_MS;
+
+static _Thread_local int idle_fds[MAX_UPSTREAMS][PROXY_IDLE_MAX];
+static _Thread_local int idle_count[MAX_UPSTREAMS];
+
+static const char *method_names[] = { "GET", "POST", "PUT" };
+
+static void set_timeouts(int fd, long ms) {
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t nbytes = write(fd, buf, len);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+static void set_health(upstream *u, int healthy) {
+	if (__atomic_exchange_n(&u->healthy, healthy, __ATOMIC_RELAXED) != healthy) {
+		printf("proxy: upstream %s is %s\n", u->name, healthy ? "up" : "down");
+	}
+}
+
+static int probe(upstream *u) {
+	int fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return 0;
+	set_timeouts(fd, HEALTH_TIMEOUT_MS);
+
+	int healthy = connect(fd, (struct sockaddr *)&u->addr, u->addr_len) == 0;
+	if (healthy && health_path) {
+		char buf[256];
+		int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", health_path, u->name);
+		int code = 0;
+		ssize_t nbytes;
+		if (write_all(fd, buf, len) == 0 && (nbytes = read(fd, buf, sizeof(buf) - 1)) > 0) {
+			buf[nbytes] = '\0';
+			sscanf(buf, "HTTP/%*s %d", &code);
+		}
+		healthy = code >= 200 && code < 400;
+	}
+	close(fd);
+	return healthy;
+}
+
+static void *run_health_checks(void *arg) {
+	(void)arg;
+	while (1) {
+		for (int i = 0; i < upstream_count; i++) {
+			set_health(&upstreams[i], probe(&upstreams[i]));
+		}
+		usleep(health_interval * 1000);
+	}
+	return NULL;
+}
+
+static int add_upstream(char *spec) {
+	char *colon = strrchr(spec, ':');
+	if (!colon || upstream_count == MAX_UPSTREAMS) {
+		fprintf(stderr, "proxy: invalid upstream %s\n", spec);
+		return -1;
+	}
+	upstream *u = &upstreams[upstream_count];
+	snprintf(u->name, sizeof(u->name), "%s", spec);
+	*colon = '\0';
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *res;
+	int err = getaddrinfo(spec, colon + 1, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "proxy: %s: %s\n", u->name, gai_strerror(err));
+		return -1;
+	}
+	memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+	u->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	u->healthy = 1;
+	upstream_count++;
+	return 0;
+}
+
+// Returns 1 if upstreams are configured, 0 if not and -1 on errors.
+int proxy_init(void) {
+	const char *list = config_string("HTTP_UPSTREAMS", NULL);
+	if (!list) {
+		return 0;
+	}
+	health_path = config_string("HTTP_UPSTREAM_HEALTH", NULL);
+	health_interval = config_int("HTTP_UPSTREAM_HEALTH_MS", HEALTH_INTERVAL_MS);
+	connect_timeout = config_int("HTTP_UPSTREAM_CONNECT_MS", CONNECT_TIMEOUT_MS);
+	first_byte_timeout = config_int("HTTP_UPSTREAM_FIRST_BYTE_MS", FIRST_BYTE_TIMEOUT_MS);
+	idle_timeout = config_int("HTTP_UPSTREAM_IDLE_MS", IDLE_TIMEOUT_MS);
+
+	char *specs = strdup(list);
+	char *saveptr;
+	for (char *spec = strtok_r(specs, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr)) {
+		if (add_upstream(spec) == -1) {
+			free(specs);
+			return -1;
+		}
+	}
+	free(specs);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_health_checks, NULL) != 0) {
+		perror("pthread_create health checks");
+		return -1;
+	}
+	pthread_detach(thread);
+	printf("proxy: %d upstream(s)\n", upstream_count);
+	return 1;
+}
+
+int proxy_enabled(void) {
+	return upstream_count > 0;
+}
+
+// Least outstanding requests; the rotating start spreads ties.
+static int pick_upstream(void) {
+	static unsigned int next = 0;
+	unsigned int start = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+	int best = -1;
+	int best_load = 0;
+	for (int k = 0; k < upstream_count; k++) {
+		int i = (start + k) % upstream_count;
+		if (!__atomic_load_n(&upstreams[i].healthy, __ATOMIC_RELAXED)) continue;
+		int load = __atomic_load_n(&upstreams[i].outstanding, __ATOMIC_RELAXED);
+		if (best == -1 || load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+	if (best != -1) {
+		__atomic_add_fetch(&upstreams[best].outstanding, 1, __ATOMIC_RELAXED);
+	}
+	return best;
+}
+
+static void release_upstream(int u) {
+	__atomic_sub_fetch(&upstreams[u].outstanding, 1, __ATOMIC_RELAXED);
+}
+
+static int pool_take(int u) {
+	while (idle_count[u] > 0) {
+		int fd = idle_fds[u][--idle_count[u]];
+		struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+		if (poll(&pfd, 1, 0) == 0) {
+			return fd;
+		}
+		// closed by the upstream while idle
+		close(fd);
+	}
+	return -1;
+}
+
+static void pool_put(int u, int fd) {
+	if (idle_count[u] < PROXY_IDLE_MAX) {
+		idle_fds[u][idle_count[u]++] = fd;
+		return;
+	}
+	close(fd);
+}
+
+/*
+ * Returns a pooled connection or starts a new one, which is still
+ * connecting if nonblocking is set.
+ */
+static int upstream_open(int u, int nonblocking, int use_pool, int *reused) {
+	int fd = use_pool ? pool_take(u) : -1;
+	*reused = fd != -1;
+	if (fd != -1) {
+		return fd;
+	}
+
+	fd = socket(upstreams[u].addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (!nonblocking) {
+		set_timeouts(fd, PROXY_TIMEOUT * 1000);
+	}
+	if (connect(fd, (struct sockaddr *)&upstreams[u].addr, upstreams[u].addr_len) == -1 && errno != EINPROGRESS) {
+		set_health(&upstreams[u], 0);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int is_hop_by_hop(const char *key) {
+	static const char *names[] = {
+		"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "Expect", "HTTP2-Settings"
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcasecmp(key, names[i]) == 0) return 1;
+	}
+	return 0;
+}
+
+// Request line and end-to-end headers, followed by the first body bytes.
+static char *build_request_head(http_request *request, int u, const char *body, size_t body_len, size_t *len) {
+	size_t cap = 64 + strlen(request->request.request_target) + sizeof(upstreams[u].name) + body_len;
+	for (size_t i = 0; i < request->headers.count; i++) {
+		cap += strlen(request->headers.headers[i].key) + strlen(request->headers.headers[i].value) + 4;
+	}
+	char *head = malloc(cap);
+	if (!head) return NULL;
+
+	size_t n = sprintf(head, "%s %s HTTP/1.1\r\n", method_names[request->request.method], request->request.request_target);
+	if (!http_get_header(request, "Host")) {
+		n += sprintf(head + n, "Host: %s\r\n", upstreams[u].name);
+	}
+	for (size_t i = 0; i < request->headers.count; i++) {
+		http_header *h = &request->headers.headers[i];
+		if (!is_hop_by_hop(h->key)) {
+			n += sprintf(head + n, "%s: %s\r\n", h->key, h->value);
+		}
+	}
+	n += sprintf(head + n, "\r\n");
+	memcpy(head + n, body, body_len);
+	*len = n + body_len;
+	return head;
+}
+
+typedef struct {
+	int code;
+	int keep_alive;
+	int until_close;            // no framing, the body ends when the upstream closes
+	http_body_decoder body;
+	char *start_line;
+	char *headers;              // "Key: value\r\n" lines passed on to the client
+	size_t headers_len;
+} upstream_response;
+
+static void free_upstream_response(upstream_response *resp) {
+	free(resp->start_line);
+	free(resp->headers);
+	resp->start_line = NULL;
+	resp->headers = NULL;
+}
+
+/*
+ * Parses the upstream response head at the start of buf. Returns its
+ * length, 0 if it isn't complete yet and -1 if it is invalid. The framing
+ * headers are only passed on if keep_framing is set, otherwise the body is
+ * framed again on the way out.
+ */
+static int parse_response_head(const char *buf, size_t len, int keep_framing, upstream_response *resp) {
+	const char *end = memmem(buf, len, "\r\n\r\n", 4);
+	if (!end) {
+		return len >= PROXY_HEAD_MAX ? -1 : 0;
+	}
+	size_t head_len = end + 4 - buf;
+
+	const char *line_end = memmem(buf, head_len, "\r\n", 2);
+	int minor = 0;
+	if (sscanf(buf, "HTTP/1.%d %3d", &minor, &resp->code) != 2 || resp->code < 100) {
+		return -1;
+	}
+	resp->keep_alive = minor >= 1;
+	resp->start_line = strndup(buf, line_end - buf);
+	resp->headers = malloc(head_len);
+	resp->headers_len = 0;
+	if (!resp->start_line || !resp->headers) {
+		free_upstream_response(resp);
+		return -1;
+	}
+
+	char transfer_encoding[64] = "";
+	char content_length[32] = "";
+	for (const char *p = line_end + 2; p < end; ) {
+		const char *eol = memmem(p, end + 2 - p, "\r\n", 2);
+		const char *colon = memchr(p, ':', eol - p);
+		if (colon) {
+			int key_len = colon - p;
+			const char *value = colon + 1;
+			while (value < eol && (*value == ' ' || *value == '\t')) value++;
+			int value_len = eol - value;
+
+			int framing = 0;
+			if (key_len == 17 && strncasecmp(p, "Transfer-Encoding", 17) == 0) {
+				snprintf(transfer_encoding, sizeof(transfer_encoding), "%.*s", value_len, value);
+				framing = 1;
+			} else if (key_len == 14 && strncasecmp(p, "Content-Length", 14) == 0) {
+				snprintf(content_length, sizeof(content_length), "%.*s", value_len, value);
+				framing = 1;
+			}
+			int hop = (key_len == 10 && strncasecmp(p, "Connection", 10) == 0) ||
+				(key_len == 10 && strncasecmp(p, "Keep-Alive", 10) == 0);
+			if (hop && memmem(value, value_len, "close", 5)) {
+				resp->keep_alive = 0;
+			}
+			if (!hop && (keep_framing || !framing)) {
+				memcpy(resp->headers + resp->headers_len, p, eol + 2 - p);
+				resp->headers_len += eol + 2 - p;
+			}
+		}
+		p = eol + 2;
+	}
+
+	int has_body = resp->code >= 200 && resp->code != 204 && resp->code != 304;
+	resp->until_close = has_body && !transfer_encoding[0] && !content_length[0];
+	if (resp->until_close) {
+		resp->keep_alive = 0;
+	}
+	if (http_body_init_framing(&resp->body,
+			has_body && transfer_encoding[0] ? transfer_encoding : NULL,
+			has_body && content_length[0] ? content_length : NULL, SIZE_MAX) != 0) {
+		free_upstream_response(resp);
+		return -1;
+	}
+	return head_len;
+}
+
+static const char *reason_phrase(int code) {
+	switch (code) {
+	case 400: return "Bad Request";
+	case 413: return "Payload Too Large";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	default: return "Bad Gateway";
+	}
+}
+
+static int no_body_cb(const char *chunk, size_t len, void *ctx) {
+	(void)chunk;
+	(void)len;
+	(void)ctx;
+	return 0;
+}
+
+/* Blocking path */
+
+typedef struct {
+	int upstream;
+	int fd;
+	upstream_response resp;
+	char *rest;                 // body bytes that came with the head
+	size_t rest_len;
+} proxy_exchange;
+
+static void finish_exchange(proxy_exchange *ex, int reusable) {
+	if (ex->fd == -1) return;
+	if (reusable) {
+		pool_put(ex->upstream, ex->fd);
+	} else {
+		close(ex->fd);
+	}
+	ex->fd = -1;
+	release_upstream(ex->upstream);
+}
+
+static void free_exchange(void *ctx) {
+	proxy_exchange *ex = ctx;
+	finish_exchange(ex, 0);
+	free_upstream_response(&ex->resp);
+	free(ex->rest);
+	free(ex);
+}
+
+static int write_to_client(const char *chunk, size_t len, void *ctx) {
+	return http_writer_write(ctx, chunk, len);
+}
+
+static int stream_upstream_body(http_writer *writer, void *ctx) {
+	proxy_exchange *ex = ctx;
+	upstream_response *resp = &ex->resp;
+	char buf[PROXY_BUF_SIZE];
+	char *data = ex->rest;
+	ssize_t len = ex->rest_len;
+
+	while (1) {
+		if (len > 0) {
+			if (resp->until_close) {
+				if (http_writer_write(writer, data, len) == -1) break;
+			} else {
+				ssize_t used = http_body_feed(&resp->body, data, len, write_to_client, writer);
+				if (used == -1) break;
+				if (used < len) resp->keep_alive = 0;
+			}
+		}
+		if (!resp->until_close && http_body_done(&resp->body)) {
+			// hand the connection back on this thread, the response may be freed elsewhere
+			finish_exchange(ex, resp->keep_alive);
+			return 0;
+		}
+		len = read(ex->fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR) {
+			len = 0;
+			continue;
+		}
+		if (len == 0 && resp->until_close) {
+			finish_exchange(ex, 0);
+			return 0;
+		}
+		if (len <= 0) break;
+		data = buf;
+	}
+	finish_exchange(ex, 0);
+	return -1;
+}
+
+static int proxy_error(http_response *response, int code) {
+	char line[64];
+	snprintf(line, sizeof(line), "%s\n", reason_phrase(code));
+	response->resp_body = strdup(line);
+	response->body_size = response->resp_body ? strlen(line) : 0;
+	snprintf(line, sizeof(line), "%zu", response->body_size);
+	add_http_header(response, "Content-Type", "text/plain");
+	add_http_header(response, "Content-Length", line);
+	response->code = code;
+	switch (code) {
+	case 400: response->start_line = "HTTP/1.1 400 Bad Request"; break;
+	case 413: response->start_line = "HTTP/1.1 413 Payload Too Large"; break;
+	case 501: response->start_line = "HTTP/1.1 501 Not Implemented"; break;
+	case 503: response->start_line = "HTTP/1.1 503 Service Unavailable"; break;
+	default: response->start_line = "HTTP/1.1 502 Bad Gateway"; break;
+	}
+	return 0;
+}
+
+/*
+ * Sends the request to the upstream. Returns 0, an HTTP status for errors
+ * on the client side, -2 if the upstream connection failed before anything
+ * was sent (*replayable tells whether the request can be sent again) and
+ * -1 for other upstream errors.
+ */
+static int send_request(http_request *request, proxy_exchange *ex, int *replayable) {
+	http_body_decoder decoder;
+	int status = http_body_init(&decoder, request);
+	if (status != 0) return status;
+
+	size_t prefix = 0;
+	if (request->body_len > 0 && !http_body_done(&decoder)) {
+		ssize_t used = http_body_feed(&decoder, request->body, request->body_len, no_body_cb, NULL);
+		if (used == -1) return decoder.error;
+		prefix = used;
+	}
+	size_t head_len;
+	char *head = build_request_head(request, ex->upstream, request->body, prefix, &head_len);
+	if (!head) return 500;
+	status = write_all(ex->fd, head, head_len);
+	free(head);
+	if (status == -1) return -2;
+
+	if (http_body_done(&decoder)) {
+		return 0;
+	}
+	*replayable = 0;
+	if (request->fd == -1) return 400;
+	if (http_send_continue(request) == -1) return 500;
+
+	char buf[PROXY_BUF_SIZE];
+	while (!http_body_done(&decoder)) {
+		ssize_t nbytes = read(request->fd, buf, sizeof(buf));
+		if (nbytes == -1 && errno == EINTR) continue;
+		if (nbytes <= 0) return 400;
+		ssize_t used = http_body_feed(&decoder, buf, nbytes, no_body_cb, NULL);
+		if (used == -1) return decoder.error;
+		if (write_all(ex->fd, buf, used) == -1) return -1;
+	}
+	return 0;
+}
+
+// Reads up to the end of the response head, skipping 1xx responses. Returns
+// -2 if the upstream closed without answering at all.
+static int read_response_head(proxy_exchange *ex) {
+	char buf[PROXY_HEAD_MAX];
+	size_t len = 0;
+	while (1) {
+		ssize_t nbytes = read(ex->fd, buf + len, sizeof(buf) - len);
+		if (nbytes == -1 && errno == EINTR) continue;
+		if (nbytes <= 0) return len == 0 ? -2 : -1;
+		len += nbytes;
+
+		int head_len;
+		while ((head_len = parse_response_head(buf, len, 0, &ex->resp)) > 0 && ex->resp.code < 200) {
+			free_upstream_response(&ex->resp);
+			memmove(buf, buf + head_len, len - head_len);
+			len -= head_len;
+		}
+		if (head_len == -1) return -1;
+		if (head_len > 0) {
+			ex->rest_len = len - head_len;
+			ex->rest = malloc(ex->rest_len + 1);
+			if (!ex->rest) {
+				perror("malloc");
+				return -1;
+			}
+			memcpy(ex->rest, buf + head_len, ex->rest_len);
+			return 0;
+		}
+	}
+}
+
+int handle_proxy(http_request *request, http_response *response) {
+	printf("handle proxy\n");
+	proxy_exchange *ex = calloc(1, sizeof(proxy_exchange));
+	if (!ex) {
+		perror("calloc");
+		return proxy_error(response, 502);
+	}
+	ex->fd = -1;
+
+	int attempts = 0;
+	int status;
+	do {
+		ex->upstream = pick_upstream();
+		if (ex->upstream == -1) {
+			free_exchange(ex);
+			return proxy_error(response, 503);
+		}
+		int reused;
+		ex->fd = upstream_open(ex->upstream, 0, attempts == 0, &reused);
+		if (ex->fd == -1) {
+			// the upstream is marked down now, the next attempt picks another one
+			release_upstream(ex->upstream);
+			status = -2;
+			continue;
+		}
+
+		int replayable = 1;
+		status = send_request(request, ex, &replayable);
+		if (status == 0) {
+			status = read_response_head(ex);
+		}
+		// a pooled connection may have been closed by the upstream in the meantime
+		if (status == -2 && !(reused && replayable)) {
+			status = -1;
+		}
+		if (status == -2) {
+			finish_exchange(ex, 0);
+		}
+	} while (status == -2 && ++attempts < 2);
+
+	if (status != 0) {
+		free_exchange(ex);
+		return proxy_error(response, status > 0 ? status : 502);
+	}
+
+	response->code = ex->resp.code;
+	response->start_line = ex->resp.start_line;
+	response->raw_headers = ex->resp.headers;
+	response->raw_headers_len = ex->resp.headers_len;
+	response->stream_ctx = ex;
+	response->stream_free = free_exchange;
+	if (http_body_done(&ex->resp.body) && !ex->resp.until_close) {
+		// 204, 304 and empty bodies
+		if (ex->resp.body.encoding == BODY_CONTENT_LENGTH) {
+			add_http_header(response, "Content-Length", "0");
+		}
+		finish_exchange(ex, ex->resp.keep_alive && ex->rest_len == 0);
+		return 0;
+	}
+	response->stream = stream_upstream_body;
+	return 0;
+}
+
+/* Non-blocking path */
+
+enum {
+	SESSION_CONNECT,    // waiting for a new upstream connection
+	SESSION_SEND,       // sending the request
+	SESSION_HEAD,       // reading the response head
+	SESSION_BODY,       // relaying the response body
+	SESSION_DONE        // the client gets what's left in the buffer
+};
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t off;
+	size_t cap;
+} proxy_buf;
+
+struct proxy_session {
+	int client_fd;
+	int upstream_fd;
+	int upstream;               // -1 once released
+	int state;
+	int reused;
+	int retried;
+	int streamed;               // body bytes came from the socket, the request can't be replayed
+	int reusable;               // the upstream connection can go back to the pool
+	http_body_decoder request_body;
+	char *replay;               // request head and the first body bytes
+	size_t replay_len;
+	proxy_buf up;               // to the upstream
+	proxy_buf down;             // to the client
+	upstream_response resp;
+	int got_head;
+	char head[PROXY_HEAD_MAX];
+	size_t head_len;
+	long long deadline;         // tcp_now() by which the exchange has to make progress
+};
+
+static int buf_append(proxy_buf *buf, const void *data, size_t len) {
+	if (buf->off == buf->len) {
+		buf->off = buf->len = 0;
+	}
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : PROXY_BUF_SIZE;
+		while (cap < buf->len + len) cap *= 2;
+		char *tmp = realloc(buf->data, cap);
+		if (!tmp) return -1;
+		buf->data = tmp;
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+static int buf_pending(proxy_buf *buf) {
+	return buf->off < buf->len;
+}
+
+// Writes what the buffer holds. Returns -1 on errors, EAGAIN isn't one.
+static int buf_flush(proxy_buf *buf, int fd) {
+	while (buf_pending(buf)) {
+		ssize_t nbytes = write(fd, buf->data + buf->off, buf->len - buf->off);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		buf->off += nbytes;
+	}
+	return 0;
+}
+
+static void reply_error(proxy_session *s, int code) {
+	char reply[256];
+	const char *reason = reason_phrase(code);
+	int len = snprintf(reply, sizeof(reply),
+		"HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+		code, reason, strlen(reason) + 1, reason);
+	buf_append(&s->down, reply, len);
+	s->state = SESSION_DONE;
+}
+
+static void set_deadline(proxy_session *s, long timeout) {
+	s->deadline = tcp_now() + timeout;
+}
+
+static int start_upstream(proxy_session *s, int use_pool) {
+	int fd = upstream_open(s->upstream, 1, use_pool, &s->reused);
+	if (fd == -1) {
+		return -1;
+	}
+	if (s->upstream_fd == -1) {
+		s->upstream_fd = fd;
+	} else {
+		// keep the descriptor number, it is already in the caller's poll set
+		dup2(fd, s->upstream_fd);
+		close(fd);
+	}
+	s->state = s->reused ? SESSION_SEND : SESSION_CONNECT;
+	set_deadline(s, s->reused ? idle_timeout : connect_timeout);
+	s->up.off = s->up.len = 0;
+	return buf_append(&s->up, s->replay, s->replay_len);
+}
+
+proxy_session *proxy_session_new(http_request *request, int client_fd) {
+	printf("proxy session\n");
+	proxy_session *s = calloc(1, sizeof(proxy_session));
+	if (!s) {
+		perror("calloc");
+		return NULL;
+	}
+	s->client_fd = client_fd;
+	s->upstream_fd = -1;
+	s->upstream = -1;
+	set_deadline(s, idle_timeout);
+	fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+	int status = http_body_init(&s->request_body, request);
+	size_t prefix = 0;
+	if (status == 0 && request->body_len > 0 && !http_body_done(&s->request_body)) {
+		ssize_t used = http_body_feed(&s->request_body, request->body, request->body_len, no_body_cb, NULL);
+		status = used == -1 ? s->request_body.error : 0;
+		prefix = used == -1 ? 0 : used;
+	}
+	if (status != 0) {
+		reply_error(s, status);
+		return s;
+	}
+
+	int code = 503;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		s->upstream = pick_upstream();
+		if (s->upstream == -1) break;
+		free(s->replay);
+		s->replay = build_request_head(request, s->upstream, request->body, prefix, &s->replay_len);
+		if (s->replay && start_upstream(s, 1) == 0) break;
+		// the upstream is marked down now, the next attempt picks another one
+		release_upstream(s->upstream);
+		s->upstream = -1;
+		code = 502;
+	}
+	if (s->upstream == -1) {
+		reply_error(s, code);
+		return s;
+	}
+
+	const char *expect = http_get_header(request, "Expect");
+	if (!http_body_done(&s->request_body) && expect && strcasecmp(expect, "100-continue") == 0) {
+		const char *line = "HTTP/1.1 100 Continue\r\n\r\n";
+		buf_append(&s->down, line, strlen(line));
+	}
+	return s;
+}
+
+int proxy_session_client_fd(proxy_session *s) {
+	return s->client_fd;
+}
+
+int proxy_session_upstream_fd(proxy_session *s) {
+	return s->upstream_fd;
+}
+
+short proxy_session_client_events(proxy_session *s) {
+	if (buf_pending(&s->down)) {
+		return POLLOUT;
+	}
+	if (s->state == SESSION_SEND && !buf_pending(&s->up) && !http_body_done(&s->request_body)) {
+		return POLLIN;
+	}
+	return 0;
+}
+
+short proxy_session_upstream_events(proxy_session *s) {
+	switch (s->state) {
+	case SESSION_CONNECT:
+		return POLLOUT;
+	case SESSION_SEND:
+		return buf_pending(&s->up) ? POLLOUT : 0;
+	case SESSION_HEAD:
+		return POLLIN;
+	case SESSION_BODY:
+		// read more only once the client took the last buffer
+		return buf_pending(&s->down) ? 0 : POLLIN;
+	default:
+		return 0;
+	}
+}
+
+int proxy_session_upstream_done(proxy_session *s) {
+	return s->upstream_fd != -1 && s->state == SESSION_DONE;
+}
+
+void proxy_session_release_upstream(proxy_session *s) {
+	if (s->upstream_fd != -1) {
+		if (s->reusable) {
+			pool_put(s->upstream, s->upstream_fd);
+		} else {
+			close(s->upstream_fd);
+		}
+		s->upstream_fd = -1;
+	}
+	if (s->upstream != -1) {
+		release_upstream(s->upstream);
+		s->upstream = -1;
+	}
+}
+
+static int session_finished(proxy_session *s) {
+	return s->state == SESSION_DONE && !buf_pending(&s->down);
+}
+
+static void upstream_failed(proxy_session *s) {
+	// a pooled connection may have been closed by the upstream while idle,
+	// a new one may have been refused
+	int replayable = !s->streamed && !s->got_head && s->head_len == 0;
+	if (!s->retried && replayable && (s->reused || s->state == SESSION_CONNECT)) {
+		s->retried = 1;
+		if (!__atomic_load_n(&upstreams[s->upstream].healthy, __ATOMIC_RELAXED)) {
+			release_upstream(s->upstream);
+			s->upstream = pick_upstream();
+			if (s->upstream == -1) {
+				reply_error(s, 503);
+				return;
+			}
+		}
+		if (start_upstream(s, 0) == 0) {
+			return;
+		}
+	}
+	s->reusable = 0;
+	if (!s->got_head) {
+		reply_error(s, 502);
+		set_deadline(s, idle_timeout);
+	} else {
+		// the client sees a truncated body
+		s->state = SESSION_DONE;
+	}
+}
+
+static void relay_body(proxy_session *s, const char *data, size_t len) {
+	upstream_response *resp = &s->resp;
+	if (resp->until_close) {
+		buf_append(&s->down, data, len);
+		return;
+	}
+	ssize_t used = http_body_feed(&resp->body, data, len, no_body_cb, NULL);
+	if (used == -1) {
+		upstream_failed(s);
+		return;
+	}
+	buf_append(&s->down, data, used);
+	if (http_body_done(&resp->body)) {
+		s->reusable = resp->keep_alive && (size_t)used == len;
+		s->state = SESSION_DONE;
+	}
+}
+
+static void read_head(proxy_session *s) {
+	ssize_t nbytes = read(s->upstream_fd, s->head + s->head_len, sizeof(s->head) - s->head_len);
+	if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if (nbytes <= 0) {
+		upstream_failed(s);
+		return;
+	}
+	s->head_len += nbytes;
+
+	int head_len;
+	while ((head_len = parse_response_head(s->head, s->head_len, 1, &s->resp)) > 0 && s->resp.code < 200) {
+		free_upstream_response(&s->resp);
+		memmove(s->head, s->head + head_len, s->head_len - head_len);
+		s->head_len -= head_len;
+	}
+	if (head_len == -1) {
+		upstream_failed(s);
+		return;
+	}
+	if (head_len == 0) return;
+
+	// the client connection closes after this response
+	s->got_head = 1;
+	buf_append(&s->down, s->resp.start_line, strlen(s->resp.start_line));
+	buf_append(&s->down, "\r\n", 2);
+	buf_append(&s->down, s->resp.headers, s->resp.headers_len);
+	const char *close_line = "Connection: close\r\n\r\n";
+	buf_append(&s->down, close_line, strlen(close_line));
+
+	s->state = SESSION_BODY;
+	if (http_body_done(&s->resp.body) && !s->resp.until_close) {
+		s->reusable = s->resp.keep_alive && s->head_len == (size_t)head_len;
+		s->state = SESSION_DONE;
+	} else if (s->head_len > (size_t)head_len) {
+		relay_body(s, s->head + head_len, s->head_len - head_len);
+	}
+}
+
+// Moves to SESSION_HEAD once the whole request is with the upstream
+static void request_sent(proxy_session *s) {
+	if (!buf_pending(&s->up) && http_body_done(&s->request_body)) {
+		s->state = SESSION_HEAD;
+		set_deadline(s, first_byte_timeout);
+	}
+}
+
+int proxy_session_on_upstream(proxy_session *s, short revents) {
+	if (s->state == SESSION_CONNECT) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(s->upstream_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			set_health(&upstreams[s->upstream], 0);
+			upstream_failed(s);
+			return session_finished(s);
+		}
+		s->state = SESSION_SEND;
+	}
+
+	if (s->state == SESSION_SEND) {
+		set_deadline(s, idle_timeout);
+		if (buf_flush(&s->up, s->upstream_fd) == -1) {
+			upstream_failed(s);
+		} else {
+			request_sent(s);
+		}
+	} else if (s->state == SESSION_HEAD) {
+		read_head(s);
+		if (s->head_len > 0) {
+			// the first byte is in, the rest of the head only has to keep coming
+			set_deadline(s, idle_timeout);
+		}
+	} else if (s->state == SESSION_BODY) {
+		set_deadline(s, idle_timeout);
+		char buf[PROXY_BUF_SIZE];
+		ssize_t nbytes = read(s->upstream_fd, buf, sizeof(buf));
+		if (nbytes > 0) {
+			relay_body(s, buf, nbytes);
+		} else if (nbytes == 0 && s->resp.until_close) {
+			s->state = SESSION_DONE;
+		} else if (nbytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+			upstream_failed(s);
+		}
+	} else if (revents & (POLLHUP | POLLERR)) {
+		s->reusable = 0;
+	}
+
+	// the first bytes go out right away instead of waiting for the next poll
+	if (buf_flush(&s->down, s->client_fd) == -1) {
+		return 1;
+	}
+	return session_finished(s);
+}
+
+int proxy_session_on_client(proxy_session *s, short revents) {
+	if (revents & POLLOUT) {
+		if (buf_flush(&s->down, s->client_fd) == -1) {
+			return 1;
+		}
+		if (s->state == SESSION_BODY || s->state == SESSION_DONE) {
+			set_deadline(s, idle_timeout);
+		}
+	}
+	if ((revents & POLLIN) && s->state == SESSION_SEND && !buf_pending(&s->up)) {
+		char buf[PROXY_BUF_SIZE];
+		ssize_t nbytes = read(s->client_fd, buf, sizeof(buf));
+		if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+			return 0;
+		}
+		if (nbytes <= 0) {
+			// the client went away in the middle of its request
+			return 1;
+		}
+		s->streamed = 1;
+		set_deadline(s, idle_timeout);
+		ssize_t used = http_body_feed(&s->request_body, buf, nbytes, no_body_cb, NULL);
+		if (used == -1) {
+			s->reusable = 0;
+			reply_error(s, s->request_body.error);
+			return session_finished(s);
+		}
+		buf_append(&s->up, buf, used);
+		if (buf_flush(&s->up, s->upstream_fd) == -1) {
+			upstream_failed(s);
+		} else {
+			request_sent(s);
+		}
+	} else if ((revents & (POLLHUP | POLLERR)) && !(revents & POLLOUT)) {
+		return 1;
+	}
+	return session_finished(s);
+}
+
+int proxy_session_check(proxy_session *s, long long now) {
+	if (now < s->deadline) {
+		return 0;
+	}
+	if (s->got_head || s->state == SESSION_DONE) {
+		// the response is under way or the client doesn't take it, nothing left to answer with
+		return 1;
+	}
+	printf("proxy: upstream timed out\n");
+	if (s->state == SESSION_CONNECT) {
+		set_health(&upstreams[s->upstream], 0);
+	}
+	s->reusable = 0;
+	reply_error(s, 504);
+	set_deadline(s, idle_timeout);
+	return session_finished(s);
+}
+
+void proxy_session_free(proxy_session *s) {
+	if (!s) return;
+	proxy_session_release_upstream(s);
+	free_upstream_response(&s->resp);
+	free(s->replay);
+	free(s->up.data);
+	free(s->down.data);
+	free(s);
+}
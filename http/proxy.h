@@ -0,0 +1,67 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "http-parser.h"
+#include "http-response.h"
+
+/*
+ * Reverse proxy behind the ROUTE_PROXY routes. Upstreams are configured as
+ * HTTP_UPSTREAMS="127.0.0.1:9001,127.0.0.1:9002"; without it the proxy
+ * routes are skipped.
+ *
+ * Every request goes to the healthy upstream with the fewest requests in
+ * flight. Upstream connections are kept alive in per-thread pools, so every
+ * worker reuses its own connections without locking. A health thread
+ * probes each upstream every HTTP_UPSTREAM_HEALTH_MS, with a plain connect
+ * or, if HTTP_UPSTREAM_HEALTH names a path, a GET that must answer 2xx/3xx.
+ * Failed connects take an upstream out until the next successful probe.
+ *
+ * handle_proxy() is the blocking path for the prethreaded workers and
+ * HTTP/2 streams, the upstream body is streamed through response->stream.
+ * proxy_session is the non-blocking path for event loops: the loop polls
+ * the client and the upstream socket with the events the session asks for
+ * and feeds it the results. Bytes are relayed as they arrive, one buffer
+ * at a time, so neither side is ever fully buffered. A session has
+ * HTTP_UPSTREAM_CONNECT_MS (default 5 s) to connect, then
+ * HTTP_UPSTREAM_FIRST_BYTE_MS (30 s) from the end of the request to the
+ * first byte of the response, and HTTP_UPSTREAM_IDLE_MS (30 s) whenever it
+ * waits on either side otherwise.
+ */
+
+int proxy_init(void);
+int proxy_enabled(void);
+
+int handle_proxy(http_request *request, http_response *response);
+
+typedef struct proxy_session proxy_session;
+
+/*
+ * Takes over client_fd (switched to non-blocking) for the rest of the
+ * exchange. NULL if out of memory, client_fd is left to the caller then.
+ */
+proxy_session *proxy_session_new(http_request *request, int client_fd);
+
+int proxy_session_client_fd(proxy_session *session);
+int proxy_session_upstream_fd(proxy_session *session);    // -1 if none is in use
+short proxy_session_client_events(proxy_session *session);
+short proxy_session_upstream_events(proxy_session *session);
+
+// Both return 1 once the exchange is over and the session can be freed.
+int proxy_session_on_client(proxy_session *session, short revents);
+int proxy_session_on_upstream(proxy_session *session, short revents);
+
+/*
+ * Called by the loop every so often. Answers 504 if the upstream missed its
+ * deadline before the response started, returns 1 if the exchange has to
+ * be given up (the response is cut short, or the client stopped reading).
+ */
+int proxy_session_check(proxy_session *session, long long now);
+
+// The upstream connection is no longer needed, take it out of the poll set and release it.
+int proxy_session_upstream_done(proxy_session *session);
+void proxy_session_release_upstream(proxy_session *session);
+
+// Releases the upstream connection too, the client fd is left to the caller.
+void proxy_session_free(proxy_session *session);
+
+#endif // PROXY_H
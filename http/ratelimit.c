@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "admission.h"
+#include "config.h"
+
+#define RATE_SHARDS 64
+#define RATE_SHARD_SLOTS 256    // 16384 clients in 512 KB
+#define RATE_PROBE 8            // slots looked at per lookup
+#define RATE_MAX 1000000        // per second, keeps the bucket math in 64 bits
+#define TOKEN 1000              // buckets count thousandths of a token
+#define OPEN_COUNTERS 65536     // open connection counts, 256 KB
+
+static const char too_many[] =
+	"HTTP/1.1 429 Too Many Requests\r\n"
+	"Content-Length: 0\r\n"
+	"Retry-After: 1\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+typedef struct {
+	unsigned int rate;      // tokens per second, 0 if the limit is off
+	unsigned int burst;     // bucket size in tokens
+} rate_limit;
+
+/*
+ * A bucket is one word, so it can be updated with a single CAS: the time of
+ * the last refill in ms in the high half, the tokens left in the low half.
+ * 0 stands for a full bucket.
+ */
+typedef struct {
+	unsigned long long key;     // 0 for a free slot
+	unsigned long long conn;
+	unsigned long long req;
+	unsigned int used;          // ms of the last lookup, for eviction
+} rate_slot;
+
+typedef struct {
+	rate_slot slots[RATE_SHARD_SLOTS];
+} __attribute__((aligned(64))) rate_shard;
+
+static rate_shard *shards = NULL;
+static rate_limit conn_limit;
+static rate_limit req_limit;
+static unsigned int *open_conns = NULL;
+static unsigned int open_max;
+static unsigned int v4_mask;
+static struct timespec started;
+
+static rate_limit read_limit(const char *rate_name, const char *burst_name) {
+	long rate = config_int(rate_name, 0);
+	if (rate <= 0) {
+		return (rate_limit){ 0, 0 };
+	}
+	if (rate > RATE_MAX) rate = RATE_MAX;
+	long burst = config_int(burst_name, rate * 2);
+	if (burst < 1) burst = 1;
+	if (burst > 0xffffffffL / TOKEN) burst = 0xffffffffL / TOKEN;
+	return (rate_limit){ rate, burst };
+}
+
+int ratelimit_init(void) {
+	conn_limit = read_limit("HTTP_RATE_CONN", "HTTP_RATE_CONN_BURST");
+	req_limit = read_limit("HTTP_RATE_REQ", "HTTP_RATE_REQ_BURST");
+	long conn_max = config_int("HTTP_RATE_CONN_MAX", 0);
+	open_max = conn_max > 0 ? conn_max : 0;
+	if (!conn_limit.rate && !req_limit.rate && !open_max) {
+		return 0;
+	}
+	if (open_max) {
+		open_conns = calloc(OPEN_COUNTERS, sizeof(unsigned int));
+		if (!open_conns) {
+			perror("calloc");
+			return -1;
+		}
+	}
+	long prefix = config_int("HTTP_RATE_PREFIX", 32);
+	if (prefix < 0) prefix = 0;
+	if (prefix > 32) prefix = 32;
+	v4_mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+
+	shards = aligned_alloc(64, sizeof(rate_shard) * RATE_SHARDS);
+	if (!shards) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	memset(shards, 0, sizeof(rate_shard) * RATE_SHARDS);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &started);
+	printf("ratelimit: %u connections/s (burst %u), %u requests/s (burst %u), %u open connections per client\n",
+		conn_limit.rate, conn_limit.burst, req_limit.rate, req_limit.burst, open_max);
+	return 1;
+}
+
+int ratelimit_enabled(void) {
+	return shards != NULL;
+}
+
+// ms since ratelimit_init(), never 0
+static unsigned int now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (unsigned int)((ts.tv_sec - started.tv_sec) * 1000 + (ts.tv_nsec - started.tv_nsec) / 1000000) + 1;
+}
+
+ratelimit_key ratelimit_client(const struct sockaddr *addr) {
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		return 1ULL << 32 | (ntohl(in->sin_addr.s_addr) & v4_mask);
+	}
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+			unsigned int v4;
+			memcpy(&v4, &in6->sin6_addr.s6_addr[12], sizeof(v4));
+			return 1ULL << 32 | (ntohl(v4) & v4_mask);
+		}
+		unsigned long long prefix;
+		memcpy(&prefix, in6->sin6_addr.s6_addr, sizeof(prefix));
+		return prefix ? prefix : 1;
+	}
+	return 1;
+}
+
+// splitmix64 finalizer, spreads neighbouring addresses over the shards
+static unsigned long long mix(unsigned long long x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * Finds or inserts the client's slot. Returns NULL if another thread took
+ * the slot we were about to evict, the request is let through then.
+ */
+static rate_slot *lookup(ratelimit_key key, unsigned int now) {
+	unsigned long long hash = mix(key);
+	rate_shard *shard = &shards[hash % RATE_SHARDS];
+	unsigned int start = (hash / RATE_SHARDS) % RATE_SHARD_SLOTS;
+
+	rate_slot *oldest = NULL;
+	unsigned int oldest_age = 0;
+	for (int i = 0; i < RATE_PROBE; i++) {
+		rate_slot *slot = &shard->slots[(start + i) % RATE_SHARD_SLOTS];
+		unsigned long long current = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if (current == 0 && __atomic_compare_exchange_n(&slot->key, &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&slot->used, now, __ATOMIC_RELAXED);
+			return slot;
+		}
+		if (current == key) {
+			__atomic_store_n(&slot->used, now, __ATOMIC_RELAXED);
+			return slot;
+		}
+		unsigned int age = now - __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+		if (!oldest || age > oldest_age) {
+			oldest = slot;
+			oldest_age = age;
+		}
+	}
+
+	// the window is full, take over the entry used longest ago
+	unsigned long long victim = __atomic_load_n(&oldest->key, __ATOMIC_ACQUIRE);
+	if (!__atomic_compare_exchange_n(&oldest->key, &victim, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return victim == key ? oldest : NULL;
+	}
+	__atomic_store_n(&oldest->conn, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&oldest->req, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&oldest->used, now, __ATOMIC_RELAXED);
+	return oldest;
+}
+
+static int take(unsigned long long *bucket, const rate_limit *limit, unsigned int now) {
+	unsigned long long full = (unsigned long long)limit->burst * TOKEN;
+	unsigned long long old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+	while (1) {
+		unsigned long long tokens = full;
+		if (old != 0) {
+			int elapsed = (int)(now - (unsigned int)(old >> 32));
+			// a thread with an older clock reading may come in second
+			if (elapsed < 0) elapsed = 0;
+			// rate tokens per second are rate thousandths per ms
+			tokens = (old & 0xffffffff) + (unsigned long long)elapsed * limit->rate;
+			if (tokens > full) tokens = full;
+		}
+		if (tokens < TOKEN) {
+			return 0;
+		}
+		unsigned long long next = (unsigned long long)now << 32 | (tokens - TOKEN);
+		if (__atomic_compare_exchange_n(bucket, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+}
+
+static int allow(ratelimit_key client, const rate_limit *limit, int request) {
+	if (!shards || !limit->rate) {
+		return 1;
+	}
+	unsigned int now = now_ms();
+	rate_slot *slot = lookup(client, now);
+	if (!slot) {
+		return 1;
+	}
+	return take(request ? &slot->req : &slot->conn, limit, now);
+}
+
+int ratelimit_connection(ratelimit_key client) {
+	return allow(client, &conn_limit, 0);
+}
+
+int ratelimit_request(ratelimit_key client) {
+	return allow(client, &req_limit, 1);
+}
+
+int ratelimit_open(ratelimit_key client) {
+	if (!open_conns) {
+		return 1;
+	}
+	unsigned int *count = &open_conns[mix(client) % OPEN_COUNTERS];
+	unsigned int old = __atomic_load_n(count, __ATOMIC_RELAXED);
+	do {
+		if (old >= open_max) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(count, &old, old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+void ratelimit_close(ratelimit_key client) {
+	if (open_conns) {
+		__atomic_sub_fetch(&open_conns[mix(client) % OPEN_COUNTERS], 1, __ATOMIC_RELAXED);
+	}
+}
+
+void ratelimit_reject(int fd) {
+	reject_connection(fd, too_many, sizeof(too_many) - 1);
+}
@@ -0,0 +1,54 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <sys/socket.h>
+
+/*
+ * Per-client rate limiting, so that one client can't take over the accept
+ * queue or a worker's poll set. Every client address gets two token
+ * buckets: one for new connections, checked right after accept(), and one
+ * for requests, checked before dispatch. A third limit caps the
+ * connections a client holds open at once. All are off unless configured:
+ *
+ *   HTTP_RATE_CONN      connections per second and client
+ *   HTTP_RATE_CONN_BURST                           (default 2x the rate)
+ *   HTTP_RATE_REQ       requests per second and client
+ *   HTTP_RATE_REQ_BURST                            (default 2x the rate)
+ *   HTTP_RATE_CONN_MAX  connections open at once per client
+ *   HTTP_RATE_PREFIX    IPv4 prefix length clients are grouped by (default
+ *                       32), IPv6 clients are always grouped by /64
+ *
+ * The buckets live in a fixed-size hash table split into cache-aligned
+ * shards, so memory stays bounded however many addresses show up. A
+ * client is looked up within a small probe window of its shard; when the
+ * window is full, the entry used longest ago is evicted, an approximate
+ * LRU. Lookups, inserts and bucket updates are all compare-and-swap, no
+ * locks are taken. Open connections are counted in a table of their own
+ * that is never evicted, a count must stay right until its connections
+ * close; clients whose keys hash alike share a count.
+ */
+
+typedef unsigned long long ratelimit_key;
+
+// Returns 1 if any limit is on, 0 if none is configured.
+int ratelimit_init(void);
+int ratelimit_enabled(void);
+
+ratelimit_key ratelimit_client(const struct sockaddr *addr);
+
+// Each takes a token and returns 1, or 0 if the client is over its limit.
+int ratelimit_connection(ratelimit_key client);
+int ratelimit_request(ratelimit_key client);
+
+/*
+ * Counts a connection of client as open and returns 1, or 0 (nothing
+ * counted) if the client already has HTTP_RATE_CONN_MAX open. Every
+ * counted connection must be handed to ratelimit_close() once closed.
+ */
+int ratelimit_open(ratelimit_key client);
+void ratelimit_close(ratelimit_key client);
+
+// Answers 429 without blocking and closes fd.
+void ratelimit_reject(int fd);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "sse.h"
+#include "http-body.h"
+#include "http-handlers.h"
+#include "config.h"
+
+#define SSE_HUBS_MAX 64
+#define SSE_MAX_LAG (256 * 1024)
+#define SSE_IOV 64              // messages per writev()
+#define SSE_PUBLISH_MAX (64 * 1024)
+#define SSE_READ_BUF 256
+#define SSE_HEARTBEAT_MS 15000
+
+static const char stream_head[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/event-stream\r\n"
+	"Cache-Control: no-cache\r\n"
+	"\r\n";
+
+struct sse_message {
+	int refs;                   // one per hub that still keeps the message
+	size_t len;
+	char data[];
+};
+
+struct sse_subscriber {
+	int fd;
+	int index;                  // in hub->subs
+	int blocked;                // waiting for POLLOUT
+	unsigned long long seq;     // next message to send
+	size_t offset;              // bytes of it already sent
+	unsigned long long sent;    // stream offset sent so far
+};
+
+static sse_hub *hubs[SSE_HUBS_MAX];
+static int hub_count = 0;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long last_id = 0;
+static size_t max_lag = SSE_MAX_LAG;
+static int publish_enabled = 0;
+static long heartbeat_ms = SSE_HEARTBEAT_MS;
+
+void sse_init(void) {
+	long lag = config_int("HTTP_SSE_MAX_LAG", SSE_MAX_LAG);
+	max_lag = lag > 0 ? (size_t)lag : SSE_MAX_LAG;
+	publish_enabled = config_int("HTTP_SSE_PUBLISH", 0) != 0;
+	heartbeat_ms = config_int("HTTP_SSE_HEARTBEAT_MS", SSE_HEARTBEAT_MS);
+}
+
+int sse_enabled(void) {
+	return hub_count > 0;
+}
+
+int sse_hub_init(sse_hub *hub, void (*wake)(void *), void (*update)(void *, int, short), void *ctx) {
+	if (hub_count == SSE_HUBS_MAX) {
+		fprintf(stderr, "sse: more than %d hubs\n", SSE_HUBS_MAX);
+		return -1;
+	}
+	memset(hub, 0, sizeof(*hub));
+	pthread_mutex_init(&hub->lock, NULL);
+	hub->wake = wake;
+	hub->update = update;
+	hub->ctx = ctx;
+	hubs[hub_count++] = hub;
+	return 0;
+}
+
+static void release(sse_message *msg) {
+	if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(msg);
+	}
+}
+
+/*
+ * Builds the wire form of an event. Data lines are split on '\n' and lose
+ * their '\r', an event name is cut at the first line break.
+ */
+static sse_message *serialize(unsigned long long id, const char *event, const char *data, size_t len) {
+	size_t lines = 1;
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] == '\n') lines++;
+	}
+	size_t event_len = event ? strcspn(event, "\r\n") : 0;
+	// "id: " and 20 digits, "event: ", "data: " and '\n' per line, the blank line
+	size_t size = 32 + event_len + 8 + len + lines * 7 + 1;
+	sse_message *msg = malloc(sizeof(sse_message) + size);
+	if (!msg) {
+		perror("malloc");
+		return NULL;
+	}
+
+	char *p = msg->data;
+	p += sprintf(p, "id: %llu\n", id);
+	if (event_len > 0) {
+		p += sprintf(p, "event: %.*s\n", (int)event_len, event);
+	}
+	const char *line = data;
+	const char *end = data + len;
+	while (1) {
+		const char *newline = memchr(line, '\n', end - line);
+		const char *stop = newline ? newline : end;
+		memcpy(p, "data: ", 6);
+		p += 6;
+		for (const char *c = line; c < stop; c++) {
+			if (*c != '\r') *p++ = *c;
+		}
+		*p++ = '\n';
+		if (!newline) break;
+		line = newline + 1;
+	}
+	*p++ = '\n';
+	msg->len = p - msg->data;
+	return msg;
+}
+
+int sse_publish(const char *event, const char *data, size_t len) {
+	if (hub_count == 0) {
+		return 0;
+	}
+	// one publisher at a time, so every hub sees the events in id order
+	pthread_mutex_lock(&publish_lock);
+	sse_message *msg = serialize(last_id + 1, event, data, len);
+	if (!msg) {
+		pthread_mutex_unlock(&publish_lock);
+		return -1;
+	}
+	last_id++;
+	msg->refs = hub_count;
+
+	for (int i = 0; i < hub_count; i++) {
+		sse_hub *hub = hubs[i];
+		pthread_mutex_lock(&hub->lock);
+		if (hub->inbox_len == hub->inbox_cap) {
+			size_t cap = hub->inbox_cap ? hub->inbox_cap * 2 : 16;
+			sse_message **inbox = realloc(hub->inbox, cap * sizeof(sse_message *));
+			if (!inbox) {
+				pthread_mutex_unlock(&hub->lock);
+				perror("realloc");
+				release(msg);
+				continue;
+			}
+			hub->inbox = inbox;
+			hub->inbox_cap = cap;
+		}
+		hub->inbox[hub->inbox_len++] = msg;
+		int wake = !hub->pending;
+		__atomic_store_n(&hub->pending, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&hub->lock);
+		if (wake) {
+			hub->wake(hub->ctx);
+		}
+	}
+	pthread_mutex_unlock(&publish_lock);
+	return 0;
+}
+
+sse_subscriber *sse_subscribe(sse_hub *hub, int fd) {
+	// the socket is fresh, the head fits into its send buffer
+	if (write(fd, stream_head, sizeof(stream_head) - 1) != sizeof(stream_head) - 1) {
+		return NULL;
+	}
+	if (hub->sub_count == hub->sub_cap) {
+		int cap = hub->sub_cap ? hub->sub_cap * 2 : 64;
+		sse_subscriber **subs = realloc(hub->subs, cap * sizeof(sse_subscriber *));
+		if (!subs) {
+			perror("realloc");
+			return NULL;
+		}
+		hub->subs = subs;
+		hub->sub_cap = cap;
+	}
+	sse_subscriber *sub = calloc(1, sizeof(sse_subscriber));
+	if (!sub) {
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	sub->fd = fd;
+	sub->index = hub->sub_count;
+	sub->seq = hub->head;
+	sub->sent = hub->bytes;
+	hub->subs[hub->sub_count++] = sub;
+	return sub;
+}
+
+void sse_unsubscribe(sse_hub *hub, sse_subscriber *sub) {
+	sse_subscriber *last = hub->subs[--hub->sub_count];
+	hub->subs[sub->index] = last;
+	last->index = sub->index;
+	free(sub);
+}
+
+static void drop(sse_hub *hub, sse_subscriber *sub) {
+	int fd = sub->fd;
+	sse_unsubscribe(hub, sub);
+	hub->update(hub->ctx, fd, 0);
+}
+
+static void advance(sse_hub *hub, sse_subscriber *sub, size_t nbytes) {
+	sub->sent += nbytes;
+	while (nbytes > 0) {
+		size_t left = hub->ring[sub->seq % SSE_RING].msg->len - sub->offset;
+		if (nbytes < left) {
+			sub->offset += nbytes;
+			return;
+		}
+		nbytes -= left;
+		sub->seq++;
+		sub->offset = 0;
+	}
+}
+
+/*
+ * Writes what the subscriber hasn't sent yet straight from the ring, until
+ * it is caught up or its socket is full. Returns -1 if the connection
+ * failed.
+ */
+static int flush(sse_hub *hub, sse_subscriber *sub) {
+	while (sub->seq < hub->head) {
+		struct iovec iov[SSE_IOV];
+		int n = 0;
+		size_t offset = sub->offset;
+		for (unsigned long long seq = sub->seq; seq < hub->head && n < SSE_IOV; seq++) {
+			sse_message *msg = hub->ring[seq % SSE_RING].msg;
+			iov[n++] = (struct iovec){ msg->data + offset, msg->len - offset };
+			offset = 0;
+		}
+		ssize_t nbytes = writev(sub->fd, iov, n);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!sub->blocked) {
+					sub->blocked = 1;
+					hub->update(hub->ctx, sub->fd, POLLIN | POLLOUT);
+				}
+				return 0;
+			}
+			return -1;
+		}
+		advance(hub, sub, nbytes);
+	}
+	if (sub->blocked) {
+		sub->blocked = 0;
+		hub->update(hub->ctx, sub->fd, POLLIN);
+	}
+	return 0;
+}
+
+static int lagging(sse_hub *hub, sse_subscriber *sub) {
+	return sub->seq < hub->tail || hub->bytes - sub->sent > max_lag;
+}
+
+void sse_on_events(sse_hub *hub, sse_subscriber *sub, short revents) {
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		// nothing is expected after the request, a read of 0 means the client left
+		char buf[SSE_READ_BUF];
+		ssize_t nbytes = read(sub->fd, buf, sizeof(buf));
+		if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			drop(hub, sub);
+			return;
+		}
+	}
+	if ((revents & POLLOUT) && (lagging(hub, sub) || flush(hub, sub) == -1)) {
+		drop(hub, sub);
+	}
+}
+
+static void append(sse_hub *hub, sse_message *msg) {
+	if (hub->sub_count == 0) {
+		release(msg);
+		return;
+	}
+	if (hub->head - hub->tail == SSE_RING) {
+		// whoever still needs the oldest message is too far behind and gets dropped
+		release(hub->ring[hub->tail % SSE_RING].msg);
+		hub->tail++;
+	}
+	hub->bytes += msg->len;
+	hub->ring[hub->head % SSE_RING] = (sse_entry){ msg, hub->bytes };
+	hub->head++;
+}
+
+// Writes the ring out to every subscriber that isn't blocked
+static void flush_all(sse_hub *hub) {
+	unsigned long long oldest = hub->head;
+	for (int i = 0; i < hub->sub_count;) {
+		sse_subscriber *sub = hub->subs[i];
+		// blocked subscribers are written to once they report POLLOUT
+		if (lagging(hub, sub) || (!sub->blocked && flush(hub, sub) == -1)) {
+			// the last subscriber moves into slot i
+			drop(hub, sub);
+			continue;
+		}
+		if (sub->seq < oldest) oldest = sub->seq;
+		i++;
+	}
+	// messages every subscriber has sent are let go
+	while (hub->tail < oldest) {
+		release(hub->ring[hub->tail % SSE_RING].msg);
+		hub->tail++;
+	}
+}
+
+void sse_hub_deliver(sse_hub *hub) {
+	if (!__atomic_load_n(&hub->pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&hub->lock);
+	for (size_t i = 0; i < hub->inbox_len; i++) {
+		append(hub, hub->inbox[i]);
+	}
+	hub->inbox_len = 0;
+	__atomic_store_n(&hub->pending, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&hub->lock);
+	flush_all(hub);
+}
+
+void sse_hub_heartbeat(sse_hub *hub, long long now) {
+	if (heartbeat_ms <= 0 || now < hub->next_heartbeat) {
+		return;
+	}
+	hub->next_heartbeat = now + heartbeat_ms;
+	if (hub->sub_count == 0) {
+		return;
+	}
+	// a comment line, it goes through the ring so it never lands inside an event
+	sse_message *msg = malloc(sizeof(sse_message) + 2);
+	if (!msg) {
+		perror("malloc");
+		return;
+	}
+	msg->refs = 1;
+	msg->len = 2;
+	memcpy(msg->data, ":\n", 2);
+	append(hub, msg);
+	flush_all(hub);
+}
+
+// Event streams need a connection the event loop holds on to, HTTP/2 streams end up here
+int handle_events(http_request *request, http_response *response) {
+	(void)request;
+	printf("handle events\n");
+	const char *body = "Event streams need HTTP/1.1\n";
+	char length[21];
+	response->resp_body = strdup(body);
+	response->body_size = strlen(body);
+	snprintf(length, sizeof(length), "%zu", response->body_size);
+	add_http_header(response, "Content-Type", "text/plain");
+	add_http_header(response, "Content-Length", length);
+	response->code = 501;
+	response->start_line = "HTTP/1.1 501 Not Implemented";
+	return 0;
+}
+
+typedef struct {
+	char data[SSE_PUBLISH_MAX];
+	size_t len;
+	int too_large;
+} publish_body;
+
+static int collect(const char *chunk, size_t len, void *ctx) {
+	publish_body *body = ctx;
+	if (body->len + len > sizeof(body->data)) {
+		body->too_large = 1;
+		return -1;
+	}
+	memcpy(body->data + body->len, chunk, len);
+	body->len += len;
+	return 0;
+}
+
+/**
+ * POST /events publishes its body as a message event, or as the event
+ * named by ?event=
+ */
+int handle_publish(http_request *request, http_response *response) {
+	printf("handle publish\n");
+	if (!publish_enabled || !sse_enabled()) {
+		return handle_not_found(request, response);
+	}
+
+	publish_body *body = malloc(sizeof(publish_body));
+	if (!body) {
+		return handle_internal_server_error(request, response);
+	}
+	body->len = 0;
+	body->too_large = 0;
+	int status = http_read_body(request, collect, body);
+
+	char event[64] = "";
+	const char *query = strstr(request->request.request_target, "?event=");
+	if (query) {
+		snprintf(event, sizeof(event), "%.*s", (int)strcspn(query + 7, "&"), query + 7);
+	}
+	if (status == 0 && sse_publish(event[0] ? event : NULL, body->data, body->len) == -1) {
+		status = 500;
+	}
+	if (body->too_large) {
+		status = 413;
+	}
+	free(body);
+
+	switch (status) {
+	case 0:
+		response->code = 204;
+		response->start_line = "HTTP/1.1 204 No Content";
+		break;
+	case 400:
+		response->code = 400;
+		response->start_line = "HTTP/1.1 400 Bad Request";
+		break;
+	case 408:
+		response->code = 408;
+		response->start_line = "HTTP/1.1 408 Request Timeout";
+		break;
+	case 413:
+		response->code = 413;
+		response->start_line = "HTTP/1.1 413 Payload Too Large";
+		break;
+	default:
+		response->code = 500;
+		response->start_line = "HTTP/1.1 500 Internal Server Error";
+		break;
+	}
+	add_http_header(response, "Content-Length", "0");
+	return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <pthread.h>
+
+#include "http-parser.h"
+#include "http-response.h"
+
+/*
+ * Server-Sent Events broadcast behind the ROUTE_EVENTS routes. Every event
+ * loop owns an sse_hub with the subscribers it polls, sse_publish() may be
+ * called from any thread.
+ *
+ * A published event is serialized once into a reference-counted message
+ * and appended to every hub, each holding one reference while any of its
+ * subscribers still has to send it. Subscribers don't copy or reference
+ * messages, they only keep a cursor into their hub's ring and write
+ * straight from the shared buffers with writev(). Publishing costs one
+ * append per hub and delivering one writev() per subscriber, so the work
+ * grows with the bytes sent rather than with subscribers times message
+ * size.
+ *
+ * Nothing is buffered for a subscriber whose socket stops taking data. It
+ * is dropped, and its connection closed, once it falls more than
+ * HTTP_SSE_MAX_LAG bytes (default 256 KB) or SSE_RING messages behind;
+ * EventSource clients reconnect on their own. HTTP_SSE_PUBLISH=1 lets
+ * POST /events publish its body, off by default.
+ *
+ * Every HTTP_SSE_HEARTBEAT_MS (default 15 s, 0 turns it off) subscribers
+ * get a ":" comment line, so proxies don't time out a quiet stream and
+ * clients that went away are found by the failing write.
+ *
+ * Each subscriber holds a connection in its loop's poll set. The poll sets
+ * grow as needed, so the ceiling is the process's open file limit, which
+ * tcp_init() raises to the hard limit.
+ */
+
+#define SSE_RING 1024   // messages a hub keeps for subscribers that are behind
+
+typedef struct sse_message sse_message;
+typedef struct sse_subscriber sse_subscriber;
+
+typedef struct {
+	sse_message *msg;
+	unsigned long long end;     // stream offset right after the message
+} sse_entry;
+
+typedef struct {
+	// written by publishers
+	pthread_mutex_t lock;
+	sse_message **inbox;
+	size_t inbox_len;
+	size_t inbox_cap;
+	int pending;                // inbox isn't empty, checked without the lock
+	void (*wake)(void *ctx);    // wakes the loop after a publish
+	/*
+	 * Tells the loop which events to poll fd for. 0 means the subscriber
+	 * was dropped, the loop takes fd out of its poll set and closes it.
+	 */
+	void (*update)(void *ctx, int fd, short events);
+	void *ctx;
+
+	// owned by the loop
+	sse_entry ring[SSE_RING] __attribute__((aligned(64)));
+	unsigned long long head;    // seq of the next message
+	unsigned long long tail;    // seq of the oldest message kept
+	unsigned long long bytes;   // stream offset after the newest message
+	sse_subscriber **subs;
+	int sub_count;
+	int sub_cap;
+	long long next_heartbeat;   // tcp_now() when the next heartbeat is due
+} sse_hub;
+
+void sse_init(void);
+int sse_enabled(void);
+
+// Registers a hub, all hubs must be set up before the first publish.
+int sse_hub_init(sse_hub *hub, void (*wake)(void *), void (*update)(void *, int, short), void *ctx);
+
+/*
+ * Sends the event-stream response head on fd, switches it to non-blocking
+ * and adds it to the hub. NULL on errors, fd is left to the caller then.
+ */
+sse_subscriber *sse_subscribe(sse_hub *hub, int fd);
+
+// Removes the subscriber, the fd is left to the caller.
+void sse_unsubscribe(sse_hub *hub, sse_subscriber *sub);
+
+// Handles poll results on the subscriber's fd.
+void sse_on_events(sse_hub *hub, sse_subscriber *sub, short revents);
+
+// Moves published messages into the ring and writes them out, once per loop turn.
+void sse_hub_deliver(sse_hub *hub);
+
+// Sends the heartbeat once it is due, now is tcp_now(). Called on the loop's timer tick.
+void sse_hub_heartbeat(sse_hub *hub, long long now);
+
+/*
+ * Queues an event for every subscriber. event may be NULL for the default
+ * "message" type, every line of data becomes a data: field.
+ */
+int sse_publish(const char *event, const char *data, size_t len);
+
+int handle_events(http_request *request, http_response *response);
+int handle_publish(http_request *request, http_response *response);
+
+#endif // SSE_H
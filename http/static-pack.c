@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "static-pack.h"
+
+static const char *pack = NULL;
+static size_t pack_size = 0;
+static const static_pack_entry *pack_index = NULL;
+static uint32_t pack_index_size = 0;
+
+uint64_t static_pack_hash(const char *path, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+static int span_valid(static_pack_span span) {
+	return span.offset <= pack_size && span.len <= pack_size - span.offset;
+}
+
+/*
+ * Maps the pack read-only. Pages are faulted in on first use, so startup
+ * does not depend on the size of the pack.
+ */
+int static_pack_open(const char *file_name) {
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(static_pack_header)) {
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap static pack");
+		return -1;
+	}
+
+	const static_pack_header *header = map;
+	pack_size = sb.st_size;
+	if (memcmp(header->magic, STATIC_PACK_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != STATIC_PACK_VERSION ||
+	    header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0 ||
+	    header->index_offset > pack_size ||
+	    (pack_size - header->index_offset) / sizeof(static_pack_entry) < header->index_size) {
+		fprintf(stderr, "%s: not a valid static pack\n", file_name);
+		munmap(map, sb.st_size);
+		pack_size = 0;
+		return -1;
+	}
+
+	pack = map;
+	pack_index = (const static_pack_entry *)(pack + header->index_offset);
+	pack_index_size = header->index_size;
+	printf("static pack %s: %u assets\n", file_name, header->count);
+	return 0;
+}
+
+/*
+ * Looks up path (relative to the static dir). Returns 0 and fills asset
+ * with pointers into the mapping, or -1 if the asset is not packed.
+ */
+int static_pack_lookup(const char *path, int accept_gzip, static_pack_asset *asset) {
+	if (!pack) return -1;
+
+	size_t len = strlen(path);
+	uint64_t hash = static_pack_hash(path, len);
+	for (uint32_t i = 0; i < pack_index_size; i++) {
+		const static_pack_entry *e = &pack_index[(hash + i) & (pack_index_size - 1)];
+		if (e->hash == 0) {
+			return -1;
+		}
+		if (e->hash != hash || e->path.len != len || !span_valid(e->path) ||
+		    memcmp(pack + e->path.offset, path, len) != 0) {
+			continue;
+		}
+
+		int gzip = accept_gzip && e->gzip_body.len > 0;
+		// each variant has its own etag, a cache must never mix their bytes
+		static_pack_span etag = gzip ? e->gzip_etag : e->etag;
+		static_pack_span headers = gzip ? e->gzip_headers : e->headers;
+		static_pack_span body = gzip ? e->gzip_body : e->body;
+		if (!span_valid(etag) || !span_valid(headers) || !span_valid(body)) {
+			return -1;
+		}
+		asset->etag = pack + etag.offset;
+		asset->etag_len = etag.len;
+		asset->headers = pack + headers.offset;
+		asset->headers_len = headers.len;
+		asset->body = pack + body.offset;
+		asset->body_len = body.len;
+		return 0;
+	}
+	return -1;
+}
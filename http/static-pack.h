@@ -0,0 +1,59 @@
+#ifndef STATIC_PACK_H
+#define STATIC_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A static pack bundles a static directory into one immutable file that is
+ * built by tools/mkpack.c and memory-mapped by the servers at startup.
+ *
+ * Layout: static_pack_header, the hash index (index_size entries, open
+ * addressing with linear probing), then the data area holding the paths,
+ * ETags, precomputed header blocks and bodies. All offsets are relative
+ * to the start of the file.
+ */
+
+#define STATIC_PACK_MAGIC "HTTPPACK"
+#define STATIC_PACK_VERSION 2
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t index_size;        // power of two
+	uint32_t reserved;
+	uint64_t index_offset;
+} static_pack_header;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} static_pack_span;
+
+typedef struct {
+	uint64_t hash;              // 0 marks an empty slot
+	static_pack_span path;      // relative to the static dir, starts with '/'
+	static_pack_span etag;      // quoted, hash of the content
+	static_pack_span headers;   // "Key: value\r\n" lines for the identity body, Content-Length first
+	static_pack_span body;
+	static_pack_span gzip_etag;  // the identity etag with a -gz suffix
+	static_pack_span gzip_headers;
+	static_pack_span gzip_body; // len 0 when there is no precompressed variant
+} static_pack_entry;
+
+typedef struct {
+	const char *etag;
+	size_t etag_len;
+	const char *headers;
+	size_t headers_len;
+	const char *body;
+	size_t body_len;
+} static_pack_asset;
+
+uint64_t static_pack_hash(const char *path, size_t len);
+
+int static_pack_open(const char *file_name);
+int static_pack_lookup(const char *path, int accept_gzip, static_pack_asset *asset);
+
+#endif // STATIC_PACK_H
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tcp.h"
+#include "config.h"
+
+#define TCP_DEFER_ACCEPT_S 1
+#define TCP_FASTOPEN_QUEUE 256
+#define ACCEPT_BACKOFF_MS 10
+
+static int defer_accept = TCP_DEFER_ACCEPT_S;
+static int fastopen = TCP_FASTOPEN_QUEUE;
+static int nodelay = 1;
+static int cork = 1;
+static int busy_poll = 0;
+static int accept_batch = 1;
+
+/*
+ * Every connection is a descriptor, the soft limit (often 1024) would cap
+ * the connections far below what the workers can hold.
+ */
+static void raise_fd_limit(void) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		perror("getrlimit");
+		return;
+	}
+	if (limit.rlim_cur == limit.rlim_max) {
+		return;
+	}
+	rlim_t soft = limit.rlim_cur;
+	limit.rlim_cur = limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		perror("setrlimit");
+		return;
+	}
+	printf("tcp: open file limit raised from %llu to %llu\n",
+		(unsigned long long)soft, (unsigned long long)limit.rlim_max);
+}
+
+void tcp_init(void) {
+	raise_fd_limit();
+	defer_accept = config_int("HTTP_TCP_DEFER_ACCEPT", TCP_DEFER_ACCEPT_S);
+	fastopen = config_int("HTTP_TCP_FASTOPEN", TCP_FASTOPEN_QUEUE);
+	nodelay = config_int("HTTP_TCP_NODELAY", 1) != 0;
+	cork = config_int("HTTP_TCP_CORK", 1) != 0;
+	busy_poll = config_int("HTTP_TCP_BUSY_POLL", 0);
+	accept_batch = config_int("HTTP_TCP_ACCEPT_BATCH", 1);
+	if (accept_batch < 1) accept_batch = 1;
+}
+
+// Options the kernel may not support are only worth a warning
+static void set_option(int fd, int level, int name, int value, const char *what) {
+	if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+		fprintf(stderr, "tcp: %s: %s\n", what, strerror(errno));
+	}
+}
+
+static int fastopen_enabled_by_kernel(void) {
+	FILE *sysctl = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+	int mode = 0;
+	if (sysctl) {
+		if (fscanf(sysctl, "%d", &mode) != 1) mode = 0;
+		fclose(sysctl);
+	}
+	return mode & 2;
+}
+
+int tcp_listen(int port, int backlog) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	int opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+		perror("setsockopt SO_REUSEADDR");
+		close(fd);
+		return -1;
+	}
+	if (defer_accept > 0) {
+		set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, "TCP_DEFER_ACCEPT");
+	}
+	if (fastopen > 0) {
+		set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+		if (!fastopen_enabled_by_kernel()) {
+			printf("tcp: fast open is off in the kernel, set net.ipv4.tcp_fastopen=3 to use it\n");
+		}
+	}
+	if (accept_batch > 1) {
+		// drained with accept4() until EAGAIN after every wakeup
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	struct sockaddr_in address = {0};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)(&address), sizeof(address)) == -1) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, backlog) == -1) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	printf("tcp: defer accept %ds, fast open %d, nodelay %d, cork %d, busy poll %dus, accept batch %d\n",
+		defer_accept, fastopen, nodelay, cork, busy_poll, accept_batch);
+	return fd;
+}
+
+void tcp_tune(int fd) {
+	if (nodelay) {
+		set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	}
+	if (busy_poll > 0) {
+		set_option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "SO_BUSY_POLL");
+	}
+}
+
+int tcp_accept(int listen_fd, tcp_client *clients, int max) {
+	if (max > accept_batch) {
+		max = accept_batch;
+	}
+	int n = 0;
+	while (n < max) {
+		socklen_t socklen = sizeof(clients[n].addr);
+		// the workers read with blocking calls, so the sockets stay blocking
+		int fd = accept4(listen_fd, (struct sockaddr *)&clients[n].addr, &socklen, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (n > 0) break;
+				struct pollfd pfd = { .fd = listen_fd, .events = POLLIN, .revents = 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			int err = errno;
+			perror("accept");
+			// out of descriptors, the listener stays readable until some are closed
+			if (n == 0 && (err == EMFILE || err == ENFILE)) {
+				poll(NULL, 0, ACCEPT_BACKOFF_MS);
+			}
+			break;
+		}
+		tcp_tune(fd);
+		clients[n++].fd = fd;
+	}
+	return n;
+}
+
+int tcp_more_flag(void) {
+	return cork ? MSG_MORE : 0;
+}
+
+long long tcp_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int tcp_wait(int fd, short events, int timeout_ms, long long deadline) {
+	if (deadline > 0) {
+		long long left = deadline - tcp_now();
+		if (left <= 0) return 0;
+		if (left < timeout_ms) timeout_ms = left;
+	}
+	struct pollfd pfd = { .fd = fd, .events = events, .revents = 0 };
+	int ready;
+	do {
+		ready = poll(&pfd, 1, timeout_ms);
+	} while (ready == -1 && errno == EINTR);
+	return ready;
+}
@@ -0,0 +1,61 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <sys/socket.h>
+
+/*
+ * Socket tuning for the listener and the client connections. Every option
+ * can be changed from the environment:
+ *
+ *   HTTP_TCP_DEFER_ACCEPT   seconds the kernel holds a new connection back
+ *                           until its first bytes arrive, so workers are
+ *                           never woken for idle connections (default 1,
+ *                           0 turns it off)
+ *   HTTP_TCP_FASTOPEN       TCP Fast Open queue length, lets returning
+ *                           clients send their request with the SYN
+ *                           (default 256, 0 off; the kernel needs
+ *                           net.ipv4.tcp_fastopen & 2)
+ *   HTTP_TCP_NODELAY        disable Nagle on client connections (default 1)
+ *   HTTP_TCP_CORK           hold a response head back with MSG_MORE until
+ *                           the body follows, so both leave in one segment
+ *                           (default 1). Only the per-send MSG_MORE flag is
+ *                           used, the TCP_CORK socket option is never set
+ *   HTTP_TCP_BUSY_POLL      us to busy-poll the device queue on blocking
+ *                           reads, SO_BUSY_POLL (default 0, off)
+ *   HTTP_TCP_ACCEPT_BATCH   connections accepted per listener wakeup
+ *                           (default 1)
+ */
+
+typedef struct {
+	int fd;
+	struct sockaddr_storage addr;
+} tcp_client;
+
+// Reads the options and raises the open file limit to the hard limit.
+void tcp_init(void);
+
+// Opens, tunes and binds the listener on all addresses, -1 on errors.
+int tcp_listen(int port, int backlog);
+
+/*
+ * Waits for connections and accepts up to HTTP_TCP_ACCEPT_BATCH (at most
+ * max) of them into clients, each already tuned. Returns how many.
+ */
+int tcp_accept(int listen_fd, tcp_client *clients, int max);
+
+// Applies the per-connection options to an accepted socket.
+void tcp_tune(int fd);
+
+// MSG_MORE if response heads should wait for their body, 0 otherwise.
+int tcp_more_flag(void);
+
+// CLOCK_MONOTONIC in ms, the clock of the deadlines below.
+long long tcp_now(void);
+
+/*
+ * Waits up to timeout_ms for events on fd, but never past deadline (0 for
+ * none). Returns 1 once fd is ready, 0 on timeouts and -1 on errors.
+ */
+int tcp_wait(int fd, short events, int timeout_ms, long long deadline);
+
+#endif // TCP_H
@@ -0,0 +1,74 @@
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// The CoDel shed decisions and drop spacing, driven with made-up clocks (us)
+
+#define MS 1000
+
+static int check(const char *name, long long got, long long want) {
+	int ok = got == want;
+	printf("%s: %lld%s\n", name, got, ok ? "" : " <- wrong");
+	return !ok;
+}
+
+int main() {
+	admission_control ac;
+	int failed = 0;
+
+	setenv("HTTP_ADMIT_TARGET_MS", "5", 1);
+	setenv("HTTP_ADMIT_INTERVAL_MS", "100", 1);
+	admission_init(&ac);
+	failed |= check("target", ac.target, 5 * MS);
+	failed |= check("interval", ac.interval, 100 * MS);
+
+	// short waits never shed, a long one only starts the clock
+	long long now = 1000 * MS;
+	failed |= check("below target", admission_should_shed(&ac, now - 4 * MS, now), 0);
+	failed |= check("first above target", admission_should_shed(&ac, now - 10 * MS, now), 0);
+	failed |= check("above target within interval", admission_should_shed(&ac, now + 50 * MS - 10 * MS, now + 50 * MS), 0);
+	// dipping below the target resets the excursion
+	failed |= check("dip below target", admission_should_shed(&ac, now + 60 * MS - 1 * MS, now + 60 * MS), 0);
+	failed |= check("above again", admission_should_shed(&ac, now + 70 * MS - 10 * MS, now + 70 * MS), 0);
+	failed |= check("not yet an interval", admission_should_shed(&ac, now + 160 * MS - 10 * MS, now + 160 * MS), 0);
+
+	// a whole interval above target sheds one and starts dropping
+	now += 170 * MS;
+	failed |= check("standing queue", admission_should_shed(&ac, now - 10 * MS, now), 1);
+	failed |= check("dropping", ac.dropping, 1);
+	failed |= check("next drop after interval", ac.drop_next - now, 100 * MS);
+
+	// between drops nothing is shed, then drops come interval / sqrt(count) apart
+	failed |= check("before next drop", admission_should_shed(&ac, ac.drop_next - 1 - 10 * MS, ac.drop_next - 1), 0);
+	long long expected[] = { 100 * MS / 1.4142135, 100 * MS / 1.7320508, 100 * MS / 2 };
+	for (int i = 0; i < 3; i++) {
+		long long at = ac.drop_next;
+		failed |= check("drop", admission_should_shed(&ac, at - 10 * MS, at), 1);
+		// control_law works in 1/1024 steps
+		long long spacing = ac.drop_next - at;
+		failed |= check("spacing within 0.1%", llabs(spacing - expected[i]) * 1000 < expected[i], 1);
+	}
+	failed |= check("count", ac.count, 4);
+
+	// the queue draining below target ends the dropping state
+	now = ac.drop_next;
+	failed |= check("drained", admission_should_shed(&ac, now - 1 * MS, now), 0);
+	failed |= check("dropping after drain", ac.dropping, 0);
+
+	// a new episode soon after picks up near the previous rate
+	now += 10 * MS;
+	admission_should_shed(&ac, now - 10 * MS, now);
+	now += 100 * MS;
+	failed |= check("new episode", admission_should_shed(&ac, now - 10 * MS, now), 1);
+	failed |= check("count resumed", ac.count, 2);
+
+	// zero or negative settings are clamped to 1 ms
+	setenv("HTTP_ADMIT_TARGET_MS", "0", 1);
+	setenv("HTTP_ADMIT_INTERVAL_MS", "-5", 1);
+	admission_init(&ac);
+	failed |= check("clamped target", ac.target, 1 * MS);
+	failed |= check("clamped interval", ac.interval, 1 * MS);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
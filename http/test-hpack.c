@@ -0,0 +1,65 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <string.h>
+
+// Request examples with Huffman coding from RFC 7541, Appendix C.4
+
+static int print_header(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx) {
+	char *out = ctx;
+	char line[256];
+	snprintf(line, sizeof(line), "%.*s: %.*s\n", (int)name_len, name, (int)value_len, value);
+	strcat(out, line);
+	return 0;
+}
+
+static int decode_hex(hpack_table *table, const char *hex, char *out) {
+	unsigned char buf[256];
+	size_t len = 0;
+	for (const char *p = hex; p[0] && p[1]; p += 2) {
+		sscanf(p, "%2hhx", &buf[len++]);
+	}
+	out[0] = '\0';
+	return hpack_decode(table, buf, len, print_header, out);
+}
+
+int main() {
+	hpack_table decoder;
+	hpack_table_init(&decoder, HPACK_DEFAULT_TABLE_SIZE);
+	char out[1024];
+	int failed = 0;
+
+	decode_hex(&decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff", out);
+	failed |= strcmp(out, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n") != 0;
+	printf("%s", out);
+
+	decode_hex(&decoder, "828684be5886a8eb10649cbf", out);
+	failed |= strcmp(out, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n") != 0;
+	printf("%s", out);
+
+	decode_hex(&decoder, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", out);
+	failed |= strcmp(out, ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n") != 0;
+	printf("%s", out);
+	failed |= decoder.size != 164;
+
+	// what the encoder produces has to decode to the same fields
+	hpack_table encoder, roundtrip;
+	hpack_table_init(&encoder, HPACK_DEFAULT_TABLE_SIZE);
+	hpack_table_init(&roundtrip, HPACK_DEFAULT_TABLE_SIZE);
+	for (int i = 0; i < 2; i++) {
+		hpack_buf block = {0};
+		hpack_encode(&encoder, &block, ":status", "200");
+		hpack_encode(&encoder, &block, "content-type", "text/html");
+		hpack_encode(&encoder, &block, "content-length", "835");
+		out[0] = '\0';
+		hpack_decode(&roundtrip, block.data, block.len, print_header, out);
+		failed |= strcmp(out, ":status: 200\ncontent-type: text/html\ncontent-length: 835\n") != 0;
+		printf("%zu bytes\n%s", block.len, out);
+		hpack_buf_free(&block);
+	}
+
+	hpack_table_free(&decoder);
+	hpack_table_free(&encoder);
+	hpack_table_free(&roundtrip);
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
@@ -0,0 +1,71 @@
+#include "http-body.h"
+#include <stdio.h>
+#include <string.h>
+
+// Content-Length and chunked bodies fed in pieces, and the framing errors they answer with
+
+static int collect(const char *chunk, size_t len, void *ctx) {
+	char *out = ctx;
+	strncat(out, chunk, len);
+	return 0;
+}
+
+/*
+ * Decodes input step bytes at a time. Returns the status the decoder
+ * answered with, 0 if it didn't fail; *used is the input consumed.
+ */
+static int decode(const char *te, const char *cl, size_t limit, const char *input, size_t step, char *out, size_t *used) {
+	http_body_decoder decoder;
+	out[0] = '\0';
+	*used = 0;
+	int status = http_body_init_framing(&decoder, te, cl, limit);
+	if (status != 0) return status;
+	size_t len = strlen(input);
+	while (*used < len && !http_body_done(&decoder)) {
+		size_t n = len - *used < step ? len - *used : step;
+		ssize_t nbytes = http_body_feed(&decoder, input + *used, n, collect, out);
+		if (nbytes == -1) return decoder.error;
+		*used += nbytes;
+	}
+	return http_body_done(&decoder) ? 0 : -1;
+}
+
+static int expect(const char *name, int status, int want_status, const char *out, const char *want_out) {
+	int ok = status == want_status && (want_out == NULL || strcmp(out, want_out) == 0);
+	printf("%s: %d \"%s\"%s\n", name, status, out, ok ? "" : " <- wrong");
+	return !ok;
+}
+
+int main() {
+	char out[256];
+	size_t used;
+	int failed = 0;
+
+	const char *chunked = "5\r\nhello\r\n6;name=value\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n";
+	for (size_t step = 1; step <= strlen(chunked); step += 7) {
+		failed |= expect("chunked", decode("chunked", NULL, 1024, chunked, step, out, &used), 0, out, "hello world");
+		failed |= used != strlen(chunked);
+	}
+	// the next request on the connection is left alone
+	failed |= expect("pipelined", decode("chunked", NULL, 1024, "3\r\nabc\r\n0\r\n\r\nGET /", 4, out, &used), 0, out, "abc");
+	failed |= used != strlen("3\r\nabc\r\n0\r\n\r\n");
+	failed |= expect("uppercase hex", decode("chunked", NULL, 1024, "A\r\n0123456789\r\n0\r\n\r\n", 3, out, &used), 0, out, "0123456789");
+
+	failed |= expect("size not hex", decode("chunked", NULL, 1024, "zz\r\n", 1, out, &used), 400, out, NULL);
+	failed |= expect("size missing", decode("chunked", NULL, 1024, "\r\nhello\r\n", 1, out, &used), 400, out, NULL);
+	failed |= expect("size line without LF", decode("chunked", NULL, 1024, "5\rhello", 1, out, &used), 400, out, NULL);
+	failed |= expect("data without CRLF", decode("chunked", NULL, 1024, "5\r\nhelloX\r\n0\r\n\r\n", 1, out, &used), 400, out, NULL);
+	failed |= expect("size overflows", decode("chunked", NULL, 1024, "10000000000000000\r\n", 1, out, &used), 413, out, NULL);
+	failed |= expect("chunk over limit", decode("chunked", NULL, 8, "5\r\nhello\r\n5\r\nworld\r\n0\r\n\r\n", 64, out, &used), 413, out, NULL);
+	failed |= expect("other coding", decode("gzip", NULL, 1024, "", 1, out, &used), 501, out, NULL);
+
+	failed |= expect("content-length", decode(NULL, "11", 1024, "hello worldGET /", 5, out, &used), 0, out, "hello world");
+	failed |= used != 11;
+	failed |= expect("empty", decode(NULL, "0", 1024, "GET /", 1, out, &used), 0, out, "");
+	failed |= expect("negative length", decode(NULL, "-1", 1024, "", 1, out, &used), 400, out, NULL);
+	failed |= expect("length not a number", decode(NULL, "12abc", 1024, "", 1, out, &used), 400, out, NULL);
+	failed |= expect("length over limit", decode(NULL, "2048", 1024, "", 1, out, &used), 413, out, NULL);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
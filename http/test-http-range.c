@@ -0,0 +1,112 @@
+#include "http-handlers.h"
+#include "http-parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+// Range and If-Range requests for a 100 byte file, answered by handle_file()
+
+#define FILE_SIZE 100
+
+static const char *get_header(http_response *res, const char *key) {
+	for (size_t i = 0; i < res->headers.count; i++) {
+		if (strcasecmp(res->headers.headers[i].key, key) == 0) {
+			return res->headers.headers[i].value;
+		}
+	}
+	return "";
+}
+
+static int make_file(const char *path, time_t mtime) {
+	FILE *f = fopen(path, "w");
+	if (!f) return -1;
+	for (int i = 0; i < FILE_SIZE; i++) {
+		fputc('0' + i % 10, f);
+	}
+	fclose(f);
+	struct timeval times[2] = { { mtime, 0 }, { mtime, 0 } };
+	return mtime ? utimes(path, times) : 0;
+}
+
+/*
+ * Requests path with the given extra header lines and checks the status
+ * handle_file() returns, the Content-Range it sets and, for single
+ * ranges, the body.
+ */
+static int expect(const char *path, const char *headers, int want_status, const char *want_range, const char *want_body) {
+	char buf[512];
+	snprintf(buf, sizeof(buf), "GET /file HTTP/1.1\r\nHost: localhost\r\n%s\r\n", headers);
+	http_request req = {0};
+	http_response res = {0};
+	if (parse_http_request(buf, &req) == -1) {
+		printf("%s: unparsable\n", headers);
+		return 1;
+	}
+	int status = handle_file(&req, &res, (char *)path);
+	const char *range = get_header(&res, "Content-Range");
+	const char *body = res.resp_body ? res.resp_body : "";
+	int ok = status == want_status && strcmp(range, want_range) == 0 &&
+		(want_body == NULL || strcmp(body, want_body) == 0);
+	printf("%s-> %d \"%s\"%s\n", headers, status, range, ok ? "" : " <- wrong");
+	free_http_request(&req);
+	free_http_response(&res);
+	return !ok;
+}
+
+int main() {
+	char old_path[] = "/tmp/test-http-range-old-XXXXXX";
+	char new_path[] = "/tmp/test-http-range-new-XXXXXX";
+	close(mkstemp(old_path));
+	close(mkstemp(new_path));
+	time_t old = time(NULL) - 3600;
+	if (make_file(old_path, old) == -1 || make_file(new_path, 0) == -1) {
+		perror("make_file");
+		return 1;
+	}
+	char modified[64];
+	strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&old));
+	char if_range[128];
+	int failed = 0;
+
+	failed |= expect(old_path, "", 0, "", NULL);
+	failed |= expect(old_path, "Range: bytes=0-9\r\n", 206, "bytes 0-9/100", "0123456789");
+	failed |= expect(old_path, "Range: bytes=95-\r\n", 206, "bytes 95-99/100", "56789");
+	failed |= expect(old_path, "Range: bytes=98-500\r\n", 206, "bytes 98-99/100", "89");
+
+	// suffix ranges count from the end, a longer one gets the whole file
+	failed |= expect(old_path, "Range: bytes=-3\r\n", 206, "bytes 97-99/100", "789");
+	failed |= expect(old_path, "Range: bytes=-500\r\n", 206, "bytes 0-99/100", NULL);
+
+	// several ranges go out as multipart/byteranges, unless they ask for more than the file
+	failed |= expect(old_path, "Range: bytes=0-1,5-6\r\n", 206, "", NULL);
+	failed |= expect(old_path, "Range: bytes=0-60,40-99\r\n", 0, "", NULL);
+
+	// nothing satisfiable is a 416, a malformed header is ignored
+	failed |= expect(old_path, "Range: bytes=100-\r\n", 416, "bytes */100", NULL);
+	failed |= expect(old_path, "Range: bytes=-0\r\n", 416, "bytes */100", NULL);
+	failed |= expect(old_path, "Range: bytes=5-1\r\n", 0, "", NULL);
+	failed |= expect(old_path, "Range: lines=1-2\r\n", 0, "", NULL);
+
+	// If-Range only keeps the range while it names the file's date
+	snprintf(if_range, sizeof(if_range), "Range: bytes=0-1\r\nIf-Range: %s\r\n", modified);
+	failed |= expect(old_path, if_range, 206, "bytes 0-1/100", "01");
+	failed |= expect(old_path, "Range: bytes=0-1\r\nIf-Range: Thu, 01 Jan 1970 00:00:00 GMT\r\n", 0, "", NULL);
+	failed |= expect(old_path, "Range: bytes=0-1\r\nIf-Range: \"etag\"\r\n", 0, "", NULL);
+
+	// a date within the last second is no strong validator yet
+	time_t now = time(NULL);
+	char fresh[64];
+	strftime(fresh, sizeof(fresh), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+	snprintf(if_range, sizeof(if_range), "Range: bytes=0-1\r\nIf-Range: %s\r\n", fresh);
+	failed |= expect(new_path, if_range, 0, "", NULL);
+	failed |= expect(new_path, "Range: bytes=0-1\r\n", 206, "bytes 0-1/100", "01");
+
+	unlink(old_path);
+	unlink(new_path);
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
@@ -0,0 +1,59 @@
+#include "ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Token buckets per client and the open connection cap
+
+static int check(const char *name, int got, int want) {
+	int ok = got == want;
+	printf("%s: %d%s\n", name, got, ok ? "" : " <- wrong");
+	return !ok;
+}
+
+int main() {
+	int failed = 0;
+
+	failed |= check("off by default", ratelimit_init(), 0);
+	failed |= check("unlimited request", ratelimit_request(1), 1);
+	failed |= check("unlimited open", ratelimit_open(1), 1);
+
+	setenv("HTTP_RATE_REQ", "10", 1);
+	setenv("HTTP_RATE_REQ_BURST", "3", 1);
+	setenv("HTTP_RATE_CONN_MAX", "2", 1);
+	failed |= check("configured", ratelimit_init(), 1);
+
+	// a full bucket lets the burst through, then the client has to wait
+	ratelimit_key a = 1ULL << 32 | 0x0a000001;
+	ratelimit_key b = 1ULL << 32 | 0x0a000002;
+	for (int i = 0; i < 3; i++) {
+		failed |= check("burst", ratelimit_request(a), 1);
+	}
+	failed |= check("over the burst", ratelimit_request(a), 0);
+	// every client has a bucket of its own, connections aren't limited here
+	failed |= check("other client", ratelimit_request(b), 1);
+	failed |= check("connections unlimited", ratelimit_connection(a), 1);
+
+	// 10 per second refill one token in 100 ms
+	usleep(150 * 1000);
+	failed |= check("refilled", ratelimit_request(a), 1);
+	failed |= check("only one", ratelimit_request(a), 0);
+	// the bucket never holds more than the burst
+	usleep(600 * 1000);
+	for (int i = 0; i < 3; i++) {
+		failed |= check("burst after idle", ratelimit_request(a), 1);
+	}
+	failed |= check("capped at burst", ratelimit_request(a), 0);
+
+	// open connections are counted until closed
+	failed |= check("first open", ratelimit_open(a), 1);
+	failed |= check("second open", ratelimit_open(a), 1);
+	failed |= check("third open", ratelimit_open(a), 0);
+	failed |= check("other client open", ratelimit_open(b), 1);
+	ratelimit_close(a);
+	failed |= check("open after close", ratelimit_open(a), 1);
+	failed |= check("full again", ratelimit_open(a), 0);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "tls.h"
+#include "config.h"
+#include "tcp.h"
+
+#ifdef HTTP_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_HANDSHAKE_TIMEOUT 5000  // ms for the whole handshake
+#define TLS_RELAY_BUF 16384         // one TLS record
+#define TLS_RELAY_MAX 256
+
+static SSL_CTX *ctx = NULL;
+static int relay_max = TLS_RELAY_MAX;
+static int relays = 0;
+
+struct tls_handshake {
+	SSL *ssl;
+	int fd;
+	long long deadline;
+};
+
+// ALPN, in server preference order
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *arg) {
+	(void)ssl;
+	(void)arg;
+	if (SSL_select_next_proto((unsigned char **)out, outlen, alpn_h2, sizeof(alpn_h2) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(int offer_h2) {
+	const char *cert = config_string("HTTP_TLS_CERT", NULL);
+	const char *key = config_string("HTTP_TLS_KEY", NULL);
+	if (!cert && !key) {
+		return 0;
+	}
+	if (!cert || !key) {
+		fprintf(stderr, "tls: HTTP_TLS_CERT and HTTP_TLS_KEY must both be set\n");
+		return -1;
+	}
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// the kernel can't renegotiate, so keep OpenSSL from trying
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	// tickets are stateless, no need for a server-side session cache
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_num_tickets(ctx, 1);
+	if (offer_h2) {
+		SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+	relay_max = config_int("HTTP_TLS_RELAY_MAX", TLS_RELAY_MAX);
+	printf("tls: serving %s\n", cert);
+	return 1;
+}
+
+int tls_enabled(void) {
+	return ctx != NULL;
+}
+
+typedef struct {
+	SSL *ssl;
+	int fd;         // the client connection
+	int plain_fd;   // our end of the socketpair
+} tls_relay;
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t nbytes = write(fd, buf, len);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+/*
+ * Moves data between the TLS connection and the server's end of the
+ * socketpair until either side closes.
+ */
+static void *run_relay(void *arg) {
+	tls_relay *relay = arg;
+	struct pollfd pfds[2] = {
+		{ .fd = relay->fd, .events = POLLIN },
+		{ .fd = relay->plain_fd, .events = POLLIN },
+	};
+	char buf[TLS_RELAY_BUF];
+
+	while (1) {
+		if (SSL_pending(relay->ssl) > 0) {
+			// decrypted bytes are already buffered, don't wait for the socket
+			pfds[0].revents = POLLIN;
+			pfds[1].revents = 0;
+		} else if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("tls relay poll");
+			break;
+		}
+
+		if (pfds[0].revents) {
+			int nbytes = SSL_read(relay->ssl, buf, sizeof(buf));
+			if (nbytes <= 0 || write_all(relay->plain_fd, buf, nbytes) == -1) {
+				break;
+			}
+		}
+		if (pfds[1].revents) {
+			ssize_t nbytes = read(relay->plain_fd, buf, sizeof(buf));
+			if (nbytes <= 0) {
+				SSL_shutdown(relay->ssl);
+				break;
+			}
+			if (SSL_write(relay->ssl, buf, nbytes) <= 0) {
+				break;
+			}
+		}
+	}
+
+	SSL_free(relay->ssl);
+	close(relay->fd);
+	close(relay->plain_fd);
+	free(relay);
+	__atomic_sub_fetch(&relays, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void drop_relay(void) {
+	__atomic_sub_fetch(&relays, 1, __ATOMIC_RELAXED);
+}
+
+// Every relay is a thread, past HTTP_TLS_RELAY_MAX of them connections are refused
+static int start_relay(SSL *ssl, int fd) {
+	static int warned = 0;
+	if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+		printf("tls: kernel TLS unavailable, encrypting in user space\n");
+	}
+	if (__atomic_add_fetch(&relays, 1, __ATOMIC_RELAXED) > relay_max) {
+		drop_relay();
+		printf("tls: %d relays running, refusing connection\n", relay_max);
+		return -1;
+	}
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+		perror("socketpair");
+		drop_relay();
+		return -1;
+	}
+	tls_relay *relay = malloc(sizeof(tls_relay));
+	if (!relay) {
+		close(pair[0]);
+		close(pair[1]);
+		drop_relay();
+		return -1;
+	}
+	relay->ssl = ssl;
+	relay->fd = fd;
+	relay->plain_fd = pair[1];
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, run_relay, relay);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		errno = err;
+		perror("pthread_create tls relay");
+		free(relay);
+		close(pair[0]);
+		close(pair[1]);
+		drop_relay();
+		return -1;
+	}
+	return pair[0];
+}
+
+tls_handshake *tls_handshake_new(int fd) {
+	tls_handshake *hs = malloc(sizeof(tls_handshake));
+	if (!hs) {
+		return NULL;
+	}
+	hs->ssl = SSL_new(ctx);
+	if (!hs->ssl || SSL_set_fd(hs->ssl, fd) != 1) {
+		ERR_clear_error();
+		SSL_free(hs->ssl);
+		free(hs);
+		return NULL;
+	}
+	hs->fd = fd;
+	// the deadline covers the whole handshake, a client trickling its
+	// records gets no more time than one that stalls
+	hs->deadline = tcp_now() + TLS_HANDSHAKE_TIMEOUT;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return hs;
+}
+
+int tls_handshake_step(tls_handshake *hs, short *events, int *plain_fd) {
+	int ret = SSL_accept(hs->ssl);
+	if (ret != 1) {
+		switch (SSL_get_error(hs->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			*events = POLLIN;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			*events = POLLOUT;
+			return 0;
+		default:
+			ERR_clear_error();
+			return -1;
+		}
+	}
+	// the server and the relay expect a blocking socket
+	fcntl(hs->fd, F_SETFL, fcntl(hs->fd, F_GETFL) & ~O_NONBLOCK);
+
+	SSL *ssl = hs->ssl;
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_pending(ssl) == 0) {
+		// the kernel owns the record layer now, OpenSSL is no longer needed
+		*plain_fd = hs->fd;
+		return 1;
+	}
+	*plain_fd = start_relay(ssl, hs->fd);
+	if (*plain_fd == -1) {
+		return -1;
+	}
+	// the relay owns the session now
+	hs->ssl = NULL;
+	return 1;
+}
+
+long long tls_handshake_deadline(const tls_handshake *hs) {
+	return hs->deadline;
+}
+
+void tls_handshake_free(tls_handshake *hs) {
+	if (!hs) {
+		return;
+	}
+	SSL_free(hs->ssl);
+	free(hs);
+}
+
+int tls_accept(int fd) {
+	if (!ctx) {
+		return fd;
+	}
+
+	tls_handshake *hs = tls_handshake_new(fd);
+	if (!hs) {
+		close(fd);
+		return -1;
+	}
+	short events;
+	int plain_fd = -1;
+	int status;
+	while ((status = tls_handshake_step(hs, &events, &plain_fd)) == 0) {
+		if (tcp_wait(fd, events, TLS_HANDSHAKE_TIMEOUT, hs->deadline) <= 0) {
+			status = -1;
+			break;
+		}
+	}
+	tls_handshake_free(hs);
+	if (status == -1) {
+		close(fd);
+		return -1;
+	}
+	return plain_fd;
+}
+
+#else
+
+int tls_init(int offer_h2) {
+	(void)offer_h2;
+	if (config_string("HTTP_TLS_CERT", NULL) || config_string("HTTP_TLS_KEY", NULL)) {
+		fprintf(stderr, "tls: built without TLS support, rebuild with make TLS=1\n");
+		return -1;
+	}
+	return 0;
+}
+
+int tls_enabled(void) {
+	return 0;
+}
+
+tls_handshake *tls_handshake_new(int fd) {
+	(void)fd;
+	return NULL;
+}
+
+int tls_handshake_step(tls_handshake *hs, short *events, int *plain_fd) {
+	(void)hs;
+	(void)events;
+	(void)plain_fd;
+	return -1;
+}
+
+long long tls_handshake_deadline(const tls_handshake *hs) {
+	(void)hs;
+	return 0;
+}
+
+void tls_handshake_free(tls_handshake *hs) {
+	(void)hs;
+}
+
+int tls_accept(int fd) {
+	return fd;
+}
+
+#endif // HTTP_TLS
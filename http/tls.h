@@ -0,0 +1,49 @@
+#ifndef TLS_H
+#define TLS_H
+
+/*
+ * Optional TLS termination on the listener, built with `make TLS=1` and
+ * turned on by pointing HTTP_TLS_CERT and HTTP_TLS_KEY at a PEM certificate
+ * and key (`make certs` creates a self-signed pair for testing).
+ *
+ * OpenSSL only runs the handshake. The session keys are then handed to the
+ * kernel (kTLS, TCP_ULP "tls"), so the connection keeps carrying plaintext
+ * from the server's point of view and read(), writev(), sendfile() and
+ * splice() work unchanged. Kernels or ciphers without kTLS support fall
+ * back to a relay thread that encrypts through OpenSSL in user space, at
+ * most HTTP_TLS_RELAY_MAX (default 256) of them; connections past that
+ * are closed after the handshake.
+ *
+ * Resumed sessions use stateless session tickets. A handshake has 5
+ * seconds in total to finish.
+ */
+
+typedef struct tls_handshake tls_handshake;
+
+// Returns 1 if TLS is on, 0 if it isn't configured and -1 on errors.
+int tls_init(int offer_h2);
+int tls_enabled(void);
+
+/*
+ * Runs the server handshake on fd and returns the descriptor that carries
+ * the plaintext: fd itself with kTLS, the server end of the relay
+ * otherwise. Returns fd unchanged if TLS is off and -1 (fd closed) if the
+ * handshake fails.
+ */
+int tls_accept(int fd);
+
+/*
+ * The same handshake for event loops. tls_handshake_new() switches fd to
+ * non-blocking, NULL on errors. tls_handshake_step() returns 0 while it
+ * waits for *events on fd, -1 if the handshake failed and 1 once it is
+ * done and *plain_fd carries the plaintext (see tls_accept(); fd is
+ * blocking again then). fd is always left to the caller to close, unless
+ * *plain_fd is a relay's, which owns fd from then on.
+ */
+tls_handshake *tls_handshake_new(int fd);
+int tls_handshake_step(tls_handshake *hs, short *events, int *plain_fd);
+// tcp_now() by which the handshake has to be done
+long long tls_handshake_deadline(const tls_handshake *hs);
+void tls_handshake_free(tls_handshake *hs);
+
+#endif // TLS_H
@@ -0,0 +1,93 @@
+#include <stdio.h>
+
+#include "trace.h"
+#include "config.h"
+
+#define TRACE_SLOW_MS 1000
+#define TRACE_SLOW_PER_SEC 10
+
+static const char *phase_names[TRACE_PHASES] = {
+	[TRACE_ACCEPT] = "accept",
+	[TRACE_DEQUEUE] = "queue",
+	[TRACE_READ] = "read",
+	[TRACE_PARSE] = "parse",
+	[TRACE_HANDLER] = "wait",
+	[TRACE_DISPATCH] = "handler",
+	[TRACE_WRITE] = "write",
+};
+
+static long long slow_ns = 0;
+
+// sampling window, shared by all threads
+static long long window = 0;        // current second
+static int sampled = 0;             // dumps in the current second
+static int suppressed = 0;          // slow requests past the limit
+
+void trace_init(void) {
+	slow_ns = config_int("HTTP_SLOW_MS", TRACE_SLOW_MS) * 1000000LL;
+}
+
+// Returns how many slow requests were skipped since the last dump, -1 to skip this one
+static int take_sample(long long now) {
+	long long second = now / 1000000000;
+	long long current = __atomic_load_n(&window, __ATOMIC_RELAXED);
+	if (second != current && __atomic_compare_exchange_n(&window, &current, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&sampled, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_fetch_add(&sampled, 1, __ATOMIC_RELAXED) >= TRACE_SLOW_PER_SEC) {
+		__atomic_fetch_add(&suppressed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return __atomic_exchange_n(&suppressed, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Prints one line per slow request: the total and how long it spent in each
+ * phase, i.e. the time from the previous stamped phase to this one, e.g.
+ *
+ *   slow request: /index.html 1203.114ms: queue 0.021 read 0.140 parse 0.004 wait 1100.385 handler 102.510 (file 102.498) write 0.054
+ */
+static void dump(request_trace *trace, const char *target, long long total, int skipped) {
+	char line[512];
+	int len = snprintf(line, sizeof(line), "slow request: %s %.3fms:", target ? target : "-", total / 1e6);
+	long long prev = 0;
+	for (int i = 0; i < TRACE_PHASES && len < (int)sizeof(line); i++) {
+		if (!trace->at[i]) {
+			continue;
+		}
+		if (prev) {
+			len += snprintf(line + len, sizeof(line) - len, " %s %.3f", phase_names[i], (trace->at[i] - prev) / 1e6);
+		}
+		if (i == TRACE_DISPATCH && trace->file_ns && len < (int)sizeof(line)) {
+			len += snprintf(line + len, sizeof(line) - len, " (file %.3f)", trace->file_ns / 1e6);
+		}
+		prev = trace->at[i];
+	}
+	if (skipped > 0 && len < (int)sizeof(line)) {
+		snprintf(line + len, sizeof(line) - len, " [%d more not shown]", skipped);
+	}
+	fprintf(stderr, "%s\n", line);
+}
+
+void trace_finish(request_trace *trace, const char *target) {
+	long long first = 0, last = 0;
+	for (int i = 0; i < TRACE_PHASES; i++) {
+		if (!trace->at[i]) {
+			continue;
+		}
+		if (!first) {
+			first = trace->at[i];
+		}
+		last = trace->at[i];
+	}
+	long long total = last - first;
+	HTTP_PROBE3(done, trace, total, target);
+
+	if (slow_ns <= 0 || total < slow_ns) {
+		return;
+	}
+	int skipped = take_sample(last);
+	if (skipped >= 0) {
+		dump(trace, target, total, skipped);
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+/*
+ * Per-request phase timestamps. Every request carries a request_trace that
+ * the servers stamp as it moves through accept, the queue, the read loop,
+ * the parser, the handler and the write. Once the response is out,
+ * trace_finish() dumps the breakdown of requests slower than HTTP_SLOW_MS
+ * (default 1000, 0 turns it off), at most TRACE_SLOW_PER_SEC a second.
+ *
+ * Built with `make USDT=1` (needs <sys/sdt.h>, systemtap-sdt-dev), phase
+ * boundaries are also USDT probes in the "http" provider:
+ *
+ *   http:phase(trace, phase, ns)    at every TRACE_MARK
+ *   http:file(trace, ns)            handle_file returned, ns spent in it
+ *   http:done(trace, total_ns, target)
+ *
+ * trace identifies the request, e.g. a latency histogram in ms:
+ *
+ *   bpftrace -e 'usdt:./hybrid/http-server.r:http:done { @ = hist(arg1 / 1000000); }'
+ *
+ * A probe is a single nop until a tracer attaches to it. Without USDT=1
+ * the probes compile to nothing.
+ */
+
+typedef enum {
+	TRACE_ACCEPT,       // accepted by the listener
+	TRACE_DEQUEUE,      // taken off the accept queue by a worker
+	TRACE_READ,         // request head read
+	TRACE_PARSE,        // request head parsed
+	TRACE_HANDLER,      // handler started (hybrid: picked up by the aio pool)
+	TRACE_DISPATCH,     // handler returned
+	TRACE_WRITE,        // response written
+	TRACE_PHASES
+} trace_phase;
+
+typedef struct {
+	long long at[TRACE_PHASES];     // CLOCK_MONOTONIC ns, 0 if the phase wasn't reached
+	long long file_ns;              // time spent in handle_file, part of the handler phase
+} request_trace;
+
+#ifdef HTTP_USDT
+#include <sys/sdt.h>
+#define HTTP_PROBE2(name, a, b) DTRACE_PROBE2(http, name, a, b)
+#define HTTP_PROBE3(name, a, b, c) DTRACE_PROBE3(http, name, a, b, c)
+#else
+#define HTTP_PROBE2(name, a, b) do {} while (0)
+#define HTTP_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+static inline long long trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Stamps a phase, e.g. TRACE_MARK(&request->trace, PARSE)
+#define TRACE_MARK(trace, p) TRACE_MARK_AT(trace, p, trace_now())
+
+#define TRACE_MARK_AT(trace, p, ns) do { \
+	request_trace *trace_ = (trace); \
+	trace_->at[TRACE_##p] = (ns); \
+	HTTP_PROBE3(phase, trace_, TRACE_##p, trace_->at[TRACE_##p]); \
+} while (0)
+
+void trace_init(void);
+
+// Fires http:done with the total and samples the request if it was slow.
+void trace_finish(request_trace *trace, const char *target);
+
+#endif // TRACE_H
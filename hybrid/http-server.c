@@ -4,41 +4,199 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <poll.h>
+#include <sys/mman.h>
 
 #include "http-parser.h"
 #include "http-router.h"
+#include "static-pack.h"
+#include "constants.h"
+#include "aio-threads.h"
+#include "http2.h"
+#include "tls.h"
+#include "admission.h"
+#include "proxy.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "tcp.h"
+#include "http-handlers.h"
+#include "sse.h"
+#include "config.h"
 
 #define BACKLOG 10
+#define ACCEPT_BATCH 64
 #define MAX_CLIENTS 1024
 #define NUM_THREADS 10
 #define READ_BUF 1024
-#define MAX_POLL_FDS 1024
+#define POLL_FDS_INITIAL 1024   // slots a worker starts with, the poll set doubles when full
 #define POLL_TIMEOUT 50
+#define AIO_THREADS 4
+#define SOCKET_THREADS 16
+#define SOCKET_QUEUE 256
+#define SOCKET_DEADLINE_MS 120000
+#define H2_READ_BUF 16384
+#define HUGE_PAGE (2 * 1024 * 1024)
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond_not_full = PTHREAD_COND_INITIALIZER;
 pthread_cond_t cond_not_empty = PTHREAD_COND_INITIALIZER;
 
-int fd_buf[MAX_CLIENTS];
+// accepted connections waiting for a worker, a FIFO ring
+typedef struct {
+	int fd;
+	long long enqueued;     // admission_now() at accept
+	ratelimit_key client;
+} queued_conn;
+
+queued_conn fd_buf[MAX_CLIENTS];
+int buf_head = 0;
 int buf_size = 0;
-struct pollfd clientpfds[NUM_THREADS][MAX_POLL_FDS];
-int nfds[NUM_THREADS];
-int thread_indices[NUM_THREADS];
+admission_control admission;
 
+typedef struct {
+	tls_handshake *tls;     // set until the TLS handshake is done
+	char *head;             // request head read so far, until it is complete
+	int head_len;
+	h2_conn *h2;            // set once the connection speaks HTTP/2
+	proxy_session *proxy;   // set while the request is proxied, on the client and the upstream slot
+	sse_subscriber *sse;    // set while the connection is subscribed to the event stream
+	int upstream;           // the slot is the proxy's upstream connection
+	long long accepted;     // trace timestamps of the connection, carried
+	long long dequeued;     // into its request
+	ratelimit_key client;
+} conn_state;
 
-void add_fd(int fd, int tid) {
+/*
+ * Everything a worker owns. Each worker starts on a cache line of its own,
+ * so updating its poll set never invalidates a line another worker reads.
+ * The completion queue is written by the aio threads and the sse hub's
+ * inbox by publishers, each starts a line of its own as well.
+ */
+typedef struct {
+	int id;
+	int nfds;               // slots in use, including detached ones
+	int cap;                // slots pfds and conns have room for
+	int grown;              // pfds and conns were moved out of the initial allocation
+	int detached;           // slots waiting for compact_fds()
+	int slot_of_len;
+	int *slot_of;           // fd -> slot, -1 if fd isn't in the poll set
+	long long next_sweep;   // tcp_now() when expire_conns() runs next
+	struct pollfd *pfds;
+	conn_state *conns;
+	aio_completion_queue cq __attribute__((aligned(64)));
+	sse_hub sse __attribute__((aligned(64)));
+} __attribute__((aligned(64))) worker_state;
 
-	if (nfds[tid] >= MAX_POLL_FDS) {
-	    	close(fd);
-		errno = EMFILE;
-    		perror("Thread full, rejecting connection");
-		return;
+worker_state *workers;
+
+/*
+ * The file pool runs the handlers, which only wait on the disk. Work that
+ * waits on a client, reading a request body or writing out a streamed or
+ * file body, runs on the socket pool, bounded in threads and queue length
+ * and with a deadline on each request (HTTP_SOCKET_THREADS,
+ * HTTP_SOCKET_DEADLINE_MS), so slow clients can only tie up the socket
+ * pool, and only for so long.
+ */
+aio_pool file_pool;
+aio_pool socket_pool;
+long socket_deadline = SOCKET_DEADLINE_MS;
+
+/*
+ * A request handed to the aio pool. The connection is taken out of the
+ * worker's poll set while the pool owns it and is finished by the worker
+ * once the task is posted back.
+ */
+typedef struct {
+	aio_task task;
+	int fd;
+	int sent;
+	int limited;            // over the client's request rate, answered with 429
+	int overloaded;         // no room on the socket pool, answered with 503
+	ratelimit_key client;   // the connection is counted as open until the task closes it
+	char buf[READ_BUF];
+	http_request request;
+	http_response response;
+} http_task;
+
+// A request on an HTTP/2 stream handed to the aio pool
+typedef struct {
+	aio_task task;
+	worker_state *worker;
+	int limited;
+	int overloaded;
+	h2_conn *conn;
+	h2_stream *stream;
+} h2_task;
+
+
+int find_fd(worker_state *w, int fd) {
+	return fd >= 0 && fd < w->slot_of_len ? w->slot_of[fd] : -1;
+}
+
+/*
+ * Makes room for n more slots, doubling the poll set when it is full. The
+ * first POLL_FDS_INITIAL slots live in the workers' allocation, every
+ * growth copies pfds and conns into new arrays. This also happens in the
+ * middle of the walk over the poll results, through add_fd() from
+ * start_proxy() and handle_tls_events(), so slots are always reached by
+ * index through w and no pfds or conns address is kept across a call that
+ * may add a slot. Slots added during the walk have no revents yet.
+ */
+int reserve_slots(worker_state *w, int n) {
+	if (w->nfds + n <= w->cap) {
+		return 0;
+	}
+	int cap = w->cap * 2;
+	while (cap < w->nfds + n) cap *= 2;
+	struct pollfd *pfds = malloc(cap * sizeof(struct pollfd));
+	conn_state *conns = malloc(cap * sizeof(conn_state));
+	if (!pfds || !conns) {
+		perror("malloc");
+		free(pfds);
+		free(conns);
+		return -1;
+	}
+	memcpy(pfds, w->pfds, w->nfds * sizeof(struct pollfd));
+	memcpy(conns, w->conns, w->nfds * sizeof(conn_state));
+	if (w->grown) {
+		free(w->pfds);
+		free(w->conns);
+	}
+	w->pfds = pfds;
+	w->conns = conns;
+	w->cap = cap;
+	w->grown = 1;
+	printf("worker: %d poll set grown to %d slots\n", w->id, cap);
+	return 0;
+}
+
+// Returns the slot, or -1 if there was no room for fd and it was rejected
+int add_fd(worker_state *w, int fd) {
+
+	if (reserve_slots(w, 1) == -1) {
+		printf("worker: %d full, rejecting connection\n", w->id);
+		admission_reject(fd);
+		return -1;
+	}
+	if (fd >= w->slot_of_len) {
+		int len = w->slot_of_len ? w->slot_of_len : POLL_FDS_INITIAL;
+		while (len <= fd) len *= 2;
+		int *slot_of = realloc(w->slot_of, len * sizeof(int));
+		if (!slot_of) {
+			perror("realloc");
+			admission_reject(fd);
+			return -1;
+		}
+		for (int i = w->slot_of_len; i < len; i++) {
+			slot_of[i] = -1;
+		}
+		w->slot_of = slot_of;
+		w->slot_of_len = len;
 	}
 
 	struct pollfd pfd = {
@@ -46,157 +204,749 @@ void add_fd(int fd, int tid) {
     		.events = POLLIN,
     		.revents = 0
 	};
-	clientpfds[tid][nfds[tid]] = pfd;
-	nfds[tid]++;
+	int slot = w->nfds++;
+	w->pfds[slot] = pfd;
+	w->conns[slot] = (conn_state){0};
+	w->slot_of[fd] = slot;
+	return slot;
 }
 
-void pop_fd(int fd, int tid) {
-	for (int i = 0; i < nfds[tid]; i++) {
-		if (clientpfds[tid][i].fd == fd) {
-			close(fd);
-			clientpfds[tid][i] = clientpfds[tid][nfds[tid] - 1];
-			nfds[tid]--;
+/*
+ * Takes fd out of the poll set without closing it. The slot is only marked
+ * free, poll() skips negative fds, so every other slot keeps its index
+ * while the poll results are walked. compact_fds() closes the gaps before
+ * the next poll.
+ */
+int detach_fd(worker_state *w, int fd) {
+	int slot = find_fd(w, fd);
+	if (slot == -1) {
+		return -1;
+	}
+	w->slot_of[fd] = -1;
+	w->pfds[slot] = (struct pollfd){ .fd = -1, .events = 0, .revents = 0 };
+	free(w->conns[slot].head);
+	w->conns[slot] = (conn_state){0};
+	w->detached++;
+	return 0;
+}
+
+// Fills the gaps left by detach_fd() with the slots from the end
+void compact_fds(worker_state *w) {
+	int gap = 1;
+	while (w->detached > 0) {
+		int last = w->nfds - 1;
+		if (w->pfds[last].fd != -1) {
+			while (w->pfds[gap].fd != -1) {
+				gap++;
+			}
+			w->pfds[gap] = w->pfds[last];
+			w->conns[gap] = w->conns[last];
+			w->slot_of[w->pfds[gap].fd] = gap;
+		}
+		w->nfds--;
+		w->detached--;
+	}
+}
+
+// Closes a client connection along with whatever the loop runs on it
+void pop_fd(worker_state *w, int fd) {
+	int i = find_fd(w, fd);
+	if (i == -1) {
+		return;
+	}
+	ratelimit_close(w->conns[i].client);
+	if (w->conns[i].h2) {
+		h2_conn_close(w->conns[i].h2);
+	}
+	if (w->conns[i].sse) {
+		sse_unsubscribe(&w->sse, w->conns[i].sse);
+	}
+	tls_handshake_free(w->conns[i].tls);
+	detach_fd(w, fd);
+	close(fd);
+}
+
+/*
+ * Runs on the file pool: the handlers open, stat and read files, which may
+ * block on a cold page cache. Bodies that take the client's time to send
+ * are left to finish_http_task().
+ */
+void run_http_task(aio_task *task) {
+	http_task *t = (http_task *)task;
+	TRACE_MARK(&t->request.trace, HANDLER);
+	if (t->limited) {
+		handle_too_many_requests(&t->request, &t->response);
+	} else if (t->overloaded) {
+		handle_service_unavailable(&t->request, &t->response);
+	} else {
+		dispatch_request(&t->request, &t->response);
+	}
+	TRACE_MARK(&t->request.trace, DISPATCH);
+}
+
+// Runs on the socket pool: streamed and file bodies
+void send_http_task(aio_task *task) {
+	http_task *t = (http_task *)task;
+	http_response_send(t->fd, &t->response);
+	TRACE_MARK(&t->request.trace, WRITE);
+	t->sent = 1;
+}
+
+// Runs on the socket pool: requests with a body, which the handler reads
+void run_body_task(aio_task *task) {
+	run_http_task(task);
+	send_http_task(task);
+}
+
+void finish_http_task(aio_task *task);
+
+/*
+ * Hands the rest of the request to the socket pool, -1 if its queue is
+ * full. The socket is non-blocking from here on, so every read and write
+ * waits in poll() and gives up at the deadline.
+ */
+int submit_socket_task(http_task *t, void (*work)(aio_task *)) {
+	fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+	long long deadline = tcp_now() + socket_deadline;
+	t->request.deadline = deadline;
+	t->response.deadline = deadline;
+	t->task.work = work;
+	t->task.done = finish_http_task;
+	return aio_pool_submit(&socket_pool, &t->task);
+}
+
+void finish_http_task(aio_task *task) {
+	http_task *t = (http_task *)task;
+	if (!t->sent && (t->response.stream || t->response.file)) {
+		if (submit_socket_task(t, send_http_task) == 0) {
 			return;
 		}
+		free_http_response(&t->response);
+		t->response = (http_response){0};
+		handle_service_unavailable(&t->request, &t->response);
+	}
+	if (!t->sent) {
+		http_response_send(t->fd, &t->response);
+		TRACE_MARK(&t->request.trace, WRITE);
 	}
+	trace_finish(&t->request.trace, t->request.request.request_target);
+	free_http_request(&t->request);
+	free_http_response(&t->response);
+	close(t->fd);
+	ratelimit_close(t->client);
+	free(t);
 }
 
-int handle_http_request(int fd) {
-	char buf[READ_BUF];
-	int size = 0;
-	int nbytes;
-	char tmp[512];
-	while ((nbytes = read(fd, tmp, sizeof(tmp))) > 0) {
-		if ((size + nbytes) > READ_BUF - 1) { // leave space for null-termination
-			errno = ENOMEM;
-			return -1;
+void complete_tasks(worker_state *w) {
+	aio_task *task = aio_cq_drain(&w->cq);
+	while (task) {
+		aio_task *next = task->next;
+		task->done(task);
+		task = next;
+	}
+}
+
+/*
+ * Writes what the HTTP/2 connection has queued and waits for POLLOUT if the
+ * socket can't take all of it. Closes the connection once it is finished.
+ */
+void flush_h2(h2_conn *conn, worker_state *w) {
+	int fd = conn->fd;
+	int i = find_fd(w, fd);
+	if (i == -1) {
+		return;
+	}
+	int status = h2_conn_flush(conn);
+	if (status == -1 || h2_conn_finished(conn)) {
+		pop_fd(w, fd);
+		return;
+	}
+	w->pfds[i].events = POLLIN | (status == 1 ? POLLOUT : 0);
+}
+
+void run_h2_task(aio_task *task) {
+	h2_task *t = (h2_task *)task;
+	TRACE_MARK(&t->stream->request.trace, HANDLER);
+	if (t->limited) {
+		handle_too_many_requests(&t->stream->request, &t->stream->response);
+	} else if (t->overloaded) {
+		handle_service_unavailable(&t->stream->request, &t->stream->response);
+	} else {
+		dispatch_request(&t->stream->request, &t->stream->response);
+	}
+	h2_response_body(&t->stream->response, &t->stream->data);
+	TRACE_MARK(&t->stream->request.trace, DISPATCH);
+}
+
+void finish_h2_task(aio_task *task) {
+	h2_task *t = (h2_task *)task;
+	// the body goes out as flow control allows, the trace ends once it's queued
+	trace_finish(&t->stream->request.trace, t->stream->request.request.request_target);
+	if (h2_stream_respond(t->conn, t->stream) == 0) {
+		flush_h2(t->conn, t->worker);
+	}
+	free(t);
+}
+
+void dispatch_h2_stream(h2_conn *conn, h2_stream *stream, void *ctx) {
+	worker_state *w = ctx;
+	TRACE_MARK(&stream->request.trace, PARSE);
+	int slot = find_fd(w, conn->fd);
+	h2_task *t = slot == -1 ? NULL : calloc(1, sizeof(h2_task));
+	if (!t) {
+		// out of memory, or the connection already left the poll set
+		h2_stream_abort(conn, stream);
+		return;
+	}
+	t->worker = w;
+	t->limited = !ratelimit_request(w->conns[slot].client);
+	t->conn = conn;
+	t->stream = stream;
+	t->task.work = run_h2_task;
+	t->task.done = finish_h2_task;
+	t->task.cq = &w->cq;
+	// proxied streams wait on the upstream, the rest only on files
+	const route *match = t->limited ? NULL : find_route(&stream->request);
+	if (match && match->type == ROUTE_PROXY && aio_pool_submit(&socket_pool, &t->task) == 0) {
+		return;
+	}
+	t->overloaded = match && match->type == ROUTE_PROXY;
+	aio_pool_submit(&file_pool, &t->task);
+}
+
+void handle_h2_events(int slot, worker_state *w) {
+	int fd = w->pfds[slot].fd;
+	short revents = w->pfds[slot].revents;
+	h2_conn *conn = w->conns[slot].h2;
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		unsigned char buf[H2_READ_BUF];
+		ssize_t nbytes = read(fd, buf, sizeof(buf));
+		if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EINTR)) {
+			pop_fd(w, fd);
+			return;
 		}
-		memcpy(buf + size, tmp, nbytes);
-		size += nbytes;
-		buf[size] = '\0';
+		if (nbytes > 0) {
+			h2_conn_feed(conn, buf, nbytes);
+		}
+	}
+	flush_h2(conn, w);
+}
+
+/*
+ * Switches the connection to HTTP/2, either because the client sent the
+ * connection preface right away or because it asked for "Upgrade: h2c".
+ * NULL if that failed; nothing was sent on an upgrade then, so the request
+ * can still be answered over HTTP/1.1.
+ */
+h2_conn *start_h2(http_task *t, int size, worker_state *w) {
+	int fd = t->fd;
+	int upgrade = !h2_is_preface(t->buf, size);
+	h2_conn *conn = h2_conn_new(fd, dispatch_h2_stream, w);
+	if (!conn) {
+		return NULL;
+	}
+	if (upgrade) {
+		if (h2_conn_upgrade(conn, &t->request) == -1) {
+			h2_conn_close(conn);
+			return NULL;
+		}
+		// a failed write shows up as an error when the connection is flushed
+		const char *response = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+		if (write(fd, response, strlen(response)) == -1) {
+			perror("write");
+		}
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (upgrade) {
+		if (t->request.body_len > 0) {
+			h2_conn_feed(conn, (unsigned char *)t->request.body, t->request.body_len);
+		}
+	} else {
+		h2_conn_feed(conn, (unsigned char *)t->buf, size);
+	}
+	return conn;
+}
+
+int has_body(http_request *request) {
+	const char *content_length = http_get_header(request, "Content-Length");
+	return http_get_header(request, "Transfer-Encoding") || (content_length && strcmp(content_length, "0") != 0);
+}
+
+int wants_h2_upgrade(http_request *request) {
+	const char *upgrade = http_get_header(request, "Upgrade");
+	if (!upgrade || strcasecmp(upgrade, "h2c") != 0) {
+		return 0;
+	}
+	// requests with a body stay on HTTP/1.1
+	return !has_body(request);
+}
 
+/*
+ * Brings the poll set in line with what the proxy session waits for and
+ * tears it down once the exchange is over.
+ */
+void sync_proxy(proxy_session *session, worker_state *w, int finished) {
+	int client_fd = proxy_session_client_fd(session);
+	int upstream_fd = proxy_session_upstream_fd(session);
+	if (upstream_fd != -1 && (finished || proxy_session_upstream_done(session))) {
+		detach_fd(w, upstream_fd);
+		proxy_session_release_upstream(session);
+		upstream_fd = -1;
+	}
+	if (finished) {
+		pop_fd(w, client_fd);
+		proxy_session_free(session);
+		return;
+	}
+	w->pfds[find_fd(w, client_fd)].events = proxy_session_client_events(session);
+	if (upstream_fd != -1) {
+		w->pfds[find_fd(w, upstream_fd)].events = proxy_session_upstream_events(session);
+	}
+}
 
-		if (strstr(buf, "\r\n\r\n") != NULL) {
-			break;
+void start_proxy(proxy_session *session, int slot, worker_state *w) {
+	w->conns[slot].proxy = session;
+	int upstream_fd = proxy_session_upstream_fd(session);
+	if (upstream_fd != -1) {
+		if (reserve_slots(w, 1) == -1) {
+			sync_proxy(session, w, 1);
+			return;
 		}
+		int upstream = add_fd(w, upstream_fd);
+		w->conns[upstream] = (conn_state){ .proxy = session, .upstream = 1 };
 	}
+	sync_proxy(session, w, 0);
+}
 
-	http_request request;
-	parse_http_request(buf, &request);
-	
-	http_response response;
-	dispatch_request(&request, &response);
+void handle_proxy_events(int slot, worker_state *w) {
+	proxy_session *session = w->conns[slot].proxy;
+	short revents = w->pfds[slot].revents;
+	int finished = w->conns[slot].upstream
+		? proxy_session_on_upstream(session, revents)
+		: proxy_session_on_client(session, revents);
+	sync_proxy(session, w, finished);
+}
 
-	write(fd, response.start_line, strlen(response.start_line));
-	write(fd, "\r\n", 2);
+void wake_worker(void *ctx) {
+	worker_state *w = ctx;
+	aio_cq_wake(&w->cq);
+}
 
-	for (size_t i = 0; i < response.headers.count; i++) {
-		
-		write(fd, response.headers.headers[i].key, strlen(response.headers.headers[i].key));
-		write(fd, ": ", 2);
-		write(fd, response.headers.headers[i].value, strlen(response.headers.headers[i].value));
-		write(fd, "\r\n", 2);	
-	}
-	write(fd, "\r\n", 2);
-	write(fd, response.resp_body, strlen(response.resp_body));
-	free_http_request(&request);
-	free_http_response(&response);
+// Called by the worker's sse hub, events 0 means the subscriber was dropped
+void update_subscriber(void *ctx, int fd, short events) {
+	worker_state *w = ctx;
+	if (events == 0) {
+		// the hub is done with the subscriber already
+		w->conns[find_fd(w, fd)].sse = NULL;
+		pop_fd(w, fd);
+		return;
+	}
+	w->pfds[find_fd(w, fd)].events = events;
+}
+
+/*
+ * Reads what arrived of the request head without blocking, the head is
+ * collected in state until it is complete. Returns 1 once it is, 0 if more
+ * has to arrive and -1 on errors or if the peer closed.
+ */
+int read_head(int fd, conn_state *state) {
+	if (!state->head) {
+		state->head = malloc(READ_BUF);
+		if (!state->head) {
+			return -1;
+		}
+	}
+	// leave space for null-termination
+	ssize_t nbytes = recv(fd, state->head + state->head_len, READ_BUF - 1 - state->head_len, MSG_DONTWAIT);
+	if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	if (nbytes <= 0) {
+		return -1;
+	}
+	state->head_len += nbytes;
+	state->head[state->head_len] = '\0';
+
+	// the HTTP/2 preface has a blank line of its own, wait for all of it
+	if (h2_is_preface(state->head, state->head_len)) {
+		return state->head_len >= H2_PREFACE_LEN;
+	}
+	if (strstr(state->head, "\r\n\r\n") != NULL) {
+		return 1;
+	}
+	if (state->head_len == READ_BUF - 1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads and parses a request head. Returns 0 once the request is handed to
+ * the aio pool, 1 if the connection switched to HTTP/2 (*h2 is set), 2 if
+ * the request is proxied by the event loop (*proxy is set), 3 if the
+ * connection subscribed to the event stream (*sse is set), 4 while the
+ * head is incomplete and -1 on errors. state points into w->conns, which
+ * stays put because nothing in here adds a slot.
+ */
+int handle_http_request(int fd, worker_state *w, conn_state *state, h2_conn **h2, proxy_session **proxy, sse_subscriber **sse) {
+	int status = read_head(fd, state);
+	if (status != 1) {
+		return status == 0 ? 4 : -1;
+	}
+	http_task *t = calloc(1, sizeof(http_task));
+	if (!t) {
+		return -1;
+	}
+	char *buf = t->buf;
+	int size = state->head_len;
+	memcpy(buf, state->head, size + 1);
+	free(state->head);
+	state->head = NULL;
+	state->head_len = 0;
+
+	t->fd = fd;
+	t->client = state->client;
+	TRACE_MARK_AT(&t->request.trace, ACCEPT, state->accepted);
+	TRACE_MARK_AT(&t->request.trace, DEQUEUE, state->dequeued);
+	TRACE_MARK(&t->request.trace, READ);
+	if (h2_is_preface(buf, size)) {
+		*h2 = start_h2(t, size, w);
+		free(t);
+		return *h2 ? 1 : -1;
+	}
+
+	parse_http_request(buf, &t->request);
+	t->request.fd = fd;
+	if (t->request.body) {
+		t->request.body_len = size - (t->request.body - buf);
+	}
+	TRACE_MARK(&t->request.trace, PARSE);
+	t->limited = !ratelimit_request(state->client);
+
+	if (!t->limited && wants_h2_upgrade(&t->request)) {
+		*h2 = start_h2(t, size, w);
+		if (*h2) {
+			free_http_request(&t->request);
+			free(t);
+			return 1;
+		}
+		// the upgrade couldn't be set up, the request is answered over HTTP/1.1
+	}
+
+	const route *match = t->limited ? NULL : find_route(&t->request);
+	if (match && match->type == ROUTE_PROXY) {
+		*proxy = proxy_session_new(&t->request, fd);
+		free_http_request(&t->request);
+		free(t);
+		return *proxy ? 2 : -1;
+	}
+	if (match && match->type == ROUTE_EVENTS) {
+		*sse = sse_subscribe(&w->sse, fd);
+		free_http_request(&t->request);
+		free(t);
+		return *sse ? 3 : -1;
+	}
+
+	t->task.cq = &w->cq;
+	if (!t->limited && has_body(&t->request)) {
+		if (submit_socket_task(t, run_body_task) == 0) {
+			return 0;
+		}
+		t->overloaded = 1;
+	}
+	t->task.work = run_http_task;
+	t->task.done = finish_http_task;
+	aio_pool_submit(&file_pool, &t->task);
 	return 0;
 }
 
+/*
+ * Advances the TLS handshake on the slot. Once it is done the connection
+ * carries plaintext, on the same fd with kTLS or on the relay's end of a
+ * socketpair, which takes over the slot.
+ */
+void handle_tls_events(int slot, worker_state *w) {
+	int fd = w->pfds[slot].fd;
+	short events = 0;
+	int plain_fd = -1;
+	int status = tls_handshake_step(w->conns[slot].tls, &events, &plain_fd);
+	if (status == 0) {
+		w->pfds[slot].events = events;
+		return;
+	}
+	if (status == -1) {
+		pop_fd(w, fd);
+		return;
+	}
+	tls_handshake_free(w->conns[slot].tls);
+	w->conns[slot].tls = NULL;
+	w->pfds[slot].events = POLLIN;
+	if (plain_fd != fd) {
+		// the relay owns fd now
+		conn_state state = w->conns[slot];
+		detach_fd(w, fd);
+		int plain = add_fd(w, plain_fd);
+		if (plain != -1) {
+			w->conns[plain] = state;
+		} else {
+			ratelimit_close(state.client);
+		}
+	}
+}
+
+/*
+ * Closes connections whose TLS handshake ran out of time, gives proxy
+ * sessions their deadlines and sends the sse heartbeat, every POLL_TIMEOUT
+ */
+void expire_conns(worker_state *w) {
+	long long now = tcp_now();
+	if (now < w->next_sweep) {
+		return;
+	}
+	w->next_sweep = now + POLL_TIMEOUT;
+	for (int i = 1; i < w->nfds; i++) {
+		if (w->conns[i].tls && now >= tls_handshake_deadline(w->conns[i].tls)) {
+			pop_fd(w, w->pfds[i].fd);
+		} else if (w->conns[i].proxy && !w->conns[i].upstream) {
+			proxy_session *session = w->conns[i].proxy;
+			sync_proxy(session, w, proxy_session_check(session, now));
+		}
+	}
+	sse_hub_heartbeat(&w->sse, now);
+}
+
+void accept_client(queued_conn conn, worker_state *w) {
+	int slot = add_fd(w, conn.fd);
+	if (slot == -1) {
+		ratelimit_close(conn.client);
+		return;
+	}
+	// admission_now() reads the same clock, in us
+	w->conns[slot].accepted = conn.enqueued * 1000;
+	w->conns[slot].dequeued = trace_now();
+	w->conns[slot].client = conn.client;
+	if (tls_enabled()) {
+		// the handshake is driven by the loop like any other I/O
+		w->conns[slot].tls = tls_handshake_new(conn.fd);
+		if (!w->conns[slot].tls) {
+			pop_fd(w, conn.fd);
+		}
+	}
+}
+
 void *handle_request(void *arg) {
-	int id = *(int *)arg;
+	worker_state *w = arg;
+
+	// slot 0 is the completion queue of the aio pool
+	w->pfds[0].fd = w->cq.efd;
+	w->pfds[0].events = POLLIN;
+	w->nfds = 1;
+
 	while (1) {
-		int fd;
+		compact_fds(w);
+
+		queued_conn conn = { -1, 0, 0 };
+		int shed = 0;
 		pthread_mutex_lock(&lock);
 		if (buf_size != 0) {
+			conn = fd_buf[buf_head];
+			buf_head = (buf_head + 1) % MAX_CLIENTS;
 			buf_size--;
-			fd = fd_buf[buf_size];
-			add_fd(fd, id);
+			shed = admission_should_shed(&admission, conn.enqueued, admission_now());
 		}
 		pthread_mutex_unlock(&lock);
+		if (shed) {
+			admission_reject(conn.fd);
+			ratelimit_close(conn.client);
+		} else if (conn.fd != -1) {
+			accept_client(conn, w);
+		}
 
 		
-		int polled = poll(clientpfds[id], nfds[id], POLL_TIMEOUT);
+		int polled = poll(w->pfds, w->nfds, POLL_TIMEOUT);
 		if (polled == -1) {
             		perror("Failed to poll.");
             		continue;
         	}
-		for (int i = 0; i < nfds[id]; i++) {
-			if (clientpfds[id][i].revents & POLLIN) {
-				printf("worker: %d request picked up\n", id);
-				if (handle_http_request(clientpfds[id][i].fd) == 0) {
-					pop_fd(clientpfds[id][i].fd, id);
+		if (w->pfds[0].revents & POLLIN) {
+			complete_tasks(w);
+		}
+		sse_hub_deliver(&w->sse);
+		// slots detached below stay where they are until the next compact_fds()
+		expire_conns(w);
+		for (int i = 1; i < w->nfds; i++) {
+			if (w->conns[i].tls) {
+				if (w->pfds[i].revents) {
+					handle_tls_events(i, w);
+				}
+			}
+			else if (w->conns[i].h2 && w->pfds[i].revents) {
+				handle_h2_events(i, w);
+			}
+			else if (w->conns[i].proxy) {
+				if (w->pfds[i].revents) {
+					handle_proxy_events(i, w);
+				}
+			}
+			else if (w->conns[i].sse) {
+				if (w->pfds[i].revents) {
+					sse_on_events(&w->sse, w->conns[i].sse, w->pfds[i].revents);
 				}
-				printf("worker: %d request handled successfully\n", id);
 			}
-			else if (clientpfds[id][i].revents & (POLLHUP | POLLERR)) {
-				printf("worker: %d client disconnected. Clean up\n", id);
-				pop_fd(clientpfds[id][i].fd, id);
-				printf("worker: %d cleaned up successfully\n", id);
+			else if (w->pfds[i].revents & POLLIN) {
+				int client_fd = w->pfds[i].fd;
+				h2_conn *h2 = NULL;
+				proxy_session *proxy = NULL;
+				sse_subscriber *sse = NULL;
+				printf("worker: %d request picked up\n", w->id);
+				int status = handle_http_request(client_fd, w, &w->conns[i], &h2, &proxy, &sse);
+				if (status == 0) {
+					// parked until the aio pool posts the request back
+					detach_fd(w, client_fd);
+				} else if (status == 1) {
+					w->conns[i].h2 = h2;
+					flush_h2(h2, w);
+				} else if (status == 2) {
+					start_proxy(proxy, i, w);
+				} else if (status == 3) {
+					w->conns[i].sse = sse;
+				} else if (status == 4) {
+					// the rest of the head is still on its way
+				} else {
+					pop_fd(w, client_fd);
+				}
+				printf("worker: %d request handled\n", w->id);
+			}
+			else if (w->pfds[i].revents & (POLLHUP | POLLERR)) {
+				printf("worker: %d client disconnected. Clean up\n", w->id);
+				pop_fd(w, w->pfds[i].fd);
+				printf("worker: %d cleaned up successfully\n", w->id);
 			}
 		}
 
 	}
 }
 
+/*
+ * One allocation for all workers and their first POLL_FDS_INITIAL slots,
+ * aligned to and rounded up to a huge page so the kernel can back the
+ * poll sets with a single TLB entry until one of them has to grow.
+ */
+worker_state *alloc_workers(int n) {
+	size_t slots = POLL_FDS_INITIAL * (sizeof(struct pollfd) + sizeof(conn_state));
+	size_t size = (n * (sizeof(worker_state) + slots) + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+	worker_state *w = aligned_alloc(HUGE_PAGE, size);
+	if (!w) {
+		perror("aligned_alloc");
+		return NULL;
+	}
+	// only a hint, transparent huge pages may be off
+	madvise(w, size, MADV_HUGEPAGE);
+	memset(w, 0, size);
+	struct pollfd *pfds = (struct pollfd *)(w + n);
+	conn_state *conns = (conn_state *)(pfds + n * POLL_FDS_INITIAL);
+	for (int i = 0; i < n; i++) {
+		w[i].id = i;
+		w[i].pfds = pfds + i * POLL_FDS_INITIAL;
+		w[i].conns = conns + i * POLL_FDS_INITIAL;
+		w[i].cap = POLL_FDS_INITIAL;
+		if (aio_cq_init(&w[i].cq) == -1 || sse_hub_init(&w[i].sse, wake_worker, update_subscriber, &w[i]) == -1) {
+			return NULL;
+		}
+	}
+	return w;
+}
+
 
 
 
 int main() {
 	pthread_t thread_ids[NUM_THREADS];
 	signal(SIGPIPE, SIG_IGN);
-	
-	for (int i = 0; i < NUM_THREADS; i++) {
-		thread_indices[i] = i;
-		pthread_create(&thread_ids[i], NULL, handle_request, &thread_indices[i]); 
+	admission_init(&admission);
+	tcp_init();
+	trace_init();
+	int next_worker = 0;
+
+	if (static_pack_open(HTTP_STATIC_PACK) == -1) {
+		printf("no static pack, serving %s from disk\n", HTTP_STATIC_DIR);
 	}
-	
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd == -1) {
-		perror("socket");
+
+	if (tls_init(1) == -1 || proxy_init() == -1 || ratelimit_init() == -1) {
 		exit(1);
 	}
-	struct sockaddr_in address = {0};
-	address.sin_family = AF_INET;
-	address.sin_port = htons(8080);
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	int opt = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-		perror("setsockopt SO_REUSEADDR");
+
+	socket_deadline = config_int("HTTP_SOCKET_DEADLINE_MS", SOCKET_DEADLINE_MS);
+	if (socket_deadline < 1) socket_deadline = 1;
+	int socket_threads = config_int("HTTP_SOCKET_THREADS", SOCKET_THREADS);
+	if (socket_threads < 1) socket_threads = 1;
+	if (aio_pool_init(&file_pool, AIO_THREADS, 0) == -1 || aio_pool_init(&socket_pool, socket_threads, SOCKET_QUEUE) == -1) {
 		exit(1);
 	}
-
- 	if (bind(fd, (struct sockaddr *)(&address), sizeof(address)) == -1) {
-		perror("bind");
+	sse_init();
+	workers = alloc_workers(NUM_THREADS);
+	if (!workers) {
 		exit(1);
 	}
-
-	if (listen(fd, BACKLOG) == -1) {
-		perror("listen");
+	
+	for (int i = 0; i < NUM_THREADS; i++) {
+		pthread_create(&thread_ids[i], NULL, handle_request, &workers[i]); 
+	}
+	
+	int fd = tcp_listen(8080, BACKLOG);
+	if (fd == -1) {
 		exit(1);
 	}
 
+	tcp_client clients[ACCEPT_BATCH];
+	ratelimit_key keys[ACCEPT_BATCH];
 	while (1) {
-	
-		struct sockaddr_in client_addr = {0};
-		socklen_t socklen = sizeof(client_addr);
-		int client_fd = accept(fd, (struct sockaddr *)(&client_addr), &socklen);
-		if (client_fd == -1) {
-			perror("accept");
-			continue;
+		int accepted = tcp_accept(fd, clients, ACCEPT_BATCH);
+		for (int i = 0; i < accepted; i++) {
+			keys[i] = ratelimit_client((struct sockaddr *)&clients[i].addr);
+			// counted as open from here until a worker closes it
+			if (!ratelimit_connection(keys[i]) || !ratelimit_open(keys[i])) {
+				ratelimit_reject(clients[i].fd);
+				clients[i].fd = -1;
+			}
 		}
 
+		// the whole batch is queued under one lock, shed connections are
+		// answered once it is released
+		long long now = admission_now();
+		queued_conn shed_conns[ACCEPT_BATCH];
+		int shed = 0;
+		int queued = 0;
 		pthread_mutex_lock(&lock);
-		while (buf_size == MAX_CLIENTS) {
-			pthread_cond_wait(&cond_not_full, &lock);
+		for (int i = 0; i < accepted; i++) {
+			if (clients[i].fd == -1) {
+				continue;
+			}
+			if (buf_size == MAX_CLIENTS) {
+				// shed right away instead of letting the backlog fill up
+				shed_conns[shed++] = (queued_conn){ clients[i].fd, now, keys[i] };
+				continue;
+			}
+			fd_buf[(buf_head + buf_size) % MAX_CLIENTS] = (queued_conn){ clients[i].fd, now, keys[i] };
+			buf_size++;
+			queued++;
+		}
+		if (queued == 1) {
+			pthread_cond_signal(&cond_not_empty);
+		} else if (queued > 1) {
+			pthread_cond_broadcast(&cond_not_empty);
 		}
-
-		fd_buf[buf_size] = client_fd;
-		buf_size++;
-
-		pthread_cond_signal(&cond_not_empty);
 		pthread_mutex_unlock(&lock);
+		// don't leave the connections queued until a worker's poll times out
+		for (int i = 0; i < queued && i < NUM_THREADS; i++) {
+			aio_cq_wake(&workers[next_worker].cq);
+			next_worker = (next_worker + 1) % NUM_THREADS;
+		}
+		for (int i = 0; i < shed; i++) {
+			admission_reject(shed_conns[i].fd);
+			ratelimit_close(shed_conns[i].client);
+		}
 	}
 	
 	for (int i = 0; i < NUM_THREADS; i++) {
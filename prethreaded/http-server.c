@@ -9,23 +9,64 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 
 #include "../http/http-parser.h"
 #include "../http/http-router.h"
+#include "../http/static-pack.h"
+#include "../http/constants.h"
+#include "../http/tls.h"
+#include "../http/admission.h"
+#include "../http/proxy.h"
+#include "../http/trace.h"
+#include "../http/ratelimit.h"
+#include "../http/tcp.h"
+#include "../http/http-handlers.h"
+#include "../http/config.h"
 
 #define BACKLOG 10
+#define ACCEPT_BATCH 64
 #define MAX_CLIENTS 1024
-#define NUM_THREADS 10
 #define READ_BUF 1024
 
+// worker pool bounds, see start_workers()
+#define WORKERS_MIN 4
+#define WORKERS_PER_CORE 64         // workers mostly wait on clients, not on the CPU
+#define WORKER_MEMORY (1024 * 1024) // stack, buffers and socket buffers of a busy worker
+#define WORKER_IDLE_MS 5000
+#define WORKER_IDLE_MIN_MS 100      // a shorter wait would keep idle workers spinning
+#define GROW_WAIT_US 2000           // below the admission target, grow before shedding
+#define GROW_DEPTH 8
+#define REAP_INTERVAL_US 100000
+
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond_not_full = PTHREAD_COND_INITIALIZER;
-pthread_cond_t cond_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cond_not_empty;
+pthread_cond_t cond_backlog;     // wakes manage_pool()
+
+// accepted connections waiting for a worker, a FIFO ring
+typedef struct {
+	int fd;
+	long long enqueued;     // admission_now() at accept
+	ratelimit_key client;
+} queued_conn;
 
-int fd_buf[MAX_CLIENTS];
+queued_conn fd_buf[MAX_CLIENTS];
+int buf_head = 0;
 int buf_size = 0;
+admission_control admission;
+
+// the worker pool, under lock
+int min_workers;
+int max_workers;
+int workers = 0;            // running or starting
+int starting = 0;           // started, not waiting for connections yet
+int idle_workers = 0;       // waiting for a connection
+long long idle_timeout;     // us
+long long last_reap = 0;
 
-int handle_http_request(int fd) {
+void *handle_request(void *arg);
+
+int handle_http_request(int fd, request_trace *trace, ratelimit_key client) {
 	char buf[READ_BUF];
 	int size = 0;
 	int nbytes;
@@ -45,114 +86,310 @@ int handle_http_request(int fd) {
 		}
 	}
 
-	http_request request;
+	http_request request = {0};
+	request.trace = *trace;
+	TRACE_MARK(&request.trace, READ);
 	parse_http_request(buf, &request);
+	request.fd = fd;
+	if (request.body) {
+		request.body_len = size - (request.body - buf);
+	}
+	TRACE_MARK(&request.trace, PARSE);
 	
-	http_response response;
-	dispatch_request(&request, &response);
-
-	write(fd, response.start_line, strlen(response.start_line));
-	write(fd, "\r\n", 2);
-
-	for (size_t i = 0; i < response.headers.count; i++) {
-		
-		write(fd, response.headers.headers[i].key, strlen(response.headers.headers[i].key));
-		write(fd, ": ", 2);
-		write(fd, response.headers.headers[i].value, strlen(response.headers.headers[i].value));
-		write(fd, "\r\n", 2);	
+	http_response response = {0};
+	TRACE_MARK(&request.trace, HANDLER);
+	if (ratelimit_request(client)) {
+		dispatch_request(&request, &response);
+	} else {
+		handle_too_many_requests(&request, &response);
 	}
-	write(fd, "\r\n", 2);
-	write(fd, response.resp_body, strlen(response.resp_body));
+	TRACE_MARK(&request.trace, DISPATCH);
+
+	http_response_send(fd, &response);
+	TRACE_MARK(&request.trace, WRITE);
+	trace_finish(&request.trace, request.request.request_target);
 	free_http_request(&request);
 	free_http_response(&response);
 	return 0;
 }
 
+/*
+ * Called under lock, returns how many workers to add: one for every queued
+ * connection no idle or starting worker will pick up, once the queue either
+ * piled up or its head waited for GROW_WAIT_US.
+ */
+int workers_needed(long long now) {
+	int backlog = buf_size - idle_workers - starting;
+	if (backlog <= 0) {
+		return 0;
+	}
+	if (buf_size < GROW_DEPTH && now - fd_buf[buf_head].enqueued < GROW_WAIT_US) {
+		return 0;
+	}
+	return backlog < max_workers - workers ? backlog : max_workers - workers;
+}
+
+void start_worker(void) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, handle_request, NULL);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		errno = err;
+		perror("pthread_create worker");
+		pthread_mutex_lock(&lock);
+		workers--;
+		starting--;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/*
+ * Grows the pool while connections wait. Sleeps until the accept thread
+ * reports a backlog, then checks every GROW_WAIT_US / 2 until it is gone.
+ */
+void *manage_pool(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	while (1) {
+		if (buf_size <= idle_workers + starting) {
+			pthread_cond_wait(&cond_backlog, &lock);
+		} else {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += GROW_WAIT_US / 2 * 1000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&cond_backlog, &lock, &deadline);
+		}
+
+		int grow = workers_needed(admission_now());
+		if (grow == 0) {
+			continue;
+		}
+		workers += grow;
+		starting += grow;
+		int total = workers;
+		pthread_mutex_unlock(&lock);
+		printf("workers: +%d (%d workers)\n", grow, total);
+		for (int i = 0; i < grow; i++) {
+			start_worker();
+		}
+		pthread_mutex_lock(&lock);
+	}
+	return NULL;
+}
+
+/*
+ * Waits for a connection with the lock held. Returns 0 if the worker was
+ * idle for idle_timeout while the pool is above its minimum, it exits
+ * then. Only one worker is reaped per REAP_INTERVAL_US, so the pool
+ * shrinks gradually after a burst.
+ */
+int wait_for_connection(void) {
+	long long wait = idle_timeout;
+	while (buf_size == 0) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += wait / 1000000;
+		deadline.tv_nsec += (wait % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		idle_workers++;
+		int err = pthread_cond_timedwait(&cond_not_empty, &lock, &deadline);
+		idle_workers--;
+
+		if (err != ETIMEDOUT || workers <= min_workers) {
+			wait = idle_timeout;
+			continue;
+		}
+		long long now = admission_now();
+		if (buf_size == 0 && now - last_reap >= REAP_INTERVAL_US) {
+			workers--;
+			last_reap = now;
+			return 0;
+		}
+		// idle long enough, but another worker was just reaped
+		wait = last_reap + REAP_INTERVAL_US - now;
+		if (wait <= 0) wait = 1000;
+	}
+	return 1;
+}
+
 void *handle_request(void *arg) {
 	(void)arg;
 	pthread_t tid = pthread_self();
 
+	pthread_mutex_lock(&lock);
+	starting--;
+	pthread_mutex_unlock(&lock);
+
 	while (1) {
 		int fd;
-		// condition variable; wait cond_not_empty
-		//
 		pthread_mutex_lock(&lock);
-		while (buf_size == 0) {
-			pthread_cond_wait(&cond_not_empty, &lock);		
+		if (!wait_for_connection()) {
+			int remaining = workers;
+			pthread_mutex_unlock(&lock);
+			printf("worker: %lu idle, exiting (%d workers)\n", (unsigned long)tid, remaining);
+			return NULL;
 		}
 		
+		queued_conn conn = fd_buf[buf_head];
+		buf_head = (buf_head + 1) % MAX_CLIENTS;
 		buf_size--;
-		fd = fd_buf[buf_size];
-
-		pthread_cond_signal(&cond_not_full);
+		int shed = admission_should_shed(&admission, conn.enqueued, admission_now());
 		pthread_mutex_unlock(&lock);
 
+		fd = conn.fd;
+		request_trace trace = {0};
+		// admission_now() reads the same clock, in us
+		TRACE_MARK_AT(&trace, ACCEPT, conn.enqueued * 1000);
+		TRACE_MARK(&trace, DEQUEUE);
+		if (shed) {
+			admission_reject(fd);
+			ratelimit_close(conn.client);
+			continue;
+		}
+
+		fd = tls_accept(fd);
+		if (fd == -1) {
+			ratelimit_close(conn.client);
+			continue;
+		}
+
 		printf("worker: %lu request picked up\n", (unsigned long)tid);
-		handle_http_request(fd);
+		handle_http_request(fd, &trace, conn.client);
 		printf("worker: %lu request handled successfully\n", (unsigned long)tid);
 		shutdown(fd, SHUT_WR);
 		if (close(fd) == -1) {
 			perror("close");
 		}
+		ratelimit_close(conn.client);
 	}
 }
 
-int main() {
-	pthread_t thread_ids[NUM_THREADS];
-	signal(SIGPIPE, SIG_IGN);
-	
-	for (int i = 0; i < NUM_THREADS; i++) {
-		pthread_create(&thread_ids[i], NULL, handle_request, NULL); 
+/*
+ * Sizes the pool from HTTP_WORKERS_MIN and HTTP_WORKERS_MAX, capped by
+ * what the machine can carry: WORKERS_PER_CORE per core and WORKER_MEMORY
+ * per worker out of the available memory. Idle workers above the minimum
+ * exit after HTTP_WORKER_IDLE_MS, at least WORKER_IDLE_MIN_MS.
+ */
+void start_workers(void) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	long long memory = (long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	long cap = (cores > 0 ? cores : 1) * WORKERS_PER_CORE;
+	if (memory > 0 && memory / WORKER_MEMORY < cap) {
+		cap = memory / WORKER_MEMORY;
 	}
-	
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd == -1) {
-		perror("socket");
-		exit(1);
+	if (cap < 1) cap = 1;
+
+	min_workers = config_int("HTTP_WORKERS_MIN", WORKERS_MIN);
+	max_workers = config_int("HTTP_WORKERS_MAX", cap);
+	if (max_workers > cap) {
+		printf("workers: %d is more than this machine can carry, capped at %ld\n", max_workers, cap);
+		max_workers = cap;
 	}
-	struct sockaddr_in address = {0};
-	address.sin_family = AF_INET;
-	address.sin_port = htons(8080);
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	int opt = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-		perror("setsockopt SO_REUSEADDR");
-		exit(1);
+	if (max_workers < 1) max_workers = 1;
+	if (min_workers < 1) min_workers = 1;
+	if (min_workers > max_workers) min_workers = max_workers;
+	int idle_ms = config_int("HTTP_WORKER_IDLE_MS", WORKER_IDLE_MS);
+	if (idle_ms < WORKER_IDLE_MIN_MS) {
+		printf("workers: HTTP_WORKER_IDLE_MS %d is too short, using %d\n", idle_ms, WORKER_IDLE_MIN_MS);
+		idle_ms = WORKER_IDLE_MIN_MS;
 	}
+	idle_timeout = (long long)idle_ms * 1000;
+	printf("workers: %d to %d\n", min_workers, max_workers);
 
- 	if (bind(fd, (struct sockaddr *)(&address), sizeof(address)) == -1) {
-		perror("bind");
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond_not_empty, &attr);
+	pthread_cond_init(&cond_backlog, &attr);
+	pthread_condattr_destroy(&attr);
+
+	workers = min_workers;
+	starting = min_workers;
+	for (int i = 0; i < min_workers; i++) {
+		start_worker();
+	}
+	pthread_t manager;
+	if (pthread_create(&manager, NULL, manage_pool, NULL) != 0) {
+		perror("pthread_create manager");
 		exit(1);
 	}
+}
 
-	if (listen(fd, BACKLOG) == -1) {
-		perror("listen");
+int main() {
+	signal(SIGPIPE, SIG_IGN);
+	admission_init(&admission);
+	tcp_init();
+	trace_init();
+
+	if (static_pack_open(HTTP_STATIC_PACK) == -1) {
+		printf("no static pack, serving %s from disk\n", HTTP_STATIC_DIR);
+	}
+	if (tls_init(0) == -1 || proxy_init() == -1 || ratelimit_init() == -1) {
+		exit(1);
+	}
+	start_workers();
+	
+	int fd = tcp_listen(8080, BACKLOG);
+	if (fd == -1) {
 		exit(1);
 	}
 
+	tcp_client clients[ACCEPT_BATCH];
+	ratelimit_key keys[ACCEPT_BATCH];
 	while (1) {
-	
-		struct sockaddr_in client_addr = {0};
-		socklen_t socklen = sizeof(client_addr);
-		int client_fd = accept(fd, (struct sockaddr *)(&client_addr), &socklen);
-		if (client_fd == -1) {
-			perror("accept");
-			continue;
+		int accepted = tcp_accept(fd, clients, ACCEPT_BATCH);
+		for (int i = 0; i < accepted; i++) {
+			keys[i] = ratelimit_client((struct sockaddr *)&clients[i].addr);
+			// counted as open from here until a worker closes it
+			if (!ratelimit_connection(keys[i]) || !ratelimit_open(keys[i])) {
+				ratelimit_reject(clients[i].fd);
+				clients[i].fd = -1;
+			}
 		}
 
+		// the whole batch is queued under one lock, shed connections are
+		// answered once it is released
+		long long now = admission_now();
+		queued_conn shed_conns[ACCEPT_BATCH];
+		int shed = 0;
+		int queued = 0;
 		pthread_mutex_lock(&lock);
-		while (buf_size == MAX_CLIENTS) {
-			pthread_cond_wait(&cond_not_full, &lock);
+		for (int i = 0; i < accepted; i++) {
+			if (clients[i].fd == -1) {
+				continue;
+			}
+			if (buf_size == MAX_CLIENTS) {
+				// shed right away instead of letting the backlog fill up
+				shed_conns[shed++] = (queued_conn){ clients[i].fd, now, keys[i] };
+				continue;
+			}
+			fd_buf[(buf_head + buf_size) % MAX_CLIENTS] = (queued_conn){ clients[i].fd, now, keys[i] };
+			buf_size++;
+			queued++;
+		}
+		if (queued == 1) {
+			pthread_cond_signal(&cond_not_empty);
+		} else if (queued > 1) {
+			pthread_cond_broadcast(&cond_not_empty);
+		}
+		if (buf_size > idle_workers + starting) {
+			pthread_cond_signal(&cond_backlog);
 		}
-
-		fd_buf[buf_size] = client_fd;
-		buf_size++;
-
-		pthread_cond_signal(&cond_not_empty);
 		pthread_mutex_unlock(&lock);
-	}
-	
-	for (int i = 0; i < NUM_THREADS; i++) {
-	    pthread_join(thread_ids[i], NULL);
+		for (int i = 0; i < shed; i++) {
+			admission_reject(shed_conns[i].fd);
+			ratelimit_close(shed_conns[i].client);
+		}
 	}
 }
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http-parser.h"
+#include "http-body.h"
+
+/*
+ * Stand-in application backend for trying out the proxy routes. Speaks
+ * keep-alive HTTP/1.1 on 127.0.0.1:<port>, one thread per connection:
+ *
+ *   GET  /health          200 ok
+ *   GET  /api/bytes/<n>   n bytes in a chunked body
+ *   GET  /api/close       body delimited by closing the connection
+ *   POST /api/echo        the request body, with Content-Length
+ *   GET  /api/...         a line naming the backend and the target
+ *
+ * Every response carries X-Backend: <port>.
+ *
+ * usage: backend <port>
+ */
+
+#define HEAD_BUF 4096
+#define CHUNK 8192
+
+static int port;
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} buffer;
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t nbytes = write(fd, buf, len);
+		if (nbytes == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+static int collect(const char *chunk, size_t len, void *ctx) {
+	buffer *buf = ctx;
+	if (buf->len + len > buf->cap) {
+		buf->cap = (buf->len + len) * 2;
+		buf->data = realloc(buf->data, buf->cap);
+	}
+	memcpy(buf->data + buf->len, chunk, len);
+	buf->len += len;
+	return 0;
+}
+
+static int respond(int fd, int code, const char *reason, const char *body, size_t len) {
+	char head[256];
+	int head_len = snprintf(head, sizeof(head),
+		"HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nX-Backend: %d\r\n\r\n",
+		code, reason, len, port);
+	if (write_all(fd, head, head_len) == -1) return -1;
+	return write_all(fd, body, len);
+}
+
+static int respond_bytes(int fd, size_t n) {
+	char head[256];
+	int head_len = snprintf(head, sizeof(head),
+		"HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\nX-Backend: %d\r\n\r\n", port);
+	if (write_all(fd, head, head_len) == -1) return -1;
+
+	char chunk[CHUNK];
+	for (size_t i = 0; i < sizeof(chunk); i++) {
+		chunk[i] = 'a' + i % 26;
+	}
+	while (n > 0) {
+		size_t len = n < sizeof(chunk) ? n : sizeof(chunk);
+		char size_line[20];
+		int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+		if (write_all(fd, size_line, size_len) == -1 || write_all(fd, chunk, len) == -1 || write_all(fd, "\r\n", 2) == -1) {
+			return -1;
+		}
+		n -= len;
+	}
+	return write_all(fd, "0\r\n\r\n", 5);
+}
+
+// Returns 1 to keep the connection open.
+static int serve(int fd, http_request *request) {
+	const char *target = request->request.request_target;
+	if (strcmp(target, "/health") == 0) {
+		return respond(fd, 200, "OK", "ok\n", 3) == 0;
+	}
+	if (strncmp(target, "/api/bytes/", 11) == 0) {
+		return respond_bytes(fd, strtoul(target + 11, NULL, 10)) == 0;
+	}
+	if (strcmp(target, "/api/close") == 0) {
+		char reply[128];
+		int len = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nConnection: close\r\nX-Backend: %d\r\n\r\nuntil close\n", port);
+		write_all(fd, reply, len);
+		return 0;
+	}
+	if (strcmp(target, "/api/echo") == 0) {
+		buffer body = {0};
+		int status = http_read_body(request, collect, &body);
+		int keep = status == 0 && respond(fd, 200, "OK", body.data ? body.data : "", body.len) == 0;
+		free(body.data);
+		return keep;
+	}
+	char reply[512];
+	int len = snprintf(reply, sizeof(reply), "backend %d %s\n", port, target);
+	return respond(fd, 200, "OK", reply, len) == 0;
+}
+
+static void *handle_connection(void *arg) {
+	int fd = (int)(long)arg;
+	char buf[HEAD_BUF];
+	while (1) {
+		size_t size = 0;
+		while (!memmem(buf, size, "\r\n\r\n", 4)) {
+			ssize_t nbytes = read(fd, buf + size, sizeof(buf) - 1 - size);
+			if (nbytes <= 0 || size + nbytes >= sizeof(buf) - 1) {
+				close(fd);
+				return NULL;
+			}
+			size += nbytes;
+		}
+		buf[size] = '\0';
+
+		http_request request = {0};
+		parse_http_request(buf, &request);
+		request.fd = fd;
+		if (request.body) {
+			request.body_len = size - (request.body - buf);
+		}
+		int keep = request.request.request_target && serve(fd, &request);
+		free_http_request(&request);
+		if (!keep) break;
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+		return 1;
+	}
+	port = atoi(argv[1]);
+	signal(SIGPIPE, SIG_IGN);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int opt = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	struct sockaddr_in address = {0};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, 128) == -1) {
+		perror("bind");
+		return 1;
+	}
+
+	while (1) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd == -1) {
+			perror("accept");
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, handle_connection, (void *)(long)client_fd) != 0) {
+			close(client_fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
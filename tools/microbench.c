@@ -0,0 +1,571 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "http-parser.h"
+#include "http-router.h"
+#include "http-handlers.h"
+#include "http-response.h"
+#include "constants.h"
+#include "tcp.h"
+
+/*
+ * Microbenchmarks of the shared http/ library: the parser on a corpus of
+ * request heads, route lookup on the server's table and on a large one,
+ * a full dispatch, response serialization, handle_file() with the fd
+ * cache hit and missed, and the socket options of tcp.h over loopback:
+ * a file response with Nagle, with TCP_NODELAY and with MSG_MORE corking,
+ * and a fresh connection with and without TCP Fast Open.
+ *
+ * Every benchmark runs ROUNDS rounds of enough operations to fill
+ * ROUND_CYCLES and reports the median and the fastest round, in TSC
+ * cycles per operation (nanoseconds on machines without a TSC). Results
+ * go to out.json. Given a baseline, every benchmark whose fastest round
+ * got slower than the baseline's by more than the noise threshold
+ * (MICROBENCH_NOISE, percent, default 10) is flagged and the exit status
+ * is 1. The fastest round is compared because interference from other
+ * processes only ever adds cycles. Baselines are only meaningful on the
+ * machine that recorded them: a baseline taken with another timer or on
+ * another CPU model is skipped with a warning. The checked-in baseline is
+ * an example, record your own before comparing.
+ *
+ * Run from the repository root, `make microbench` does it for you and
+ * `make microbench-baseline` records a new baseline.
+ *
+ * usage: microbench <out.json> [baseline.json]
+ */
+
+#define ROUNDS 31
+#define ROUND_CYCLES 2000000ULL
+#define MAX_BENCHES 32
+#define UNCACHED_FILES 2048     // twice what the fd cache holds
+#define NOISE_PERCENT 10
+#define BACKLOG_BENCH 128
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMER "tsc"
+
+static inline unsigned long long cycles(void) {
+	_mm_lfence();
+	unsigned long long t = __rdtsc();
+	_mm_lfence();
+	return t;
+}
+#else
+#include <time.h>
+#define TIMER "ns"
+
+static inline unsigned long long cycles(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+typedef struct {
+	const char *name;
+	void (*run)(void *arg);     // one operation
+	void *arg;
+	void (*setup)(void *arg);   // optional, around the measurement
+	void (*teardown)(void *arg);
+	double median;
+	double min;
+} bench;
+
+static bench benches[MAX_BENCHES];
+static int bench_count = 0;
+
+static void add_bench(const char *name, void (*run)(void *), void *arg) {
+	benches[bench_count++] = (bench){ .name = name, .run = run, .arg = arg };
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void measure(bench *b) {
+	// size a round so that timer overhead and jitter stay small
+	unsigned long iterations = 1;
+	while (1) {
+		unsigned long long start = cycles();
+		for (unsigned long i = 0; i < iterations; i++) {
+			b->run(b->arg);
+		}
+		if (cycles() - start >= ROUND_CYCLES / 4) break;
+		iterations *= 2;
+	}
+	iterations *= 4;
+
+	double per_op[ROUNDS];
+	for (int r = 0; r < ROUNDS; r++) {
+		unsigned long long start = cycles();
+		for (unsigned long i = 0; i < iterations; i++) {
+			b->run(b->arg);
+		}
+		per_op[r] = (double)(cycles() - start) / iterations;
+	}
+	qsort(per_op, ROUNDS, sizeof(double), compare_doubles);
+	b->median = per_op[ROUNDS / 2];
+	b->min = per_op[0];
+}
+
+/* Parser */
+
+static const char *heads[] = {
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: curl/8.7.1\r\n"
+	"Accept: */*\r\n\r\n",
+
+	"GET /docs/getting-started/index.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Referer: https://www.example.com/docs/\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Cookie: session=3f2a9c1e8b7d4f60a1c2e3d4b5a69788; theme=dark; _ga=GA1.1.1234567890.1700000000\r\n"
+	"If-None-Match: \"5d41402abc4b2a76\"\r\n\r\n",
+
+	"POST /uploads/report.csv HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: python-requests/2.31.0\r\n"
+	"Accept: */*\r\n"
+	"Content-Type: text/csv\r\n"
+	"Content-Length: 27\r\n\r\n"
+	"id,name\n1,alpha\n2,beta\n3,c\n",
+
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Connection: Upgrade, HTTP2-Settings\r\n"
+	"Upgrade: h2c\r\n"
+	"HTTP2-Settings: AAMAAABkAARAAAAAAAIAAAAA\r\n\r\n",
+};
+
+static const char *head_names[] = { "parse/curl", "parse/browser", "parse/post", "parse/h2c-upgrade" };
+
+// the parser works in place, so every run parses a fresh copy
+static void run_parse(void *arg) {
+	const char *head = arg;
+	char buf[2048];
+	size_t len = strlen(head);
+	memcpy(buf, head, len + 1);
+	http_request request = {0};
+	parse_http_request(buf, &request);
+	free_http_request(&request);
+}
+
+/* Routing and dispatch */
+
+static int handle_nothing(http_request *request, http_response *response) {
+	(void)request;
+	(void)response;
+	return 0;
+}
+
+#define LARGE_ROUTES 512
+static route large_table[LARGE_ROUTES];
+static char large_paths[LARGE_ROUTES][48];
+
+typedef struct {
+	const route *table;     // NULL for the server's table
+	size_t count;
+	char target[64];
+	http_method method;
+} route_case;
+
+static const route *volatile matched;
+
+static void run_route(void *arg) {
+	route_case *c = arg;
+	http_request request = {0};
+	request.request.method = c->method;
+	request.request.request_target = c->target;
+	matched = c->table ? match_route(c->table, c->count, &request) : find_route(&request);
+}
+
+static void run_dispatch(void *arg) {
+	route_case *c = arg;
+	http_request request = {0};
+	request.request.method = c->method;
+	request.request.request_target = c->target;
+	http_response response = {0};
+	dispatch_request(&request, &response);
+	free_http_response(&response);
+}
+
+/* Responses */
+
+static int null_fd = -1;
+static char small_body[256];
+static char large_body[64 * 1024];
+
+static void run_response(void *arg) {
+	size_t size = (size_t)arg;
+	char length[21];
+	snprintf(length, sizeof(length), "%zu", size);
+	http_response response = {0};
+	response.code = 200;
+	response.start_line = "HTTP/1.1 200 OK";
+	add_http_header(&response, "Content-Length", length);
+	add_http_header(&response, "Content-Type", "text/html");
+	response.body_ref = size > sizeof(small_body) ? large_body : small_body;
+	response.body_size = size;
+	http_response_send(null_fd, &response);
+	free_http_response(&response);
+}
+
+/* Files */
+
+static char file_dir[] = "/tmp/microbench.XXXXXX";
+static char (*uncached_paths)[64];
+
+static void run_file(void *arg) {
+	http_response response = {0};
+	handle_file(NULL, &response, arg);
+	free_http_response(&response);
+}
+
+static void run_file_uncached(void *arg) {
+	static unsigned long next = 0;
+	(void)arg;
+	run_file(uncached_paths[next++ % UNCACHED_FILES]);
+}
+
+static int make_files(void) {
+	if (!mkdtemp(file_dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	uncached_paths = calloc(UNCACHED_FILES, sizeof(*uncached_paths));
+	if (!uncached_paths) {
+		return -1;
+	}
+	for (int i = 0; i < UNCACHED_FILES; i++) {
+		snprintf(uncached_paths[i], sizeof(uncached_paths[i]), "%s/%d.html", file_dir, i);
+		int fd = open(uncached_paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || write(fd, small_body, sizeof(small_body)) == -1) {
+			perror(uncached_paths[i]);
+			return -1;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void remove_files(void) {
+	for (int i = 0; i < UNCACHED_FILES; i++) {
+		unlink(uncached_paths[i]);
+	}
+	rmdir(file_dir);
+}
+
+/* TCP over loopback */
+
+typedef struct {
+	const char *env;            // HTTP_TCP_* settings, "NAME=value NAME=value"
+	int listen_fd;
+	int client;                 // connected pair, for the file responses
+	int server;
+	struct sockaddr_in addr;
+} tcp_case;
+
+static const char tcp_request[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static void apply_env(const char *env) {
+	char settings[256];
+	snprintf(settings, sizeof(settings), "%s", env);
+	for (char *setting = strtok(settings, " "); setting; setting = strtok(NULL, " ")) {
+		putenv(strdup(setting));
+	}
+	tcp_init();
+}
+
+static void setup_tcp(void *arg) {
+	tcp_case *c = arg;
+	apply_env(c->env);
+	c->listen_fd = tcp_listen(0, BACKLOG_BENCH);
+	socklen_t len = sizeof(c->addr);
+	getsockname(c->listen_fd, (struct sockaddr *)&c->addr, &len);
+	c->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	c->client = socket(AF_INET, SOCK_STREAM, 0);
+	connect(c->client, (struct sockaddr *)&c->addr, sizeof(c->addr));
+	// with TCP_DEFER_ACCEPT the connection only shows up once it has data
+	send(c->client, tcp_request, sizeof(tcp_request) - 1, 0);
+	tcp_client accepted;
+	tcp_accept(c->listen_fd, &accepted, 1);
+	c->server = accepted.fd;
+	char buf[256];
+	recv(c->server, buf, sizeof(buf), 0);
+}
+
+static void teardown_tcp(void *arg) {
+	tcp_case *c = arg;
+	close(c->client);
+	close(c->server);
+	close(c->listen_fd);
+	apply_env("HTTP_TCP_NODELAY=1 HTTP_TCP_CORK=1 HTTP_TCP_FASTOPEN=256 HTTP_TCP_DEFER_ACCEPT=1");
+}
+
+static void read_response(int fd, size_t body_len) {
+	char buf[4096];
+	size_t got = 0;
+	char *end = NULL;
+	size_t head_len = 0;
+	while (!end || got < head_len + body_len) {
+		ssize_t nbytes = recv(fd, buf + got, sizeof(buf) - got, 0);
+		if (nbytes <= 0) return;
+		got += nbytes;
+		if (!end && (end = memmem(buf, got, "\r\n\r\n", 4))) {
+			head_len = end + 4 - buf;
+		}
+	}
+}
+
+// A head and a small file sent with sendfile(), as the handlers do for large files
+static void run_tcp_file(void *arg) {
+	tcp_case *c = arg;
+	http_response response = {0};
+	response.start_line = "HTTP/1.1 200 OK";
+	add_http_header(&response, "Content-Type", "text/html");
+	add_http_header(&response, "Content-Length", "256");
+	response.file = fd_cache_acquire(uncached_paths[0]);
+	response.body_size = sizeof(small_body);
+	http_response_send(c->server, &response);
+	free_http_response(&response);
+	read_response(c->client, sizeof(small_body));
+}
+
+// A new connection carrying one request and its response
+static void run_tcp_connect(void *arg) {
+	tcp_case *c = arg;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (strstr(c->env, "HTTP_TCP_FASTOPEN=0")) {
+		connect(fd, (struct sockaddr *)&c->addr, sizeof(c->addr));
+		send(fd, tcp_request, sizeof(tcp_request) - 1, 0);
+	} else {
+		sendto(fd, tcp_request, sizeof(tcp_request) - 1, MSG_FASTOPEN, (struct sockaddr *)&c->addr, sizeof(c->addr));
+	}
+	tcp_client accepted;
+	tcp_accept(c->listen_fd, &accepted, 1);
+	char buf[256];
+	recv(accepted.fd, buf, sizeof(buf), 0);
+	static const char response[] = "HTTP/1.1 204 No Content\r\n\r\n";
+	send(accepted.fd, response, sizeof(response) - 1, 0);
+	read_response(fd, 0);
+	// skip TIME_WAIT, thousands of connections are opened per run
+	struct linger linger = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(fd);
+	close(accepted.fd);
+}
+
+static void add_tcp_bench(const char *name, void (*run)(void *), const char *env) {
+	tcp_case *c = calloc(1, sizeof(tcp_case));
+	c->env = env;
+	add_bench(name, run, c);
+	benches[bench_count - 1].setup = setup_tcp;
+	benches[bench_count - 1].teardown = teardown_tcp;
+}
+
+/* Reporting */
+
+static const char *cpu_model(void) {
+	static char model[128] = "unknown";
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (!cpuinfo) return model;
+	char line[256];
+	while (fgets(line, sizeof(line), cpuinfo)) {
+		char *colon = strchr(line, ':');
+		if (strncmp(line, "model name", 10) == 0 && colon) {
+			snprintf(model, sizeof(model), "%s", colon + 2);
+			model[strcspn(model, "\n\"")] = '\0';
+			break;
+		}
+	}
+	fclose(cpuinfo);
+	return model;
+}
+
+static int write_results(const char *path) {
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return -1;
+	}
+	fprintf(out, "{\n  \"timer\": \"%s\",\n  \"cpu\": \"%s\",\n  \"results\": {\n", TIMER, cpu_model());
+	for (int i = 0; i < bench_count; i++) {
+		fprintf(out, "    \"%s\": {\"median\": %.1f, \"min\": %.1f}%s\n",
+			benches[i].name, benches[i].median, benches[i].min, i + 1 < bench_count ? "," : "");
+	}
+	fprintf(out, "  }\n}\n");
+	fclose(out);
+	return 0;
+}
+
+// Reads the fastest round of name from a file written by write_results(), -1 if it isn't there
+static double baseline_min(FILE *baseline, const char *name) {
+	char line[256];
+	char key[96];
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	rewind(baseline);
+	while (fgets(line, sizeof(line), baseline)) {
+		char *at = strstr(line, key);
+		double median, min;
+		if (at && sscanf(at + strlen(key), " {\"median\": %lf, \"min\": %lf", &median, &min) == 2) {
+			return min;
+		}
+	}
+	return -1;
+}
+
+// Reads a top-level string field, e.g. "timer", into value; "" if it isn't there
+static void baseline_field(FILE *baseline, const char *name, char *value, size_t size) {
+	char line[256];
+	char key[32];
+	snprintf(key, sizeof(key), "\"%s\": \"", name);
+	value[0] = '\0';
+	rewind(baseline);
+	while (fgets(line, sizeof(line), baseline)) {
+		char *at = strstr(line, key);
+		if (at) {
+			at += strlen(key);
+			snprintf(value, size, "%.*s", (int)strcspn(at, "\""), at);
+			return;
+		}
+	}
+}
+
+static int compare(const char *path) {
+	FILE *baseline = fopen(path, "r");
+	if (!baseline) {
+		perror(path);
+		return -1;
+	}
+	// cycle counts from another machine say nothing about this one
+	char timer[16];
+	char cpu[128];
+	baseline_field(baseline, "timer", timer, sizeof(timer));
+	baseline_field(baseline, "cpu", cpu, sizeof(cpu));
+	if (strcmp(timer, TIMER) != 0 || strcmp(cpu, cpu_model()) != 0) {
+		fprintf(stderr, "\nwarning: %s was recorded on \"%s\" (%s), this is \"%s\" (%s); not comparing.\n"
+			"Record a baseline on this machine with `make microbench-baseline`.\n",
+			path, cpu, timer, cpu_model(), TIMER);
+		fclose(baseline);
+		return 0;
+	}
+	const char *noise_env = getenv("MICROBENCH_NOISE");
+	double noise = noise_env ? atof(noise_env) : NOISE_PERCENT;
+
+	int regressions = 0;
+	printf("\n%-24s %12s %12s %8s   (min, noise %.0f%%)\n", "vs baseline", "baseline", "now", "change", noise);
+	for (int i = 0; i < bench_count; i++) {
+		double base = baseline_min(baseline, benches[i].name);
+		if (base <= 0) {
+			printf("%-24s %12s %12.1f\n", benches[i].name, "-", benches[i].min);
+			continue;
+		}
+		double change = (benches[i].min - base) / base * 100;
+		int regressed = change > noise;
+		regressions += regressed;
+		printf("%-24s %12.1f %12.1f %+7.1f%%%s\n", benches[i].name, base, benches[i].min, change,
+			regressed ? "   REGRESSION" : "");
+	}
+	fclose(baseline);
+	return regressions;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <out.json> [baseline.json]\n", argv[0]);
+		return 2;
+	}
+
+	null_fd = open("/dev/null", O_WRONLY);
+	memset(small_body, 'a', sizeof(small_body));
+	memset(large_body, 'b', sizeof(large_body));
+	if (null_fd == -1 || make_files() == -1) {
+		return 2;
+	}
+
+	for (size_t i = 0; i < sizeof(heads) / sizeof(heads[0]); i++) {
+		add_bench(head_names[i], run_parse, (void *)heads[i]);
+	}
+
+	// the server's own table, a hit near the top and the catch-all at the end
+	static route_case small_hit = { NULL, 0, "/favicon.ico", GET };
+	static route_case small_last = { NULL, 0, "/static/app.js", GET };
+	for (int i = 0; i < LARGE_ROUTES; i++) {
+		snprintf(large_paths[i], sizeof(large_paths[i]), "/api/v1/service%d/*", i);
+		large_table[i] = (route){ i % 3 == 0 ? POST : GET, large_paths[i], handle_nothing, ROUTE_HANDLER };
+	}
+	static route_case large_hit = { large_table, LARGE_ROUTES, "", GET };
+	static route_case large_miss = { large_table, LARGE_ROUTES, "/static/app.js", GET };
+	snprintf(large_hit.target, sizeof(large_hit.target), "/api/v1/service%d/items/42", LARGE_ROUTES - 1);
+	add_bench("route/small-hit", run_route, &small_hit);
+	add_bench("route/small-last", run_route, &small_last);
+	add_bench("route/large-last", run_route, &large_hit);
+	add_bench("route/large-miss", run_route, &large_miss);
+
+	static route_case dispatch_index = { NULL, 0, "/", GET };
+	static route_case dispatch_missing = { NULL, 0, "/no/such/file.html", GET };
+	add_bench("dispatch/index", run_dispatch, &dispatch_index);
+	add_bench("dispatch/not-found", run_dispatch, &dispatch_missing);
+
+	add_bench("response/small", run_response, (void *)sizeof(small_body));
+	add_bench("response/64k", run_response, (void *)sizeof(large_body));
+
+	add_bench("file/cached", run_file, INDEX_FILE);
+	add_bench("file/uncached", run_file_uncached, NULL);
+
+	add_tcp_bench("tcp/file-nagle", run_tcp_file, "HTTP_TCP_NODELAY=0 HTTP_TCP_CORK=0");
+	add_tcp_bench("tcp/file-nodelay", run_tcp_file, "HTTP_TCP_NODELAY=1 HTTP_TCP_CORK=0");
+	add_tcp_bench("tcp/file-nodelay-cork", run_tcp_file, "HTTP_TCP_NODELAY=1 HTTP_TCP_CORK=1");
+	add_tcp_bench("tcp/connect", run_tcp_connect, "HTTP_TCP_FASTOPEN=0 HTTP_TCP_DEFER_ACCEPT=0");
+	add_tcp_bench("tcp/connect-fastopen", run_tcp_connect, "HTTP_TCP_FASTOPEN=256 HTTP_TCP_DEFER_ACCEPT=1");
+
+	// the handlers log to stdout, keep that out of the report
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	for (int i = 0; i < bench_count; i++) {
+		dup2(null_fd, STDOUT_FILENO);
+		if (benches[i].setup) benches[i].setup(benches[i].arg);
+		benches[i].run(benches[i].arg);     // warm up
+		measure(&benches[i]);
+		if (benches[i].teardown) benches[i].teardown(benches[i].arg);
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		printf("%-24s %10.1f %s/op (min %.1f)\n", benches[i].name, benches[i].median, TIMER, benches[i].min);
+		fflush(stdout);
+	}
+	remove_files();
+
+	if (write_results(argv[1]) == -1) {
+		return 2;
+	}
+	if (argc == 3) {
+		int regressions = compare(argv[2]);
+		if (regressions != 0) {
+			return regressions > 0 ? 1 : 2;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef PACK_GZIP
+#include <zlib.h>
+#endif
+
+#include "static-pack.h"
+#include "http-handlers.h"
+#include "constants.h"
+
+/*
+ * Packs a static directory into a static pack (see http/static-pack.h).
+ * Files are visited in sorted order and the ETag is a hash of the content,
+ * so the same directory always produces the same pack.
+ *
+ * usage: mkpack <static-dir> <pack-file>
+ */
+
+typedef struct {
+	char *path;         // relative to the static dir
+	char *data;
+	size_t size;
+} asset;
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} buffer;
+
+static asset *assets = NULL;
+static size_t asset_count = 0;
+static size_t asset_cap = 0;
+
+static void *xrealloc(void *ptr, size_t size) {
+	void *tmp = realloc(ptr, size);
+	if (!tmp) {
+		perror("realloc");
+		exit(1);
+	}
+	return tmp;
+}
+
+static static_pack_span buffer_append(buffer *buf, const void *data, size_t len) {
+	// keep every span 8-byte aligned
+	size_t start = (buf->len + 7) & ~(size_t)7;
+	if (start + len > buf->cap) {
+		while (start + len > buf->cap) {
+			buf->cap = buf->cap ? buf->cap * 2 : 65536;
+		}
+		buf->data = xrealloc(buf->data, buf->cap);
+	}
+	memset(buf->data + buf->len, 0, start - buf->len);
+	memcpy(buf->data + start, data, len);
+	buf->len = start + len;
+	return (static_pack_span){ start, len };
+}
+
+static char *read_file(const char *file_name, size_t *size) {
+	FILE *fp = fopen(file_name, "rb");
+	if (!fp) {
+		perror(file_name);
+		exit(1);
+	}
+	struct stat sb;
+	if (fstat(fileno(fp), &sb) == -1) {
+		perror(file_name);
+		exit(1);
+	}
+	char *data = malloc(sb.st_size + 1);
+	if (!data || fread(data, 1, sb.st_size, fp) != (size_t)sb.st_size) {
+		fprintf(stderr, "%s: read failed\n", file_name);
+		exit(1);
+	}
+	fclose(fp);
+	*size = sb.st_size;
+	return data;
+}
+
+static int skip_entry(const struct dirent *entry) {
+	return entry->d_name[0] != '.';
+}
+
+static void collect(const char *dir, const char *rel) {
+	struct dirent **entries;
+	int n = scandir(dir, &entries, skip_entry, alphasort);
+	if (n == -1) {
+		perror(dir);
+		exit(1);
+	}
+	for (int i = 0; i < n; i++) {
+		char file_name[SAFE_PATH_MAX];
+		char rel_name[SAFE_PATH_MAX];
+		snprintf(file_name, sizeof(file_name), "%s/%s", dir, entries[i]->d_name);
+		snprintf(rel_name, sizeof(rel_name), "%s/%s", rel, entries[i]->d_name);
+		free(entries[i]);
+
+		struct stat sb;
+		if (stat(file_name, &sb) == -1) {
+			perror(file_name);
+			exit(1);
+		}
+		if (S_ISDIR(sb.st_mode)) {
+			collect(file_name, rel_name);
+			continue;
+		}
+		if (!S_ISREG(sb.st_mode)) continue;
+
+		if (asset_count == asset_cap) {
+			asset_cap = asset_cap ? asset_cap * 2 : 16;
+			assets = xrealloc(assets, sizeof(asset) * asset_cap);
+		}
+		asset *a = &assets[asset_count++];
+		a->path = strdup(rel_name);
+		a->data = read_file(file_name, &a->size);
+	}
+	free(entries);
+}
+
+#ifdef PACK_GZIP
+// Returns the gzip-compressed data, or NULL when compression doesn't pay off.
+static char *gzip_data(const char *data, size_t size, size_t *out_size) {
+	z_stream zs = {0};
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	size_t cap = deflateBound(&zs, size);
+	char *out = malloc(cap);
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = size;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = cap;
+	int ret = deflate(&zs, Z_FINISH);
+	*out_size = zs.total_out;
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END || *out_size >= size - size / 10) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+#endif
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <static-dir> <pack-file>\n", argv[0]);
+		return 1;
+	}
+
+	collect(argv[1], "");
+
+	uint32_t index_size = 1;
+	while (index_size < asset_count * 2) {
+		index_size *= 2;
+	}
+	static_pack_entry *index = calloc(index_size, sizeof(static_pack_entry));
+	buffer data = {0};
+	uint64_t data_start = sizeof(static_pack_header) + sizeof(static_pack_entry) * index_size;
+
+	for (size_t i = 0; i < asset_count; i++) {
+		asset *a = &assets[i];
+		static_pack_entry e = {0};
+		e.hash = static_pack_hash(a->path, strlen(a->path));
+		e.path = buffer_append(&data, a->path, strlen(a->path));
+
+		char etag[24];
+		snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)static_pack_hash(a->data, a->size));
+		e.etag = buffer_append(&data, etag, strlen(etag));
+
+		char *mime_type = extract_mime_type(a->path);
+		size_t gzip_size = 0;
+		char *gzipped = NULL;
+#ifdef PACK_GZIP
+		gzipped = gzip_data(a->data, a->size, &gzip_size);
+#endif
+		const char *vary = gzipped ? "Vary: Accept-Encoding\r\n" : "";
+
+		char headers[512];
+		int len = snprintf(headers, sizeof(headers),
+			"Content-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\nAccept-Ranges: bytes\r\n%s",
+			a->size, mime_type, etag, vary);
+		e.headers = buffer_append(&data, headers, len);
+		e.body = buffer_append(&data, a->data, a->size);
+
+		if (gzipped) {
+			// the compressed bytes differ, so they get a strong etag of their own
+			char gzip_etag[28];
+			snprintf(gzip_etag, sizeof(gzip_etag), "\"%016llx-gz\"", (unsigned long long)static_pack_hash(a->data, a->size));
+			e.gzip_etag = buffer_append(&data, gzip_etag, strlen(gzip_etag));
+			len = snprintf(headers, sizeof(headers),
+				"Content-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\nContent-Encoding: gzip\r\nAccept-Ranges: bytes\r\n%s",
+				gzip_size, mime_type, gzip_etag, vary);
+			e.gzip_headers = buffer_append(&data, headers, len);
+			e.gzip_body = buffer_append(&data, gzipped, gzip_size);
+			free(gzipped);
+		}
+
+		static_pack_span *spans[] = { &e.path, &e.etag, &e.headers, &e.body, &e.gzip_etag, &e.gzip_headers, &e.gzip_body };
+		for (size_t s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+			if (spans[s]->len > 0) spans[s]->offset += data_start;
+		}
+
+		uint32_t slot = e.hash & (index_size - 1);
+		while (index[slot].hash != 0) {
+			slot = (slot + 1) & (index_size - 1);
+		}
+		index[slot] = e;
+		printf("%s %zu bytes%s\n", a->path, a->size, gzipped ? " (+gzip)" : "");
+	}
+
+	static_pack_header header = {0};
+	memcpy(header.magic, STATIC_PACK_MAGIC, sizeof(header.magic));
+	header.version = STATIC_PACK_VERSION;
+	header.count = asset_count;
+	header.index_size = index_size;
+	header.index_offset = sizeof(static_pack_header);
+
+	// write to a temporary file first so a running server never maps a half-written pack
+	char tmp_name[SAFE_PATH_MAX];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", argv[2]);
+	FILE *out = fopen(tmp_name, "wb");
+	if (!out) {
+		perror(tmp_name);
+		return 1;
+	}
+	if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+	    fwrite(index, sizeof(static_pack_entry), index_size, out) != index_size ||
+	    (data.len > 0 && fwrite(data.data, 1, data.len, out) != data.len) ||
+	    fclose(out) != 0) {
+		perror(tmp_name);
+		return 1;
+	}
+	if (rename(tmp_name, argv[2]) == -1) {
+		perror("rename");
+		return 1;
+	}
+	printf("packed %zu assets into %s\n", asset_count, argv[2]);
+	return 0;
+}